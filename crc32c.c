@@ -0,0 +1,92 @@
+/*
+ * crc32c.c: CRC32C checksums for RUDP packets and VSFTP file digests.
+ */
+
+#include <string.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78			/* Reflected Castagnoli polynomial */
+
+static u_int32_t crc32c_select(u_int32_t crc, const u_int8_t *p, size_t len);
+
+static u_int32_t crc32c_table[8][256];
+static u_int32_t (*crc32c_impl)(u_int32_t, const u_int8_t *, size_t) = crc32c_select;
+
+/*
+ * Software version: slicing-by-8 over 64-bit words, read little endian.
+ */
+static void crc32c_init_table(){
+	u_int32_t c;
+	int i, j;
+	for(i=0; i<256; i++){
+		c = i;
+		for(j=0; j<8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for(i=0; i<256; i++){
+		c = crc32c_table[0][i];
+		for(j=1; j<8; j++){
+			c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+			crc32c_table[j][i] = c;
+		}
+	}
+}
+
+static u_int32_t crc32c_sw(u_int32_t crc, const u_int8_t *p, size_t len){
+	u_int64_t w;
+	while(len >= 8){
+		memcpy(&w, p, 8);
+		w = le64toh(w) ^ crc;
+		crc = crc32c_table[7][w & 0xff] ^
+			crc32c_table[6][(w >> 8) & 0xff] ^
+			crc32c_table[5][(w >> 16) & 0xff] ^
+			crc32c_table[4][(w >> 24) & 0xff] ^
+			crc32c_table[3][(w >> 32) & 0xff] ^
+			crc32c_table[2][(w >> 40) & 0xff] ^
+			crc32c_table[1][(w >> 48) & 0xff] ^
+			crc32c_table[0][w >> 56];
+		p += 8; len -= 8;
+	}
+	while(len-- > 0)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u_int32_t crc32c_hw(u_int32_t crc, const u_int8_t *p, size_t len){
+	u_int64_t c = crc, w;
+	while(len >= 8){
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+		p += 8; len -= 8;
+	}
+	crc = (u_int32_t)c;
+	while(len-- > 0)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+/*
+ * First call: use the crc32 instruction if there is one.
+ */
+static u_int32_t crc32c_select(u_int32_t crc, const u_int8_t *p, size_t len){
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#endif
+	if(crc32c_impl == crc32c_sw)
+		crc32c_init_table();
+	return crc32c_impl(crc, p, len);
+}
+
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len){
+	return ~crc32c_impl(~crc, (const u_int8_t *)buf, len);
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define	CRC32C_H
+
+#include <sys/types.h>
+
+/*
+ * CRC32C (Castagnoli). Streaming: start with crc = 0 and feed the
+ * returned value back in for the next block. Uses the SSE4.2 crc32
+ * instruction when the CPU has it, otherwise a table driven loop.
+ */
+
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H */
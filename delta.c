@@ -0,0 +1,139 @@
+/*
+ * delta.c: checksums for rsync-style delta transfers.
+ * The receiver signs each block of its old copy with a weak rolling
+ * checksum and a strong hash; the sender slides a block-sized window over
+ * the new file, one byte at a time, and looks the weak checksum up in the
+ * signatures. Whole-block sums are needed after every match, so they are
+ * computed with SIMD kernels.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "delta.h"
+
+#define DELTA_MINBLOCK	1024		/* Smallest block size */
+#define DELTA_MAXBLOCK	(128*1024)	/* Largest block size */
+
+static void delta_sums_select(const void *buf, int len, u_int32_t *s1, u_int32_t *s2);
+
+static void (*delta_sums_impl)(const void *, int, u_int32_t *, u_int32_t *) = delta_sums_select;
+
+/*
+ * Portable version: s1 += byte, s2 += s1 for every byte.
+ */
+static void delta_sums_generic(const void *buf, int len, u_int32_t *s1, u_int32_t *s2){
+	const u_int8_t* b = (const u_int8_t*)buf;
+	u_int32_t a = *s1, c = *s2;
+	while(len-- > 0){
+		a += *b++;
+		c += a;
+	}
+	*s1 = a;
+	*s2 = c;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * For a chunk of n bytes appended to the block, s2 grows by n times the
+ * old s1 plus the sum of (n-k) * byte k. The byte sums come from psadbw,
+ * the weighted sums from pmaddubsw; both are kept per lane and folded at
+ * the end.
+ */
+__attribute__((target("ssse3")))
+static void delta_sums_ssse3(const void *buf, int len, u_int32_t *s1, u_int32_t *s2){
+	const u_int8_t* b = (const u_int8_t*)buf;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	__m128i vs1 = zero, vs2 = zero, v;
+	u_int32_t a[4], c[4];
+	while(len >= 16){
+		v = _mm_loadu_si128((const __m128i*)b);
+		vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vs1, 4));
+		vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+		vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(v, weights), ones));
+		b += 16; len -= 16;
+	}
+	_mm_storeu_si128((__m128i*)a, vs1);
+	_mm_storeu_si128((__m128i*)c, vs2);
+	*s2 += ((u_int32_t)(b - (const u_int8_t*)buf)) * *s1 + c[0] + c[1] + c[2] + c[3];
+	*s1 += a[0] + a[1] + a[2] + a[3];
+	delta_sums_generic(b, len, s1, s2);
+}
+
+__attribute__((target("avx2")))
+static void delta_sums_avx2(const void *buf, int len, u_int32_t *s1, u_int32_t *s2){
+	const u_int8_t* b = (const u_int8_t*)buf;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	__m256i vs1 = zero, vs2 = zero, v;
+	u_int32_t a[8], c[8];
+	int i;
+	while(len >= 32){
+		v = _mm256_loadu_si256((const __m256i*)b);
+		vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vs1, 5));
+		vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+		vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+		b += 32; len -= 32;
+	}
+	_mm256_storeu_si256((__m256i*)a, vs1);
+	_mm256_storeu_si256((__m256i*)c, vs2);
+	*s2 += ((u_int32_t)(b - (const u_int8_t*)buf)) * *s1;
+	for(i = 0; i < 8; i++){
+		*s1 += a[i];
+		*s2 += c[i];
+	}
+	delta_sums_generic(b, len, s1, s2);
+}
+#endif
+
+/*
+ * First call: pick the widest kernel the CPU supports.
+ */
+static void delta_sums_select(const void *buf, int len, u_int32_t *s1, u_int32_t *s2){
+	delta_sums_impl = delta_sums_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		delta_sums_impl = delta_sums_avx2;
+	else if(__builtin_cpu_supports("ssse3"))
+		delta_sums_impl = delta_sums_ssse3;
+#endif
+	delta_sums_impl(buf, len, s1, s2);
+}
+
+/*
+ * delta_sums: weak checksum sums of a block, starting from zero.
+ */
+void delta_sums(const void *buf, int len, u_int32_t *s1, u_int32_t *s2){
+	*s1 = 0;
+	*s2 = 0;
+	delta_sums_impl(buf, len, s1, s2);
+}
+
+u_int64_t delta_strong(const void *buf, int len){
+	const u_int8_t* b = (const u_int8_t*)buf;
+	u_int64_t h = 0xcbf29ce484222325ULL;
+	while(len-- > 0){
+		h ^= *b++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * delta_blocksize: about the square root of the file size, as rsync does,
+ * which balances signature traffic against literal data per change.
+ */
+u_int32_t delta_blocksize(u_int64_t size){
+	u_int32_t bs = DELTA_MINBLOCK;
+	while(bs < DELTA_MAXBLOCK && (u_int64_t)bs * bs < size)
+		bs *= 2;
+	return bs;
+}
@@ -0,0 +1,25 @@
+#ifndef DELTA_H
+#define	DELTA_H
+
+/*
+ * Block signatures for rsync-style delta transfers.
+ * The weak checksum is the rsync rolling checksum: s1 is the sum of the
+ * bytes of a block and s2 the sum of the running s1, both kept modulo
+ * 2^16. delta_sums computes both for a whole block (SSSE3 or AVX2 when
+ * the CPU supports it); delta_roll slides the block one byte forward.
+ * The strong hash is a 64-bit FNV-1a, checked only when the weak
+ * checksums match.
+ */
+
+#define DELTA_WEAK(s1, s2)	(((s1) & 0xffff) | ((s2) << 16))
+
+static inline void delta_roll(u_int32_t *s1, u_int32_t *s2, u_int8_t out, u_int8_t in, u_int32_t len){
+	*s1 = *s1 - out + in;
+	*s2 = *s2 - len * out + *s1;
+}
+
+void delta_sums(const void *buf, int len, u_int32_t *s1, u_int32_t *s2);
+u_int64_t delta_strong(const void *buf, int len);
+u_int32_t delta_blocksize(u_int64_t size);
+
+#endif /* DELTA_H */
@@ -2,7 +2,8 @@
 /*----------------------------------------------------------------------------
   File:   event.c
   Description: Rudp event handling: registering file descriptors and timeouts
-               and eventloop using the select() system call.
+               and eventloop using the select() system call, io_uring, or
+               busy polling.
   Author: Olof Hagsand and Peter Sjdin
   CVS Version: $Id: event.c,v 1.3 2007/05/03 10:46:06 psj Exp $
  
@@ -29,6 +30,7 @@
  * error, and the program is terminated.
  */
 
+#define _GNU_SOURCE                     /* sched_setaffinity */
 #ifdef HAVE_CONFIG_H
 #include "config.h" /* generated by config & autoconf */
 #endif
@@ -38,10 +40,25 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/errno.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <sched.h>
 #include <assert.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69          /* Linux 5.11 */
+#endif
 
 #include "event.h"
 
@@ -51,11 +68,59 @@
 struct event_data{
     struct event_data *e_next;          /* next in list */
     int (*e_fn)(int, void*);            /* callback function */
-    enum {EVENT_FD, EVENT_TIME} e_type; /* type of event */
+    enum {EVENT_FD, EVENT_TIME, EVENT_RECV} e_type; /* type of event */
     int e_fd;                           /* File descriptor */
     struct timeval e_time;              /* Timeout */
     void *e_arg;                        /* function argument */
     char e_string[32];                  /* string for identification/debugging */
+    int e_dead;                         /* deleted while the fd events were dispatched */
+    struct event_data *e_gc;            /* next deleted event to free after dispatch */
+    int (*e_rfn)(int, void*, char*, int, struct sockaddr*); /* EVENT_RECV callback */
+    struct msghdr e_msg;                /* io_uring: how recvmsg lays out datagrams */
+    int e_armed;                        /* io_uring: a request is outstanding */
+    int e_poll;                         /* io_uring: receive by poll and recvfrom */
+    int e_pending;                      /* io_uring: its arm or cancel waits for room on eu_pending */
+    struct event_data *e_pnext;         /* next on eu_pending */
+};
+
+/*
+ * io_uring: a queued datagram, a queued file write, and the outcome of
+ * the writes to a file.
+ */
+struct event_slot{
+    struct msghdr s_msg;
+    struct iovec s_iov;
+    struct sockaddr_storage s_name;
+    struct event_slot *s_next;          /* next free slot */
+    char s_data[EVENT_SEND_BUFLEN];
+};
+
+struct event_wfile{
+    int f_fd;
+    int f_pending;                      /* writes not completed */
+    int f_error;                        /* errno of the first that failed */
+    struct event_wfile *f_next;
+};
+
+struct event_write{
+    struct event_wfile *w_file;
+    off_t w_off;
+    int w_len;
+    int w_done;                         /* bytes written so far */
+    char w_data[];
+};
+
+/*
+ * Submission queue: a bounded lock-free multi-producer, single-consumer
+ * ring (after D. Vyukov). Each cell carries a sequence number telling
+ * whose turn it is: pos when free for the producer claiming pos, pos+1
+ * when filled. Producers claim positions with a compare-and-swap on the
+ * tail; the loop thread is the only consumer.
+ */
+struct event_cell{
+    unsigned long c_seq;
+    int (*c_fn)(int, void*);
+    void *c_arg;
 };
 
 /*
@@ -63,6 +128,51 @@ struct event_data{
  */
 static struct event_data *ee = NULL;
 static struct event_data *ee_timers = NULL;
+static int ee_dispatching = 0;          /* fd callbacks are being called */
+static struct event_data *ee_garbage = NULL;
+
+static struct event_cell eq_cells[EVENT_SUBMIT_QLEN];
+static unsigned long eq_tail = 0;       /* next position to claim; producers */
+static unsigned long eq_head = 0;       /* next position to run; loop thread */
+static int eq_wake = 0;                 /* eventfd written since the last drain */
+static int eq_fd = -1;                  /* eventfd waking the loop */
+
+static enum {EC_MONOTONIC, EC_REALTIME, EC_VIRTUAL} ec_clock = EC_MONOTONIC;
+static struct timeval ec_now = {1, 0};  /* virtual clock; 0 still reads as unset */
+
+static int es_spin = 0;                 /* busy polling instead of select() */
+static double es_tpus;                  /* es_ticks() per microsecond */
+static unsigned long es_polls = 0;      /* rounds of the spin loop */
+static unsigned long es_idle = 0;       /* ... that found nothing to do */
+static u_int64_t es_busy = 0;           /* ticks in rounds that did something */
+static u_int64_t es_spun = 0;           /* ticks in rounds that did not */
+
+static int eu_fd = -1;                  /* io_uring, or -1 to use select() */
+static char *eu_sq, *eu_cq;             /* the rings, mapped */
+static unsigned *eu_sq_head, *eu_sq_tail, *eu_sq_array;
+static unsigned eu_sq_mask, eu_sq_entries;
+static unsigned eu_sqtail;              /* tail including entries not handed over */
+static struct io_uring_sqe *eu_sqes;
+static unsigned *eu_cq_head, *eu_cq_tail;
+static unsigned eu_cq_mask;
+static struct io_uring_cqe *eu_cqes;
+static struct io_uring_buf_ring *eu_br; /* receive buffers provided to the kernel */
+static char *eu_rbufs;
+static struct event_slot eu_slots[EVENT_SEND_SLOTS];
+static struct event_slot *eu_freeslots = NULL;
+static struct event_wfile *eu_wfiles = NULL;
+static struct io_uring_cqe *eu_defer = NULL; /* completions for the loop to dispatch */
+static int eu_ndefer = 0;
+static int eu_deferlen = 0;
+static struct event_data *eu_pending = NULL; /* events whose request found the ring full */
+
+static void eu_arm(struct event_data *e);
+static void eu_cancel(struct event_data *e);
+static void eu_flush();
+static void eu_recycle(int bid);
+static int eu_loop();
+static int es_loop();
+static void es_busypoll(int fd);
 
 /*
  * Sort into internal event list
@@ -113,7 +223,20 @@ event_delete(struct event_data **firstp, int (*fn)(int, void*),
     for (e = *firstp; e; e = e->e_next){
 	if (fn == e->e_fn && arg == e->e_arg) {
 	    *e_prev = e->e_next;
-	    free(e);
+	    if (e->e_armed || e->e_pending){
+		/* Freed by the last completion of its request, or by
+		 * eu_flush if the request never went out */
+		e->e_dead = 1;
+		eu_cancel(e);
+	    }
+	    else if (ee_dispatching){
+		/* The loop may be about to step onto it */
+		e->e_dead = 1;
+		e->e_gc = ee_garbage;
+		ee_garbage = e;
+	    }
+	    else
+		free(e);
 	    return 0;
 	}
 	e_prev = &e->e_next;
@@ -165,9 +288,77 @@ event_fd(int fd, int (*fn)(int, void*), void *arg, char *str)
     e->e_type = EVENT_FD;
     e->e_next = ee;
     ee = e;
+    if (eu_fd >= 0)
+	eu_arm(e);
+    if (es_spin)
+	es_busypoll(fd);
     return 0;
 }
 
+/*
+ * Register a callback function for datagrams received on socket <fd>:
+ * <fn>(fd, arg, buf, len, from) is called for each one, and buf is only
+ * valid during the call. With io_uring the socket is read by the kernel
+ * into buffers of its own, without a wakeup and a system call per datagram.
+ */
+int
+event_recv(int fd, int (*fn)(int, void*, char*, int, struct sockaddr*), 
+	   void *arg, char *str)
+{
+    struct event_data *e;
+    e = (struct event_data *)malloc(sizeof(struct event_data));
+    if (e==NULL){
+	perror("event_recv: malloc");
+	return -1;
+    }
+    memset(e, 0, sizeof(struct event_data));
+    strcpy(e->e_string, str);
+    e->e_fd = fd;
+    e->e_fn = (int (*)(int, void*))fn;  /* the key for event_recv_delete */
+    e->e_rfn = fn;
+    e->e_arg = arg;
+    e->e_type = EVENT_RECV;
+    e->e_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    e->e_next = ee;
+    ee = e;
+    if (eu_fd >= 0)
+	eu_arm(e);
+    if (es_spin)
+	es_busypoll(fd);
+    return 0;
+}
+
+/*
+ * Deregister a datagram event.
+ */
+int
+event_recv_delete(int (*fn)(int, void*, char*, int, struct sockaddr*), 
+		  void *arg)
+{
+    return event_delete(&ee, (int (*)(int, void*))fn, arg);
+}
+
+/*
+ * Read one datagram of a readable EVENT_RECV socket and pass it on.
+ */
+static int
+event_recv_ready(struct event_data *e)
+{
+    static char buf[EVENT_RECV_BUFLEN];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    int n;
+
+    n = recvfrom(e->e_fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+    if (n < 0){
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	perror("event_recv: recvfrom");
+	return -1;
+    }
+    return (*e->e_rfn)(e->e_fd, e->e_arg, buf, n, (struct sockaddr *)&from);
+}
+
 
 /*
  * Rudp event loop.
@@ -181,15 +372,21 @@ eventloop()
     int n;
     struct timeval t, t0;
 
+    if (eu_fd >= 0)
+	return eu_loop();
+    if (es_spin)
+	return es_loop();
     while (ee || ee_timers){
 	FD_ZERO(&fdset);
 	for (e=ee; e; e=e->e_next)
-	    if (e->e_type == EVENT_FD)
+	    if (e->e_type == EVENT_FD || e->e_type == EVENT_RECV)
 		FD_SET(e->e_fd, &fdset);
 
 	if (ee_timers){
-	    gettimeofday(&t0, NULL);
+	    event_gettime(&t0);
 	    timersub(&ee_timers->e_time, &t0, &t); 
+	    if (ec_clock == EC_VIRTUAL)
+		timerclear(&t);         /* Only look for input */
 	    if (t.tv_sec < 0)
 		n = 0;
 	    else
@@ -204,6 +401,8 @@ eventloop()
 	if (n == 0) {  /* Timeout */
 	    e = ee_timers;
 	    ee_timers = ee_timers->e_next;
+	    if (ec_clock == EC_VIRTUAL && timercmp(&ec_now, &e->e_time, <))
+		ec_now = e->e_time;     /* Nothing to do until then */
 #ifdef DEBUG
 	    fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n", 
 		    e->e_string, (int)e->e_arg);
@@ -221,10 +420,11 @@ eventloop()
 	    }
 	    continue;
 	}
+	ee_dispatching = 1;
 	e = ee;
 	while (e) {
 		e1 = e->e_next;
-	    if (e->e_type == EVENT_FD && FD_ISSET(e->e_fd, &fdset)){
+	    if (e->e_type == EVENT_FD && !e->e_dead && FD_ISSET(e->e_fd, &fdset)){
 #ifdef DEBUG
 		fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n", 
 			e->e_string, e->e_fd, (int)e->e_arg);
@@ -233,11 +433,955 @@ eventloop()
 		    return  -1;
 		}
 	    }
+	    if (e->e_type == EVENT_RECV && !e->e_dead && FD_ISSET(e->e_fd, &fdset)){
+		if (event_recv_ready(e) < 0) {
+		    return  -1;
+		}
+	    }
 	    e = e1;
 	}
+	ee_dispatching = 0;
+	while ((e = ee_garbage) != NULL){
+	    ee_garbage = e->e_gc;
+	    free(e);
+	}
     }
 #ifdef DEBUG
     fprintf(stderr, "eventloop: returning 0\n");
 #endif /* DEBUG */
     return 0;
 }
+
+/*
+ * Drain the submission queue; called on the loop thread when the eventfd
+ * is readable. Runs at most one queue length of submissions per wakeup,
+ * so producers that keep the queue busy cannot starve the sockets.
+ */
+static int
+event_submit_drain(int fd, void *arg)
+{
+    struct event_cell *c;
+    int (*fn)(int, void*);
+    void *fnarg;
+    u_int64_t cnt;
+    int n;
+
+    if (read(eq_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+	perror("event_submit_drain: read");
+    __atomic_store_n(&eq_wake, 0, __ATOMIC_SEQ_CST);
+    for (n = 0; n < EVENT_SUBMIT_QLEN; n++){
+	c = &eq_cells[eq_head & (EVENT_SUBMIT_QLEN-1)];
+	if (__atomic_load_n(&c->c_seq, __ATOMIC_ACQUIRE) != eq_head+1)
+	    return 0;                   /* Empty */
+	/* Hand the cell back to the producers before running the callback */
+	fn = c->c_fn;
+	fnarg = c->c_arg;
+	__atomic_store_n(&c->c_seq, eq_head+EVENT_SUBMIT_QLEN, __ATOMIC_RELEASE);
+	eq_head++;
+	if ((*fn)(0, fnarg) < 0)
+	    return -1;
+	if (eq_fd < 0)
+	    return 0;                   /* The callback closed the queue */
+    }
+    /* More left; come back after the other events */
+    cnt = 1;
+    __atomic_store_n(&eq_wake, 1, __ATOMIC_SEQ_CST);
+    if (write(eq_fd, &cnt, sizeof(cnt)) < 0)
+	perror("event_submit_drain: write");
+    return 0;
+}
+
+/*
+ * Set up the submission queue. Must be called on the loop thread, before
+ * other threads use event_submit(). The loop does not return while the
+ * queue is open.
+ */
+int
+event_submit_open()
+{
+    unsigned long i;
+
+    if (eq_fd >= 0)
+	return 0;
+    for (i = 0; i < EVENT_SUBMIT_QLEN; i++)
+	eq_cells[i].c_seq = eq_tail+i;
+    eq_head = eq_tail;
+    if ((eq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+	perror("event_submit_open: eventfd");
+	return -1;
+    }
+    return event_fd(eq_fd, event_submit_drain, NULL, "event_submit");
+}
+
+/*
+ * Shut the submission queue down, running what is still queued. Loop
+ * thread only; no other thread may submit any more.
+ */
+int
+event_submit_close()
+{
+    if (eq_fd < 0)
+	return 0;
+    event_fd_delete(event_submit_drain, NULL);
+    eq_wake = 1;                        /* No more writes to the eventfd */
+    if (event_submit_drain(eq_fd, NULL) < 0)
+	return -1;
+    close(eq_fd);
+    eq_fd = -1;
+    return 0;
+}
+
+/*
+ * Have fn(0, arg) called on the loop thread. May be called from any
+ * thread and never blocks: returns -1 if the queue is full (or not open).
+ * Submissions from one thread run in the order they were made.
+ */
+int
+event_submit(int (*fn)(int, void*), void *arg)
+{
+    struct event_cell *c;
+    unsigned long pos, seq;
+    u_int64_t one = 1;
+
+    if (__atomic_load_n(&eq_fd, __ATOMIC_ACQUIRE) < 0)
+	return -1;
+    pos = __atomic_load_n(&eq_tail, __ATOMIC_RELAXED);
+    for (;;){
+	c = &eq_cells[pos & (EVENT_SUBMIT_QLEN-1)];
+	seq = __atomic_load_n(&c->c_seq, __ATOMIC_ACQUIRE);
+	if (seq == pos){
+	    if (__atomic_compare_exchange_n(&eq_tail, &pos, pos+1, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;                  /* Claimed; pos is ours */
+	}
+	else if ((long)(seq - pos) < 0)
+	    return -1;                  /* Full */
+	else
+	    pos = __atomic_load_n(&eq_tail, __ATOMIC_RELAXED);
+    }
+    c->c_fn = fn;
+    c->c_arg = arg;
+    __atomic_store_n(&c->c_seq, pos+1, __ATOMIC_RELEASE);
+    /* Only the first submission since the last drain needs to wake the loop */
+    if (!__atomic_exchange_n(&eq_wake, 1, __ATOMIC_SEQ_CST))
+	if (write(eq_fd, &one, sizeof(one)) < 0)
+	    perror("event_submit: write");
+    return 0;
+}
+
+/*
+ * io_uring backend, set up by event_backend("io_uring"). The kernel
+ * interface is used directly, without liburing. The rings are shared with
+ * the kernel; all requests are queued here and handed over by the one
+ * io_uring_enter() per loop iteration that also waits for completions.
+ * Completions carry a pointer to the request's owner with its kind in the
+ * low bits of user_data.
+ */
+#define EU_POLL         1               /* poll of an EVENT_FD, re-armed after each */
+#define EU_RECV         2               /* multishot recvmsg of an EVENT_RECV */
+#define EU_SEND         3               /* event_sendmsg() */
+#define EU_WRITE        4               /* event_pwrite() */
+#define EU_CANCEL       5               /* cancellation; nothing to do */
+#define EU_KIND         7
+
+static int
+eu_setup()
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sqlen, cqlen;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((eu_fd = syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &p)) < 0)
+	return -1;
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+	goto fail;                      /* Needed for timed waits */
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqlen > sqlen)
+	sqlen = cqlen;
+    eu_sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		 eu_fd, IORING_OFF_SQ_RING);
+    if (eu_sq == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	eu_cq = eu_sq;
+    else {
+	eu_cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		     eu_fd, IORING_OFF_CQ_RING);
+	if (eu_cq == MAP_FAILED)
+	    goto fail;
+    }
+    eu_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, eu_fd, IORING_OFF_SQES);
+    if (eu_sqes == MAP_FAILED)
+	goto fail;
+    eu_sq_head = (unsigned *)(eu_sq + p.sq_off.head);
+    eu_sq_tail = (unsigned *)(eu_sq + p.sq_off.tail);
+    eu_sq_mask = *(unsigned *)(eu_sq + p.sq_off.ring_mask);
+    eu_sq_entries = p.sq_entries;
+    eu_sq_array = (unsigned *)(eu_sq + p.sq_off.array);
+    for (i = 0; i < (int)p.sq_entries; i++)
+	eu_sq_array[i] = i;
+    eu_sqtail = *eu_sq_tail;
+    eu_cq_head = (unsigned *)(eu_cq + p.cq_off.head);
+    eu_cq_tail = (unsigned *)(eu_cq + p.cq_off.tail);
+    eu_cq_mask = *(unsigned *)(eu_cq + p.cq_off.ring_mask);
+    eu_cqes = (struct io_uring_cqe *)(eu_cq + p.cq_off.cqes);
+
+    /* Provided buffer ring for the multishot receives */
+    eu_br = mmap(NULL, EVENT_RECV_BUFS * sizeof(struct io_uring_buf),
+		 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (eu_br == MAP_FAILED)
+	goto fail;
+    if ((eu_rbufs = malloc(EVENT_RECV_BUFS * EVENT_RECV_BUFLEN)) == NULL)
+	goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)eu_br;
+    reg.ring_entries = EVENT_RECV_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, eu_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	goto fail;
+    for (i = 0; i < EVENT_RECV_BUFS; i++)
+	eu_recycle(i);
+
+    for (i = 0; i < EVENT_SEND_SLOTS; i++){
+	eu_slots[i].s_next = eu_freeslots;
+	eu_freeslots = &eu_slots[i];
+    }
+    return 0;
+  fail:
+    close(eu_fd);
+    eu_fd = -1;
+    return -1;
+}
+
+/*
+ * Give receive buffer bid back to the kernel.
+ */
+static void
+eu_recycle(int bid)
+{
+    struct io_uring_buf *b;
+    unsigned short tail = eu_br->tail;
+
+    b = &eu_br->bufs[tail & (EVENT_RECV_BUFS-1)];
+    b->addr = (unsigned long)(eu_rbufs + bid * EVENT_RECV_BUFLEN);
+    b->len = EVENT_RECV_BUFLEN;
+    b->bid = bid;
+    __atomic_store_n(&eu_br->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hand queued requests to the kernel and, if wait, wait for a completion
+ * at most until ts (NULL: no limit).
+ */
+static int
+eu_enter(int wait, struct timespec *ts)
+{
+    struct io_uring_getevents_arg arg;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned n;
+
+    __atomic_store_n(eu_sq_tail, eu_sqtail, __ATOMIC_RELEASE);
+    n = eu_sqtail - __atomic_load_n(eu_sq_head, __ATOMIC_ACQUIRE);
+    if (n == 0 && !wait)
+	return 0;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)ts;
+    if (wait)
+	flags |= IORING_ENTER_GETEVENTS;
+    if (syscall(__NR_io_uring_enter, eu_fd, n, wait ? 1 : 0, flags, &arg, sizeof(arg)) < 0
+	&& errno != ETIME && errno != EINTR && errno != EBUSY){
+	perror("eventloop: io_uring_enter");
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Get a cleared submission queue entry, or NULL if the ring stays full.
+ */
+static struct io_uring_sqe *
+eu_sqe()
+{
+    struct io_uring_sqe *sqe;
+
+    if (eu_sqtail - __atomic_load_n(eu_sq_head, __ATOMIC_ACQUIRE) >= eu_sq_entries){
+	eu_enter(0, NULL);
+	if (eu_sqtail - __atomic_load_n(eu_sq_head, __ATOMIC_ACQUIRE) >= eu_sq_entries)
+	    return NULL;
+    }
+    sqe = &eu_sqes[eu_sqtail & eu_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    eu_sqtail++;
+    return sqe;
+}
+
+/*
+ * Put an event whose request found the ring full on eu_pending, for
+ * eu_flush to queue the request later.
+ */
+static void
+eu_postpone(struct event_data *e)
+{
+    if (!e->e_pending){
+	e->e_pending = 1;
+	e->e_pnext = eu_pending;
+	eu_pending = e;
+    }
+}
+
+/*
+ * Queue the requests put off by eu_postpone, as far as there is room now;
+ * once per loop iteration. An event deleted before its request went out
+ * is freed.
+ */
+static void
+eu_flush()
+{
+    struct event_data *e;
+
+    while ((e = eu_pending) != NULL){
+	eu_pending = e->e_pnext;
+	e->e_pending = 0;
+	if (e->e_dead && !e->e_armed){
+	    free(e);
+	    continue;
+	}
+	if (e->e_dead)
+	    eu_cancel(e);
+	else if (!e->e_armed)
+	    eu_arm(e);
+	if (e->e_pending)
+	    break;                      /* Still full */
+    }
+}
+
+/*
+ * Start the request of an fd or receive event.
+ */
+static void
+eu_arm(struct event_data *e)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = eu_sqe()) == NULL){
+	eu_postpone(e);
+	return;
+    }
+    sqe->fd = e->e_fd;
+    if (e->e_type == EVENT_RECV && !e->e_poll){
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->addr = (unsigned long)&e->e_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (unsigned long)e | EU_RECV;
+    }
+    else {
+	/* One-shot, so it fires again while input is left, as select() does */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = (unsigned long)e | EU_POLL;
+    }
+    e->e_armed = 1;
+}
+
+/*
+ * Cancel the request of an event being deleted; it is freed when its
+ * last completion comes in.
+ */
+static void
+eu_cancel(struct event_data *e)
+{
+    struct io_uring_sqe *sqe;
+
+    if (e->e_pending)
+	return;                         /* eu_flush sees to it */
+    if ((sqe = eu_sqe()) == NULL){
+	eu_postpone(e);
+	return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)e |
+	(e->e_type == EVENT_RECV && !e->e_poll ? EU_RECV : EU_POLL);
+    sqe->user_data = EU_CANCEL;
+}
+
+/*
+ * Completion of an event_pwrite(); a short write is continued.
+ */
+static void
+eu_written(struct event_write *w, int res)
+{
+    struct io_uring_sqe *sqe;
+
+    if (res > 0 && w->w_done + res < w->w_len){
+	w->w_done += res;
+	if ((sqe = eu_sqe()) != NULL){
+	    sqe->opcode = IORING_OP_WRITE;
+	    sqe->fd = w->w_file->f_fd;
+	    sqe->addr = (unsigned long)(w->w_data + w->w_done);
+	    sqe->len = w->w_len - w->w_done;
+	    sqe->off = w->w_off + w->w_done;
+	    sqe->user_data = (unsigned long)w | EU_WRITE;
+	    return;
+	}
+	res = -EAGAIN;
+    }
+    if (res <= 0 && w->w_file->f_error == 0)
+	w->w_file->f_error = res < 0 ? -res : EIO;
+    w->w_file->f_pending--;
+    free(w);
+}
+
+/*
+ * Dispatch the completion of a poll or receive request.
+ */
+static int
+eu_event(struct io_uring_cqe *cqe)
+{
+    struct event_data *e = (struct event_data *)(unsigned long)(cqe->user_data & ~EU_KIND);
+    struct io_uring_recvmsg_out *out;
+    char *buf = NULL;
+    int bid = -1;
+    int ret = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = eu_rbufs + bid * EVENT_RECV_BUFLEN;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+	e->e_armed = 0;
+    if (e->e_dead){
+	if (bid >= 0)
+	    eu_recycle(bid);
+	if (!e->e_armed && !e->e_pending)
+	    free(e);                    /* Its last completion */
+	return 0;
+    }
+    if ((cqe->user_data & EU_KIND) == EU_POLL && cqe->res > 0)
+	ret = e->e_type == EVENT_RECV ? event_recv_ready(e) : (*e->e_fn)(e->e_fd, e->e_arg);
+    else if (buf != NULL && cqe->res >= (int)sizeof(*out)){
+	out = (struct io_uring_recvmsg_out *)buf;
+	if (!(out->flags & MSG_TRUNC))
+	    ret = (*e->e_rfn)(e->e_fd, e->e_arg,
+			      buf + sizeof(*out) + e->e_msg.msg_namelen + e->e_msg.msg_controllen,
+			      out->payloadlen, (struct sockaddr *)(out + 1));
+    }
+    else if (cqe->res == -EINVAL && (cqe->user_data & EU_KIND) == EU_RECV)
+	e->e_poll = 1;                  /* No multishot recvmsg; poll and recvfrom */
+    else if (cqe->res < 0 && cqe->res != -ENOBUFS){
+	fprintf(stderr, "eventloop: %s: %s\n", e->e_string, strerror(-cqe->res));
+	ret = -1;
+    }
+    if (bid >= 0)
+	eu_recycle(bid);
+    if (!e->e_armed && !e->e_dead)
+	eu_arm(e);                      /* Ended, e.g. out of buffers; restart */
+    return ret;
+}
+
+/*
+ * Reap completions. Sends and writes are finished here; with defer, poll
+ * and receive completions are kept for the loop instead of dispatched,
+ * as the caller is in the middle of a callback.
+ */
+static int
+eu_reap(int defer)
+{
+    struct io_uring_cqe cqe;
+    struct event_slot *s;
+    unsigned head;
+
+    /* The head is read anew each time: callbacks may reap too */
+    while ((head = *eu_cq_head) != __atomic_load_n(eu_cq_tail, __ATOMIC_ACQUIRE)){
+	cqe = eu_cqes[head & eu_cq_mask];
+	__atomic_store_n(eu_cq_head, head+1, __ATOMIC_RELEASE);
+	switch (cqe.user_data & EU_KIND){
+	case EU_SEND:
+	    s = (struct event_slot *)(unsigned long)(cqe.user_data & ~EU_KIND);
+	    s->s_next = eu_freeslots;
+	    eu_freeslots = s;
+	    break;
+	case EU_WRITE:
+	    eu_written((struct event_write *)(unsigned long)(cqe.user_data & ~EU_KIND), cqe.res);
+	    break;
+	case EU_POLL:
+	case EU_RECV:
+	    if (defer){
+		if (eu_ndefer == eu_deferlen){
+		    eu_deferlen = eu_deferlen ? 2*eu_deferlen : EVENT_URING_ENTRIES;
+		    eu_defer = realloc(eu_defer, eu_deferlen * sizeof(struct io_uring_cqe));
+		}
+		eu_defer[eu_ndefer++] = cqe;
+	    }
+	    else if (eu_event(&cqe) < 0)
+		return -1;
+	    break;
+	default:
+	    break;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Event loop on io_uring: as the select() loop, an expired timer runs
+ * first; otherwise queued requests are submitted and completions waited
+ * for in one system call.
+ */
+static int
+eu_loop()
+{
+    struct event_data *e;
+    struct io_uring_cqe cqe;
+    struct timeval t, t0;
+    struct timespec ts;
+    int i, ret;
+
+    while (ee || ee_timers){
+	eu_flush();
+	if (ee_timers){
+	    event_gettime(&t0);
+	    timersub(&ee_timers->e_time, &t0, &t); 
+	    if (ec_clock == EC_VIRTUAL && t.tv_sec >= 0 && eu_ndefer == 0){
+		ts.tv_sec = 0;          /* Only look for input */
+		ts.tv_nsec = 0;
+		if (eu_enter(1, &ts) < 0)
+		    return -1;
+		if (*eu_cq_head == __atomic_load_n(eu_cq_tail, __ATOMIC_ACQUIRE)){
+		    ec_now = ee_timers->e_time; /* Nothing to do until then */
+		    t.tv_sec = -1;
+		}
+	    }
+	    if (t.tv_sec < 0){          /* Timeout */
+		e = ee_timers;
+		ee_timers = ee_timers->e_next;
+		if ((*e->e_fn)(0, e->e_arg) < 0)
+		    return -1;
+		free(e);
+		continue;
+	    }
+	    ts.tv_sec = t.tv_sec;
+	    ts.tv_nsec = t.tv_usec * 1000;
+	    if (ec_clock != EC_VIRTUAL && eu_ndefer == 0 && eu_enter(1, &ts) < 0)
+		return -1;
+	}
+	else if (eu_ndefer == 0 && eu_enter(1, NULL) < 0)
+	    return -1;
+	ee_dispatching = 1;
+	ret = 0;
+	for (i = 0; i < eu_ndefer && ret == 0; i++){
+	    cqe = eu_defer[i];
+	    ret = eu_event(&cqe);
+	}
+	eu_ndefer = 0;
+	if (ret == 0)
+	    ret = eu_reap(0);
+	ee_dispatching = 0;
+	while ((e = ee_garbage) != NULL){
+	    ee_garbage = e->e_gc;
+	    free(e);
+	}
+	if (ret < 0)
+	    return -1;
+    }
+    eu_enter(0, NULL);                  /* What the last callbacks sent */
+    return 0;
+}
+
+/*
+ * Spin loop. It never sleeps: each round polls the file descriptors
+ * without waiting, dispatches those ready, and runs the first timeout if
+ * it is due. Whether it is due is told by the TSC, against a deadline
+ * worked out when the first timeout changes, so an idle round costs a
+ * poll() and no clock reads. Rounds are timed for event_spin_stats().
+ */
+static u_int64_t
+es_ticks()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Measure es_ticks() against CLOCK_MONOTONIC for 10 ms.
+ */
+static void
+es_calibrate()
+{
+    struct timespec a, b;
+    u_int64_t t0, t1;
+    long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    t0 = es_ticks();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	ns = (b.tv_sec - a.tv_sec) * 1000000000 + b.tv_nsec - a.tv_nsec;
+    } while (ns < 10000000);
+    t1 = es_ticks();
+    es_tpus = (double)(t1 - t0) * 1000 / ns;
+}
+
+/*
+ * Have reads of socket fd busy poll the device queue. Needs
+ * CAP_NET_ADMIN above net.core.busy_read, and a kernel that knows the
+ * options; without, the loop spins on poll() alone. Other descriptors
+ * just refuse.
+ */
+static void
+es_busypoll(int fd)
+{
+    int usecs = EVENT_BUSY_POLL, one = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+}
+
+/*
+ * The first timeout is due, or with the virtual clock, nothing else is
+ * (no input was found).
+ */
+static int
+es_due(int n)
+{
+    static struct event_data *head = NULL;
+    static struct timeval htime;
+    static u_int64_t deadline;
+    struct timeval t, t0;
+
+    if (ec_clock == EC_VIRTUAL){
+	if (n > 0)
+	    return 0;
+	if (timercmp(&ec_now, &ee_timers->e_time, <))
+	    ec_now = ee_timers->e_time; /* Nothing to do until then */
+	return 1;
+    }
+    if (ee_timers != head || timercmp(&ee_timers->e_time, &htime, !=)){
+	head = ee_timers;
+	htime = ee_timers->e_time;
+	event_gettime(&t0);
+	timersub(&htime, &t0, &t);
+	deadline = es_ticks();
+	if (t.tv_sec >= 0)
+	    deadline += (t.tv_sec * 1000000.0 + t.tv_usec) * es_tpus;
+    }
+    return es_ticks() >= deadline;
+}
+
+static int
+es_loop()
+{
+    static struct pollfd *fds = NULL;
+    static struct event_data **evs = NULL;
+    static int maxfds = 0;
+    struct event_data *e;
+    u_int64_t t0;
+    int nfds, n, i, ret;
+
+    es_calibrate();
+    while (ee || ee_timers){
+	t0 = es_ticks();
+	es_polls++;
+	for (nfds = 0, e = ee; e; e = e->e_next)
+	    nfds++;
+	if (nfds > maxfds){
+	    fds = realloc(fds, nfds * sizeof(struct pollfd));
+	    evs = realloc(evs, nfds * sizeof(struct event_data *));
+	    if (fds == NULL || evs == NULL){
+		perror("eventloop: realloc");
+		return -1;
+	    }
+	    maxfds = nfds;
+	}
+	for (i = 0, e = ee; e; e = e->e_next, i++){
+	    fds[i].fd = e->e_fd;
+	    fds[i].events = POLLIN;
+	    evs[i] = e;
+	}
+	n = nfds > 0 ? poll(fds, nfds, 0) : 0;
+	if (n == -1){
+	    if (errno != EINTR)
+		perror("eventloop: poll");
+	    n = 0;
+	}
+	if (n > 0){
+	    ee_dispatching = 1;
+	    for (i = 0; i < nfds; i++){
+		e = evs[i];             /* Deleted ones are freed after the round */
+		if (e->e_dead || fds[i].revents == 0)
+		    continue;
+		if (e->e_type == EVENT_FD)
+		    ret = (*e->e_fn)(e->e_fd, e->e_arg);
+		else
+		    ret = event_recv_ready(e);
+		if (ret < 0)
+		    return -1;
+	    }
+	    ee_dispatching = 0;
+	    while ((e = ee_garbage) != NULL){
+		ee_garbage = e->e_gc;
+		free(e);
+	    }
+	}
+	if (ee_timers && es_due(n)){
+	    e = ee_timers;
+	    ee_timers = ee_timers->e_next;
+	    if ((*e->e_fn)(0, e->e_arg) < 0)
+		return -1;
+	    free(e);
+	    n = 1;
+	}
+	if (n > 0)
+	    es_busy += es_ticks() - t0;
+	else {
+	    es_idle++;
+	    es_spun += es_ticks() - t0;
+	}
+    }
+    return 0;
+}
+
+/*
+ * How the spin loop spent its time: rounds, rounds that found nothing to
+ * do, and the share of the time in the others.
+ */
+int
+event_spin_stats(unsigned long *polls, unsigned long *idle, double *busy)
+{
+    *polls = es_polls;
+    *idle = es_idle;
+    *busy = es_busy + es_spun > 0 ? (double)es_busy / (es_busy + es_spun) : 0;
+    return 0;
+}
+
+/*
+ * Bind the calling thread to one CPU.
+ */
+int
+event_pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+	return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0){
+	perror("event_pin: sched_setaffinity");
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Select the clock of the loop: "monotonic" (the default), "realtime"
+ * or "virtual". Returns -1 for an unknown name, or once a timeout is
+ * registered: its time is on the old clock.
+ */
+int
+event_clock(char *name)
+{
+    if (ee_timers != NULL)
+	return -1;
+    if (strcmp(name, "monotonic") == 0)
+	ec_clock = EC_MONOTONIC;
+    else if (strcmp(name, "realtime") == 0)
+	ec_clock = EC_REALTIME;
+    else if (strcmp(name, "virtual") == 0)
+	ec_clock = EC_VIRTUAL;
+    else
+	return -1;
+    return 0;
+}
+
+/*
+ * Read the clock of the loop; timeouts are absolute times on it.
+ */
+int
+event_gettime(struct timeval *tv)
+{
+    struct timespec ts;
+
+    switch (ec_clock){
+    case EC_VIRTUAL:
+	*tv = ec_now;
+	return 0;
+    case EC_REALTIME:
+	return gettimeofday(tv, NULL);
+    default:
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+	    return -1;
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	return 0;
+    }
+}
+
+/*
+ * Select the loop implementation: "select" (the default), "io_uring" or
+ * "spin". Returns -1 if it is not available. Call before registering
+ * anything.
+ */
+int
+event_backend(char *name)
+{
+    if (strcmp(name, "select") == 0){
+	es_spin = 0;
+	return eu_fd < 0 ? 0 : -1;
+    }
+    if (ee != NULL)
+	return -1;
+    if (strcmp(name, "spin") == 0){
+	if (eu_fd >= 0)
+	    return -1;
+	es_spin = 1;
+	return 0;
+    }
+    if (strcmp(name, "io_uring") != 0 || es_spin)
+	return -1;
+    if (eu_fd >= 0)
+	return 0;
+    return eu_setup();
+}
+
+/*
+ * Send a datagram gathered from iov to <to>. With io_uring the data is
+ * copied and the send queued, to be submitted with the others at the next
+ * wait of the loop; the caller may reuse its buffers at once. Returns the
+ * number of bytes sent (or queued), or -1.
+ */
+int
+event_sendmsg(int fd, struct iovec *iov, int iovcnt, struct sockaddr *to, int tolen)
+{
+    struct io_uring_sqe *sqe;
+    struct event_slot *s;
+    struct msghdr msg;
+    int i, len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    if (eu_fd >= 0 && len <= EVENT_SEND_BUFLEN && tolen <= (int)sizeof(s->s_name)){
+	if (eu_freeslots == NULL){
+	    eu_enter(0, NULL);
+	    eu_reap(1);
+	}
+	if ((s = eu_freeslots) != NULL && (sqe = eu_sqe()) != NULL){
+	    eu_freeslots = s->s_next;
+	    for (len = 0, i = 0; i < iovcnt; i++){
+		memcpy(s->s_data + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	    }
+	    memcpy(&s->s_name, to, tolen);
+	    s->s_iov.iov_base = s->s_data;
+	    s->s_iov.iov_len = len;
+	    memset(&s->s_msg, 0, sizeof(s->s_msg));
+	    s->s_msg.msg_name = &s->s_name;
+	    s->s_msg.msg_namelen = tolen;
+	    s->s_msg.msg_iov = &s->s_iov;
+	    s->s_msg.msg_iovlen = 1;
+	    sqe->opcode = IORING_OP_SENDMSG;
+	    sqe->fd = fd;
+	    sqe->addr = (unsigned long)&s->s_msg;
+	    sqe->len = 1;
+	    sqe->user_data = (unsigned long)s | EU_SEND;
+	    return len;
+	}
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = to;
+    msg.msg_namelen = tolen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, 0);
+}
+
+/*
+ * Write len bytes of buf at offset of file fd. With io_uring the data is
+ * copied and written asynchronously; event_pwrite_wait() collects the
+ * outcome. Returns len, or -1.
+ */
+int
+event_pwrite(int fd, void *buf, int len, off_t offset)
+{
+    struct io_uring_sqe *sqe;
+    struct event_wfile *f;
+    struct event_write *w;
+    int n, done = 0;
+
+    if (len > 0 && eu_fd >= 0 && (w = malloc(sizeof(struct event_write) + len)) != NULL){
+	if ((sqe = eu_sqe()) != NULL){
+	    for (f = eu_wfiles; f && f->f_fd != fd; f = f->f_next)
+		;
+	    if (f == NULL && (f = calloc(1, sizeof(struct event_wfile))) != NULL){
+		f->f_fd = fd;
+		f->f_next = eu_wfiles;
+		eu_wfiles = f;
+	    }
+	    if (f != NULL){
+		memcpy(w->w_data, buf, len);
+		w->w_file = f;
+		w->w_off = offset;
+		w->w_len = len;
+		w->w_done = 0;
+		f->f_pending++;
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)w->w_data;
+		sqe->len = len;
+		sqe->off = offset;
+		sqe->user_data = (unsigned long)w | EU_WRITE;
+		return len;
+	    }
+	    sqe->opcode = IORING_OP_NOP; /* Taken; fill it harmlessly */
+	    sqe->user_data = EU_CANCEL;
+	}
+	free(w);
+    }
+    while (done < len){
+	if ((n = pwrite(fd, (char *)buf + done, len - done, offset + done)) <= 0)
+	    return -1;
+	done += n;
+    }
+    return len;
+}
+
+/*
+ * Wait for the writes to fd queued by event_pwrite(). Returns -1, with
+ * errno set, if any of them failed. Call before closing fd.
+ */
+int
+event_pwrite_wait(int fd)
+{
+    struct event_wfile *f, **fp;
+    int err;
+
+    for (fp = &eu_wfiles; (f = *fp) != NULL && f->f_fd != fd; fp = &f->f_next)
+	;
+    if (f == NULL)
+	return 0;
+    while (f->f_pending > 0){
+	if (eu_enter(1, NULL) < 0)
+	    return -1;
+	eu_reap(1);
+    }
+    err = f->f_error;
+    *fp = f->f_next;
+    free(f);
+    if (err){
+	errno = err;
+	return -1;
+    }
+    return 0;
+}
@@ -49,4 +49,80 @@ int event_fd_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd(int fd, int (*callback)(int, void*), void *callback_arg, char *idstr);
 int eventloop();
 
+/*
+ * Clock of the event loop. Timeouts given to event_timeout() are
+ * absolute times on it, read with event_gettime(). "monotonic" (the
+ * default) is CLOCK_MONOTONIC and does not jump when the time of day is
+ * set; "realtime" is the time of day. "virtual" is simulated time: it
+ * starts at one second and only moves when the loop finds no input
+ * waiting, by jumping straight to the next timeout. Timer-driven runs,
+ * such as loss recovery over a lossy link between sockets of one
+ * process, then take as long as their callbacks and not their timeouts,
+ * and give the same timings every time. Select the clock before
+ * registering any timeout.
+ */
+int event_clock(char *name);
+int event_gettime(struct timeval *tv);
+
+/*
+ * Datagram sockets: callback(fd, callback_arg, buf, len, from) is called
+ * for every datagram received on fd; buf is only valid during the call.
+ */
+struct sockaddr;
+struct iovec;
+int event_recv(int fd, int (*callback)(int, void*, char*, int, struct sockaddr*), 
+	       void *callback_arg, char *idstr);
+int event_recv_delete(int (*callback)(int, void*, char*, int, struct sockaddr*), 
+		      void *callback_arg);
+
+/*
+ * Backend of the event loop: "select" (the default), "io_uring" or
+ * "spin" (below).
+ * With io_uring, datagram sockets are read with multishot recvmsg into a
+ * ring of buffers provided to the kernel, and event_sendmsg() and
+ * event_pwrite() are queued and handed to the kernel together, with the
+ * wait for the next events, in one system call per loop iteration.
+ * event_backend() returns -1 if the kernel lacks io_uring (or recent
+ * enough features); the loop then stays on select(). Call it before
+ * registering any event.
+ */
+#define EVENT_URING_ENTRIES	256	/* Submission queue entries */
+#define EVENT_RECV_BUFS		256	/* Receive buffers; a power of two */
+#define EVENT_RECV_BUFLEN	2048	/* Bytes per receive buffer */
+#define EVENT_SEND_SLOTS	256	/* Datagrams queued for sending at most */
+#define EVENT_SEND_BUFLEN	2048	/* Largest datagram that is queued */
+
+int event_backend(char *name);
+
+/*
+ * Busy polling, for latency at the cost of a core: the "spin" backend
+ * never sleeps. It polls the descriptors without waiting, has socket
+ * reads busy poll the device queue (SO_BUSY_POLL, SO_PREFER_BUSY_POLL,
+ * where permitted), and tells when the next timeout is due from the TSC
+ * instead of the clock. event_pin() binds the loop thread to a CPU, best
+ * one set apart for it. event_spin_stats() tells how the spin loop spent
+ * its time: rounds, rounds that found nothing to do, and the share of
+ * the time spent in the others, dispatching input and timeouts.
+ */
+#define EVENT_BUSY_POLL		50	/* Microseconds a socket read busy polls */
+
+int event_pin(int cpu);
+int event_spin_stats(unsigned long *polls, unsigned long *idle, double *busy);
+int event_sendmsg(int fd, struct iovec *iov, int iovcnt, struct sockaddr *to, int tolen);
+int event_pwrite(int fd, void *buf, int len, off_t offset);
+int event_pwrite_wait(int fd);
+
+/*
+ * Cross-thread submission. event_submit() may be called from any thread
+ * to have callback(0, callback_arg) called on the thread running
+ * eventloop(); it never blocks, and returns -1 if the queue is full.
+ * event_submit_open() and event_submit_close() are called on the loop
+ * thread.
+ */
+#define EVENT_SUBMIT_QLEN	4096	/* Submission queue length; a power of two */
+
+int event_submit_open();
+int event_submit_close();
+int event_submit(int (*callback)(int, void*), void *callback_arg);
+
 #endif /* EVENT_H */
@@ -0,0 +1,84 @@
+/*
+ * fec.c: XOR kernels used to build and apply RUDP parity packets.
+ * Parity is a plain XOR over the data payloads of a group, so encoding and
+ * decoding is one pass of fec_xor per packet.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "fec.h"
+
+static void fec_xor_select(void *dst, const void *src, int len);
+
+static void (*fec_xor_impl)(void *, const void *, int) = fec_xor_select;
+
+/*
+ * Portable version: 64 bits at a time, then the remaining bytes.
+ */
+static void fec_xor_generic(void *dst, const void *src, int len){
+	u_int8_t* d = (u_int8_t*)dst;
+	const u_int8_t* s = (const u_int8_t*)src;
+	u_int64_t a, b;
+	while(len >= 8){
+		memcpy(&a, d, 8);
+		memcpy(&b, s, 8);
+		a ^= b;
+		memcpy(d, &a, 8);
+		d += 8; s += 8; len -= 8;
+	}
+	while(len-- > 0)
+		*d++ ^= *s++;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void fec_xor_sse2(void *dst, const void *src, int len){
+	u_int8_t* d = (u_int8_t*)dst;
+	const u_int8_t* s = (const u_int8_t*)src;
+	__m128i a, b;
+	while(len >= 16){
+		a = _mm_loadu_si128((const __m128i*)d);
+		b = _mm_loadu_si128((const __m128i*)s);
+		_mm_storeu_si128((__m128i*)d, _mm_xor_si128(a, b));
+		d += 16; s += 16; len -= 16;
+	}
+	fec_xor_generic(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static void fec_xor_avx2(void *dst, const void *src, int len){
+	u_int8_t* d = (u_int8_t*)dst;
+	const u_int8_t* s = (const u_int8_t*)src;
+	__m256i a, b;
+	while(len >= 32){
+		a = _mm256_loadu_si256((const __m256i*)d);
+		b = _mm256_loadu_si256((const __m256i*)s);
+		_mm256_storeu_si256((__m256i*)d, _mm256_xor_si256(a, b));
+		d += 32; s += 32; len -= 32;
+	}
+	fec_xor_generic(d, s, len);
+}
+#endif
+
+/*
+ * First call: pick the widest kernel the CPU supports.
+ */
+static void fec_xor_select(void *dst, const void *src, int len){
+	fec_xor_impl = fec_xor_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		fec_xor_impl = fec_xor_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		fec_xor_impl = fec_xor_sse2;
+#endif
+	fec_xor_impl(dst, src, len);
+}
+
+void fec_xor(void *dst, const void *src, int len){
+	fec_xor_impl(dst, src, len);
+}
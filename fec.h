@@ -0,0 +1,13 @@
+#ifndef FEC_H
+#define	FEC_H
+
+/*
+ * XOR kernels for RUDP forward error correction.
+ * fec_xor computes dst ^= src over len bytes. The implementation is
+ * selected on first use: AVX2 or SSE2 when the CPU supports it, otherwise
+ * a portable word-at-a-time loop.
+ */
+
+void fec_xor(void *dst, const void *src, int len);
+
+#endif /* FEC_H */
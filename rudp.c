@@ -1,3 +1,4 @@
+#define _GNU_SOURCE				// recvmmsg.
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,7 @@
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -17,6 +19,9 @@
 #include "event.h"
 #include "rudp.h"
 #include "rudp_api.h"
+#include "fec.h"
+#include "crc32c.h"
+#include "rudp_cc.h"
 
 #define INIT		0			// RUDP socket state: INIT.
 #define DATA		1			// RUDP socket state: DATA.
@@ -25,60 +30,324 @@
 #define FIN		4			// RUDP socket state: FIN.
 
 #define MAX_SEQ 2147483646			// The largest possible 32-bit integer value.
+#define RCVBUF_SIZE RUDP_MAXWINDOW		// Max. number of out-of-order packets buffered by the receiver.
+#define DUPACK_THRESH 3				// Duplicate ACKs that signal a lost packet.
+#define FEC_MAXGROUPS 8				// Max. number of parity packets the receiver holds on to.
+#define FLAG_V2 0x10000				// Not on the wire: the packet came with the compact header.
+
+#if RCVBUF_SIZE > 64
+#error "The unordered receive bitmap (rcvmap) covers at most 64 packets"
+#endif
 
 typedef struct{
 	struct rudp_hdr	header;			// RUDP header.
 	char data[RUDP_MAXPKTSIZE];		// RUDP data; RUDP_MAXPACKETSIZE is 1000.
 }__attribute__((packed)) rudp_packet;		// Since it's a 'typedef' for a struct, only rudp_packet is called.
 
+typedef struct{
+	struct rudp_hdr	header;			// RUDP header; type is RUDP_PARITY.
+	struct rudp_fechdr fec;			// Group size and XOR of the data lengths.
+	char data[RUDP_MAXPKTSIZE];		// XOR of the data payloads of the group.
+}__attribute__((packed)) rudp_parity_packet;
+
+/*
+ * A payload sent to several peers by rudp_sendto_group: held once, shared
+ * by the send buffer nodes of all of them, freed with the last one.
+ */
+struct rudp_buf{
+	int refs;				// Nodes still holding it.
+	int len;				// Length of data.
+	char data[RUDP_MAXPKTSIZE];		// The payload; allocated to len bytes.
+};
+
 struct send_data_list_buffer{
-        rudp_packet* packet;                   	// RUDP packet structure.
-	struct rudp_socket* skt;		// Pointer to the RUDP socket for this packet buffer.           
+        rudp_packet* packet;                   	// RUDP packet structure; header only if buf is set.
+	struct rudp_buf* buf;			// Shared payload, or NULL: the data follows the header in packet.
+	struct rudp_conn* conn;			// Pointer to the RUDP connection for this packet buffer.
         int datalen;                            // RUDP packet data length.
 	int fd;					// Filde Descriptor.	
         struct send_data_list_buffer *next;	// Pointer to structure which describes the next packet.
 	int retransCount;                       // Retransmission counter.
+	struct timeval sent;			// Time of the last transmission.
+	int delivered;				// The connection's delivered count at that time ...
+	struct timeval delivered_stamp;		// ... and when it was last increased; for delivery rate samples.
+	struct timeval expire;			// Partial reliability: give up on the packet at this time (0: never) ...
+	int maxretrans;				// ... or when it is lost after this many retransmissions (-1: never).
 	struct sockaddr_in* dest;	    	// The destination address for this packet.
 };
 
-struct rudp_socket{
-	int fd;					// Socket file descriptor.
-	struct sockaddr_in* dest;		// The destination address.
-	int state;				// The socket's state.
-	int window_size;			// The socket's current window size.
-	int hack;				// |- Receiver: the next expected sequence number. 
+struct recv_data_list_buffer{
+	rudp_packet* packet;			// Copy of an out-of-order RUDP packet, or the receive buffer it arrived in.
+	int datalen;				// RUDP packet data length.
+	int frag;				// Fragment flags the packet came with.
+	struct recv_data_list_buffer *next;	// Next buffered packet; the list is sorted on sequence number.
+};
+
+struct rudp_rxbuf{
+	int refs;				// Users: the datagram being processed, a buffered packet, descriptors.
+	struct rudp_rxbuf* next;		// Next free buffer.
+};
+
+struct fec_encoder{
+	u_int32_t base;				// Sequence number of the first data packet in the group.
+	int count;				// Number of data packets XORed into the parity so far.
+	int len;				// Length of the longest payload in the group.
+	u_int16_t lenxor;			// XOR of the payload lengths.
+	int frag;				// XOR of the fragment flags.
+	char parity[RUDP_MAXPKTSIZE];		// XOR of the payloads.
+};
+
+struct fec_group{
+	u_int32_t base;				// Sequence number of the first data packet in the group.
+	int k;					// Number of data packets in the group.
+	int len;				// Parity payload length.
+	u_int16_t lenxor;			// XOR of the payload lengths.
+	int frag;				// XOR of the fragment flags.
+	char parity[RUDP_MAXPKTSIZE];		// XOR of the payloads.
+	struct fec_group *next;
+};
+
+struct fec_history{
+	int valid[RUDP_FEC_MAXK];		// Boolean: slot holds a delivered packet.
+	u_int32_t seqno[RUDP_FEC_MAXK];		// Sequence number of the delivered packet, slot is seqno%RUDP_FEC_MAXK.
+	int datalen[RUDP_FEC_MAXK];		// Payload length of the delivered packet.
+	int frag[RUDP_FEC_MAXK];		// Its fragment flags.
+	char data[RUDP_FEC_MAXK][RUDP_MAXPKTSIZE];
+};
+
+struct rudp_conn{
+	struct rudp_socket* skt;		// The RUDP socket this connection belongs to.
+	struct sockaddr_in peer;		// The remote address; connections are looked up on it.
+	int sender;				// Boolean: opened by rudp_sendto (else by a SYN from the peer).
+	int state;				// The connection's state.
+	u_int32_t snd_nxt;			// Sender: the sequence number of the next packet to be sent.
+	u_int32_t snd_max;			// Sender: one past the highest sequence number sent so far; snd_nxt
+						// drops back to hack+1 when the retransmission timer expires.
+	u_int32_t hack;				// |- Receiver: the next expected sequence number. 
 						// |- Sender: the sequence number of the packet that the receiver expects.
-	int synseqno;				// The RUDP SYN seuence number; used in the case when close_socket is called
-						// before the SYN ACK arrives.
-	int seqno;				// The sequence number of the next data packet to be added to the buffer.
+	u_int32_t synseqno;			// The RUDP SYN seuence number; used in the case when close_socket is called
+						// before the SYN ACK arrives. Receiver: the SYN of the current (or last)
+						// connection, to recognize duplicate SYNs.
+	u_int32_t seqno;			// The sequence number of the next data packet to be added to the buffer.
 	int reachedEnd;				// Boolean int variable which specifies if all packets until RUDP FIN has
 						// been transmitted.
 	struct send_data_list_buffer* head;	// Pointer that keeps track of the head of the packet buffer.
+	struct recv_data_list_buffer* rcvhead;	// Receiver: out-of-order packets waiting for the gap to be filled.
+	int unordered;				// Boolean: receiver delivers packets as they arrive.
+	u_int64_t rcvmap;			// Receiver, unordered: bit i is set once packet hack+i is delivered.
+	char* reasm;				// Receiver: the fragmented message being put together, or NULL ...
+	int reasmlen;				// ... its length, 0 when none is on the way ...
+	int reasmoff;				// ... the bytes of it received so far ...
+	u_int32_t reasmnext;			// ... and the sequence number of its next fragment.
+	int csum;				// Boolean: append a CRC32C to every packet sent.
+	struct rudp_cc cc;			// Sender: congestion control; limits snd_nxt-hack.
+	int dupacks;				// Sender: duplicate ACKs received in a row.
+	u_int32_t recover;			// Sender: in recovery until this sequence number is acknowledged.
+	int rto_armed;				// Boolean: the retransmission timer is armed.
+	int rto_backoff;			// Sender: timer expiries since the last new ACK; doubles the timeout.
+	int skipped;				// Boolean: packets were given up on; the receiver is told with RUDP_SKIP.
+	int snd_wnd;				// Sender: the receiver's advertised window; 0 makes the sender probe.
+	int probes;				// Sender: zero-window probes the receiver has not answered.
+	int rcv_wnd;				// Receiver: the window last advertised.
+	int ackpending;				// Receiver: the datagram being processed is owed an ACK.
+	int piggyback;				// Sender: the peer takes ACKs on our data (RUDP_WND_ACKOK).
+	int v2;					// Boolean: packets to the peer have the compact header.
+	int heard;				// Receiver: a packet arrived since rudp_reap last looked.
+	int delivered;				// Sender: packets acknowledged so far.
+	struct timeval delivered_stamp;		// Sender: when delivered last increased.
+	struct timeval pace_next;		// Sender: earliest time for the next paced transmission.
+	int pacing;				// Boolean: the pacing timer is armed.
+	int batch;				// Boolean: data packets carry length-prefixed messages (RUDP_FLAG_BATCH).
+	rudp_packet* batchpkt;			// Sender: data packet being filled with messages, not yet queued.
+	int batchlen;				// Sender: bytes of batchpkt used so far.
+	int batching;				// Boolean: the timer that flushes batchpkt is armed.
+	int txqueued;				// Boolean: on the transmit scheduler's queue.
+	int deficit;				// Sender: bytes the scheduler still lets it send this round.
+	struct rudp_conn* txnext;		// Next connection on the transmit scheduler's queue.
+	struct fec_encoder* fec_tx;		// Sender: parity of the group being sent.
+	struct fec_group* fec_groups;		// Receiver: parity packets of groups not yet complete.
+	struct fec_history* fec_hist;		// Receiver: recently delivered payloads; allocated once parity is seen.
+	struct rudp_conn* next;			// Next connection on the same socket.
+};
+
+struct rudp_socket{
+	int fd;					// Socket file descriptor.
+	struct rudp_conn* conns;		// One connection per remote peer.
+	int closing;				// Boolean: rudp_close has been called; free the socket with its last connection.
+	int csum;				// Boolean: new connections checksum their packets.
+	int fec_k;				// Sender: data packets per parity packet; 0 turns FEC off.
+	int keepalive;				// Sender: seconds of idleness before a keepalive is sent; 0 is off.
+	struct rudp_cc_ops* cc_ops;		// Sender: congestion control of new connections.
+	int coalesce;				// Sender: ms a message may wait to share a packet; 0 is off.
+	int unordered;				// Boolean: new receiving connections deliver out of order.
+	int idle;				// Receiver: seconds of silence before a connection is dropped; 0 is off.
+	int weight;				// Sender: share of the transmit scheduler of its connections.
+	u_int32_t rcvseq;			// Packet number of the data being delivered; see rudp_seqno.
+	char* rxmem;				// Receive buffers given by the application, or NULL; see rudp_recv_buffers.
+	struct rudp_rxbuf* rxbufs;		// One per receive buffer.
+	int nrxbufs;				// Number of receive buffers.
+	struct rudp_rxbuf* rxfree;		// Receive buffers not in use.
+	int rxnfree;				// Number of them.
+	int rxlent;				// Descriptors handed over and not yet released.
+	struct rudp_rxdesc* rxdesc;		// Data received in this wakeup, for the batch handler.
+	int nrxdesc;				// Number of entries of rxdesc used ...
+	int rxdesclen;				// ... and allocated.
+	int rxbusy;				// Boolean: a wakeup is being processed; the socket must not be freed.
+	int rxpaused;				// Boolean: all receive buffers are in use; the socket is not read,
+						// and its connections' windows are advertised by rudp_persist.
+	int (*rxbatch_handler_callback)(rudp_socket_t, struct rudp_rxdesc *, int);
 	int (*recvfrom_handler_callback)(rudp_socket_t, struct sockaddr_in *, char *, int);
 	int (*event_handler_callback)(rudp_socket_t, rudp_event_t, struct sockaddr_in *);
 };
 
+struct rudp_submission{
+	struct rudp_socket* skt;		// Socket to send on.
+	struct sockaddr_in to;			// Destination.
+	int len;				// Length of data.
+	char data[RUDP_MAXPKTSIZE];		// Copy of the message; allocated to len bytes.
+};
+
 struct rudp_hdr createRUDPHeader(u_int16_t type, u_int32_t seqno);
 
-rudp_packet* sendSYN(int fd, struct sockaddr_in* to, int seqno);
+rudp_packet* sendSYN(struct rudp_conn* conn, struct sockaddr_in* to, u_int32_t seqno, char* data, int datalen);
+
+int rudp_output(struct rudp_conn* conn, void* packet, int len, struct sockaddr_in* dest);
+
+int outputData(struct rudp_conn* conn, struct rudp_hdr* hdr, char* data, int datalen, struct sockaddr_in* dest);
 
 rudp_packet* createRUDPPacket(u_int16_t type, u_int32_t seqno, char* data, int datalen);
 
-int send_ack(struct rudp_socket *rsocket, struct sockaddr_in *dest, int seqnum);
+int send_ack(struct rudp_conn *conn, struct sockaddr_in *dest, u_int32_t seqnum);
+
+int rcvWindow(struct rudp_conn* conn);
+
+int ackOwed(struct rudp_conn* conn);
+
+int send_data(struct rudp_conn *conn, struct sockaddr_in *dest);
+
+int sendBurst(struct rudp_conn *conn, struct sockaddr_in *dest, int* quota);
+
+int schedule(struct rudp_conn* conn);
+
+int txQuantum(struct rudp_conn* conn);
+
+void unschedule(struct rudp_conn* conn);
+
+int rudp_txrun(int argc, void* arg);
 
 int rudp_receive_data(int fd, void *arg);
 
+int rudp_received(int fd, void *arg, char *buf, int len, struct sockaddr *from);
+
 int rudp_retransmit(int argc, void *arg);
 
-struct send_data_list_buffer* createNodeBuffer(rudp_packet* packet, struct rudp_socket* skt,
+int rudp_keepalive(int argc, void *arg);
+
+int rudp_pace(int argc, void *arg);
+
+int rudp_coalesce(int argc, void *arg);
+
+int rudp_persist(int argc, void *arg);
+
+void armPersist(struct rudp_socket* skt);
+
+void flushBatch(struct rudp_conn* conn);
+
+void skipTo(struct rudp_conn* conn, u_int32_t seqno, struct sockaddr_in* dest);
+
+void deliverMessages(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen);
+
+void handOver(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen, u_int32_t seqno,
+		int frag);
+
+void reassemble(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen,
+		u_int32_t seqno, int frag);
+
+void dropMessage(struct rudp_conn* conn);
+
+void moveTo(struct rudp_conn* conn, u_int32_t seqno);
+
+void openConn(struct rudp_conn* conn, char* data, int len);
+
+int sendFragments(struct rudp_conn* conn, char* data, int len, int lifetime, int maxretrans);
+
+void resetReceiver(struct rudp_conn* conn);
+
+void dropBuffered(struct rudp_conn* conn);
+
+void flushDeliveries(struct rudp_socket* skt);
+
+int rudp_reap(int argc, void* arg);
+
+static long rudp_mem = 0;			// Bytes of packets, list nodes and connection state held, all sockets.
+static long rudp_memlimit = 0;			// Ceiling on rudp_mem beyond which load is shed; 0: none.
+static struct rudp_conn* rudp_txq = NULL;	// Connections with packets to send, all sockets, in round robin order ...
+static struct rudp_conn* rudp_txtail = NULL;	// ... and the last of them.
+static int rudp_txarmed = 0;			// Boolean: rudp_txrun is due.
+static unsigned short rudp_rand48[3];		// State of nextRandom's generator ...
+static int rudp_seeded = 0;			// ... and whether it has been seeded.
+
+/*
+ * allocMem, freeMem: allocate and release memory that counts towards rudp_mem.
+ */
+void* allocMem(size_t len){
+	void* p = malloc(len);
+	if(p != NULL){
+		rudp_mem = rudp_mem+len;
+	}
+	return p;
+}
+
+void freeMem(void* p, size_t len){
+	if(p != NULL){
+		free(p);
+		rudp_mem = rudp_mem-len;
+	}
+}
+
+/*
+ * nextRandom: a random number from 0 to 2^31-1, for ports and SYN
+ * sequence numbers. The generator is the library's own, so the
+ * application's rand() sequence is left alone. It is seeded on first use,
+ * so that a restarted peer does not reuse the previous run's numbers.
+ */
+long nextRandom(){
+	struct timeval tv;
+	if(!rudp_seeded){
+		gettimeofday(&tv, NULL);
+		rudp_rand48[0] = tv.tv_usec;
+		rudp_rand48[1] = tv.tv_sec;
+		rudp_rand48[2] = getpid();
+		rudp_seeded = 1;
+	}
+	return nrand48(rudp_rand48);
+}
+
+/*
+ * memFull: the memory ceiling is reached. New connections, new messages and
+ * copies of out-of-order packets are refused until memory is released.
+ */
+int memFull(){
+	return rudp_memlimit > 0 && rudp_mem >= rudp_memlimit;
+}
+
+/*
+ * memFits: bytes more stay under the memory ceiling.
+ */
+int memFits(long bytes){
+	return rudp_memlimit <= 0 || rudp_mem+bytes <= rudp_memlimit;
+}
+
+struct send_data_list_buffer* createNodeBuffer(rudp_packet* packet, struct rudp_conn* conn,
 		int datalen, struct sockaddr_in* dest){
 	struct send_data_list_buffer* node;
-	node = (struct send_data_list_buffer *)malloc(sizeof(struct send_data_list_buffer));
+	node = (struct send_data_list_buffer *)allocMem(sizeof(struct send_data_list_buffer));
 	memset(node, 0x0, sizeof(struct send_data_list_buffer));
 	node->packet = packet;			// Set the RUDP packet of this node.
-	node->skt = skt;			// Register the RUDP socket pointer to this node.
+	node->conn = conn;			// Register the RUDP connection pointer to this node.
 	node->datalen = datalen;		// Register the RUDP packet data length.
 	node->dest = dest;			// Register the destination address pointer.
+	node->maxretrans = -1;			// Fully reliable unless sent with rudp_sendto_partial.
 	node->next = NULL;			// This will be the current latest packet; next==NULL.
 	return node; 
 }
@@ -102,13 +371,27 @@ struct send_data_list_buffer* removeNode(struct send_data_list_buffer* head){
 	}else{					
 		tmp = head;
 		head = head->next;
-		event_timeout_delete(&rudp_retransmit, (void*)tmp);
-		free(tmp);
+		if(tmp->buf != NULL){
+			freeMem(tmp->packet, sizeof(struct rudp_hdr));
+			if(--tmp->buf->refs == 0){	// The last peer has it.
+				freeMem(tmp->buf, sizeof(struct rudp_buf)-RUDP_MAXPKTSIZE+tmp->buf->len);
+			}
+		}else{
+			freeMem(tmp->packet, sizeof(rudp_packet));
+		}
+		freeMem(tmp, sizeof(struct send_data_list_buffer));
 		return head;
 	}
 }
 
-struct send_data_list_buffer* findNode(struct send_data_list_buffer* head, int seqno){
+/*
+ * nodeData: the payload of a send buffer node.
+ */
+char* nodeData(struct send_data_list_buffer* node){
+	return node->buf != NULL ? node->buf->data : node->packet->data;
+}
+
+struct send_data_list_buffer* findNode(struct send_data_list_buffer* head, u_int32_t seqno){
 	struct send_data_list_buffer* tmp;
 	if(head==NULL)
 		return NULL;
@@ -122,274 +405,1921 @@ struct send_data_list_buffer* findNode(struct send_data_list_buffer* head, int s
 	return NULL;
 }
 
-int send_ack(struct rudp_socket* skt, struct sockaddr_in* dest, int seqnum){
-	int ret = 0;
-	rudp_packet* packet;
-	packet = createRUDPPacket(RUDP_ACK, seqnum, NULL, 0);
-	ret = sendto((int)skt->fd, (void*)packet, sizeof(struct rudp_hdr), 0,
-				(struct sockaddr*)dest, sizeof(struct sockaddr_in));
-	if(ret <= 0){
-		fprintf(stderr, "rudp: sendto fail(%d)\n", ret);
-		return -1;
+/*
+ * findConn: look up the connection to (sender) or from a remote address.
+ * Both may exist at once: a peer that sends to us can be sent to as well,
+ * over a second connection in the other direction.
+ */
+struct rudp_conn* findConn(struct rudp_socket* skt, struct sockaddr_in* addr, int sender){
+	struct rudp_conn* conn;
+	for(conn=skt->conns; conn!=NULL; conn=conn->next){
+		if(conn->sender == sender &&
+				conn->peer.sin_addr.s_addr == addr->sin_addr.s_addr &&
+				conn->peer.sin_port == addr->sin_port){
+			return conn;
+		}
 	}
-	return 0;
+	return NULL;
 }
 
-int send_data(struct rudp_socket *skt, struct sockaddr_in *dest){
-	int ret;
-	struct send_data_list_buffer* node;
-	struct timeval t , t1, t2;
-	while(skt->window_size>0){
-		node = findNode(skt->head, skt->hack+RUDP_WINDOW-skt->window_size);
-		if(node == NULL){
-			return -1;
-		}
-		node->fd = skt->fd;
-		if(ntohs(node->packet->header.type) == RUDP_FIN && skt->reachedEnd == 0){
-			skt->reachedEnd = 1;	
-			return 2;// to know its a fin
-		}
-		ret = sendto((int)skt->fd, (void *)node->packet, node->datalen+sizeof(struct rudp_hdr), 0,
-				(struct sockaddr*)dest, sizeof(struct sockaddr_in));
-		if(ret <= 0){
-			fprintf(stderr, "rudp: sendto fail(%d)\n", ret);
-			return -1;
+/*
+ * createConn: add a connection in the INIT state to the socket.
+ */
+struct rudp_conn* createConn(struct rudp_socket* skt, struct sockaddr_in* addr, int sender){
+	struct rudp_conn* conn;
+	struct timeval t, t1, t2;
+	conn = (struct rudp_conn*)allocMem(sizeof(struct rudp_conn));
+	memset(conn, 0, sizeof(struct rudp_conn));
+	conn->skt = skt;
+	conn->peer = *addr;
+	conn->sender = sender;
+	conn->state = INIT;					// Make the connection start in the INIT state.
+	rudp_cc_init(&conn->cc, skt->cc_ops);			// The window starts at RUDP_WINDOW packets.
+	conn->snd_wnd = RUDP_MAXWINDOW;				// Until the receiver advertises one.
+	conn->reachedEnd = 0;					// |-(==1): The next packtet to send is RUDP FIN.
+								// |-(==0): There are still buffered packets to send.
+	conn->csum = skt->csum;
+	conn->batch = sender && skt->coalesce > 0;
+	conn->unordered = !sender && skt->unordered;
+	conn->next = skt->conns;
+	skt->conns = conn;
+	if(sender && skt->keepalive > 0){
+		t.tv_sec = skt->keepalive;
+		t.tv_usec = 0;
+		event_gettime(&t1);
+		timeradd(&t1, &t, &t2);
+		event_timeout(t2, &rudp_keepalive, conn, "keepalive");
+	}
+	return conn;
+}
+
+/*
+ * freeSocket: release the socket once it is closed and has no connections left,
+ * and the application has given back its receive buffers.
+ */
+void freeSocket(struct rudp_socket* skt){
+	if(skt->closing && skt->conns == NULL && !skt->rxbusy && skt->rxnfree == skt->nrxbufs){
+		event_recv_delete(&rudp_received, (void*)skt);
+		event_fd_delete(&rudp_receive_data, (void*)skt);
+		event_timeout_delete(&rudp_persist, (void*)skt);
+		close(skt->fd);
+		free(skt->rxbufs);
+		free(skt->rxdesc);
+		free(skt);
+	}
+}
+
+/*
+ * freeConn: unlink a connection from its socket and release it, with any
+ * packets still buffered and their timers. Frees the socket too if it was
+ * waiting for its last connection.
+ */
+void freeConn(struct rudp_conn* conn){
+	struct rudp_socket* skt = conn->skt;
+	struct rudp_conn** prev;
+	for(prev=&skt->conns; *prev!=NULL && *prev!=conn; prev=&(*prev)->next){}
+	if(*prev != NULL){
+		*prev = conn->next;
+	}
+	while(conn->head != NULL){
+		conn->head = removeNode(conn->head);
+	}
+	resetReceiver(conn);
+	freeMem(conn->fec_tx, sizeof(struct fec_encoder));
+	event_timeout_delete(&rudp_keepalive, (void*)conn);
+	event_timeout_delete(&rudp_pace, (void*)conn);
+	event_timeout_delete(&rudp_retransmit, (void*)conn);
+	event_timeout_delete(&rudp_coalesce, (void*)conn);
+	event_timeout_delete(&rudp_reap, (void*)conn);
+	unschedule(conn);
+	freeMem(conn->batchpkt, sizeof(rudp_packet));
+	freeMem(conn, sizeof(struct rudp_conn));
+	freeSocket(skt);
+}
+
+/*
+ * armReap: run rudp_reap on a receiving connection ms milliseconds from now.
+ */
+void armReap(struct rudp_conn* conn, int ms){
+	struct timeval t, t1, t2;
+	t.tv_sec = ms/1000;
+	t.tv_usec = (ms%1000)*1000;
+	event_gettime(&t1);
+	timeradd(&t1, &t, &t2);
+	event_timeout_delete(&rudp_reap, (void*)conn);
+	if(event_timeout(t2, &rudp_reap, conn, "reap") == -1){
+		fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+	}
+}
+
+/*
+ * rudp_reap: timer callback of a receiving connection. It is freed when
+ * the socket is closed, when TIME_WAIT is over after the FIN, or when the
+ * peer has been silent for the idle time of the socket; the application
+ * is told about the last with RUDP_EVENT_TIMEOUT.
+ */
+int rudp_reap(int argc, void* arg){
+	struct rudp_conn* conn = (struct rudp_conn*)arg;
+	struct rudp_socket* skt = conn->skt;
+	struct sockaddr_in peer;
+	if(conn->state == DATA && !skt->closing){
+		if(skt->idle == 0){
+			return 0;
 		}
-		t.tv_sec = RUDP_TIMEOUT/1000;           	// Convert to seconds.
-		t.tv_usec = (RUDP_TIMEOUT%1000) * 1000; 	// Convert to microseconds.
-		gettimeofday(&t1, NULL);     			// Get current time of the day.
-		timeradd(&t1, &t, &t2);  			// Sum the timeout time with the current time of the day.
-								// Start the timeout callback with event_timeout.
-		if(event_timeout(t2, &rudp_retransmit, node, "timer_callback") == -1){
-			fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
-			return -1;
+		if(conn->heard){
+			conn->heard = 0;
+			armReap(conn, skt->idle*1000);
+			return 0;
 		}
-		skt->window_size = skt->window_size-1;
+		peer = conn->peer;
+		freeConn(conn);
+		skt->event_handler_callback((rudp_socket_t)skt, RUDP_EVENT_TIMEOUT, &peer);
+		return 0;
 	}
+	freeConn(conn);
 	return 0;
 }
 
-
-void handleINITState(struct rudp_socket* skt, rudp_packet* packet, struct sockaddr_in* dest){	
-	switch(ntohs(packet->header.type)){
-	case RUDP_SYN:
-		skt->state = DATA;
-		skt->hack = ntohl(packet->header.seqno)+1;
-		send_ack(skt, dest, skt->hack);
-		break;
-	default:
-		break;
+/*
+ * putVarint: write v as a varint to p. Returns its length.
+ */
+int putVarint(u_char* p, u_int32_t v){
+	int n = 0;
+	while(v >= 0x80){
+		p[n++] = v | 0x80;
+		v = v >> 7;
 	}
+	p[n++] = v;
+	return n;
 }
 
-void handleWAITFINACKState(struct rudp_socket* skt, rudp_packet* packet, struct sockaddr_in* dest){
-	switch(ntohs(packet->header.type)){
-	case RUDP_ACK:
-		if(ntohl(packet->header.seqno) == skt->hack+1){
-			skt->state = FIN;
-			skt->head = removeNode(skt->head);
-			skt->event_handler_callback((rudp_socket_t*)skt,RUDP_EVENT_CLOSED,dest);
-			event_fd_delete(&rudp_receive_data, (void*)skt);
-			close(skt->fd);
-			free(skt);			
-			fprintf(stdout, "File sending successful!\n");
+/*
+ * getVarint: read a varint at p, which may not reach end. Returns the
+ * byte after it, or NULL if it is cut off or too long.
+ */
+u_char* getVarint(u_char* p, u_char* end, u_int32_t* v){
+	int shift;
+	*v = 0;
+	for(shift=0; p<end && shift<35; shift=shift+7){
+		*v = *v | (u_int32_t)(*p & 0x7f) << shift;
+		if(!(*p++ & 0x80)){
+			return p;
 		}
-		break;
-	default:
-		break;
 	}
+	return NULL;
 }
 
-void handleDATAState(struct rudp_socket* skt, rudp_packet* packet, 
-		struct sockaddr_in* dest, int datalen){
-	switch(ntohs(packet->header.type)){
-	case RUDP_DATA:
-		if(ntohl(packet->header.seqno) == skt->hack){
-			skt->recvfrom_handler_callback((rudp_socket_t*)skt, dest, 
-				(char*)packet->data, datalen);
-			skt->hack = skt->hack+1;
+/*
+ * encodeHeader: write the compact header for a packet with header h (flags
+ * included) to buf. seqno and ack are counted from the SYNs already.
+ * Returns its length.
+ */
+int encodeHeader(u_char* buf, struct rudp_hdr* h, u_int32_t seqno, u_int32_t ack, u_int16_t wnd){
+	u_int16_t type = ntohs(h->type);
+	int n;
+	buf[0] = RUDP_VERSION2 << 5 | (type & RUDP_V2_TYPE);
+	buf[1] = type >> 8;
+	n = 2+putVarint(buf+2, seqno);
+	if(type & RUDP_FLAG_ACK){
+		n = n+putVarint(buf+n, ack);
+		n = n+putVarint(buf+n, wnd);
+	}
+	return n;
+}
+
+/*
+ * decodeHeader: turn the compact header of a received packet of *len bytes
+ * (checksum stripped) in buf into a struct rudp_hdr in front of its
+ * payload, which is moved up if the compact header was the shorter one;
+ * buf has room for a rudp_packet. Sequence numbers are made absolute with
+ * the SYNs of the connections to the peer, and a piggybacked ACK goes to
+ * ackhdr. Returns the packet and sets *len and *flags, or NULL if the
+ * packet is malformed or for no connection.
+ */
+rudp_packet* decodeHeader(struct rudp_socket* skt, char* buf, int* len, struct sockaddr_in* from,
+		int* flags, struct rudp_ackhdr* ackhdr){
+	u_char* p = (u_char*)buf;
+	u_char* end = p+*len;
+	struct rudp_conn *conn, *snd;
+	rudp_packet* packet;
+	u_int32_t seqno, ack = 0, wnd = 0;
+	int type = p[0] & RUDP_V2_TYPE;
+	*flags = p[1] << 8 | FLAG_V2;
+	p = getVarint(p+2, end, &seqno);
+	if(p != NULL && (*flags & (RUDP_FLAG_ACK|RUDP_FLAG_OPT))){	// Neither on plain DATA and ACK.
+		if(*flags & RUDP_FLAG_ACK){
+			if((p = getVarint(p, end, &ack)) != NULL){
+				p = getVarint(p, end, &wnd);
+			}
 		}
-		send_ack(skt, dest, skt->hack);
-		break;
-	case RUDP_ACK:
-		if(ntohl(packet->header.seqno) == skt->synseqno+1){
-			skt->head = removeNode(skt->head);
-			skt->hack = skt->hack+1;
-			skt->window_size = RUDP_WINDOW;
-		}
-		if((ntohl(packet->header.seqno) > skt->hack) && 
-				(ntohl(packet->header.seqno) <= 
-					(skt->hack+RUDP_WINDOW-skt->window_size))){
-			do{
-				skt->head = removeNode(skt->head);
-				skt->hack = skt->hack+1;
-				skt->window_size = skt->window_size+1;	
-			}while(ntohl(packet->header.seqno) > skt->hack);
-		}
-		send_data(skt,dest);			
-		break;
-	case RUDP_FIN:
-		if(ntohl(packet->header.seqno) == skt->hack){
-			skt->state = FIN;
-			skt->event_handler_callback((rudp_socket_t*)skt, RUDP_EVENT_CLOSED, dest);
-			skt->hack = skt->hack+1;
-			send_ack(skt, dest, skt->hack);
-			skt->state = INIT;
-			skt->hack = 0;
-			skt->seqno = 0;
-			skt->window_size = 0;
+		while(p != NULL && (*flags & RUDP_FLAG_OPT) && p < end && *p != RUDP_OPT_END){
+			p = p+2 <= end && p+2+p[1] <= end ? p+2+p[1] : NULL;
+		}
+		if(p != NULL && (*flags & RUDP_FLAG_OPT)){
+			p = p < end ? p+1 : NULL;		// RUDP_OPT_END.
+		}
+	}
+	if(p == NULL || end-p > (int)sizeof(struct rudp_fechdr)+RUDP_MAXPKTSIZE){
+		return NULL;
+	}
+	if((conn = findConn(skt, from, type == RUDP_ACK)) == NULL){
+		return NULL;				// Compact headers come after the SYN only.
+	}
+	if(*flags & RUDP_FLAG_ACK){
+		if((snd = findConn(skt, from, 1)) != NULL){
+			ackhdr->ack = htonl(ack+snd->synseqno);
+			ackhdr->wnd = htons(wnd);
 		}else{
-			send_ack(skt, dest, skt->hack);
+			*flags = *flags & ~RUDP_FLAG_ACK;
 		}
-		break;
-	default:
-		break;
-	
 	}
+	packet = (rudp_packet*)(p-sizeof(struct rudp_hdr));
+	if((char*)packet < buf){
+		memmove(buf+sizeof(struct rudp_hdr), p, end-p);
+		packet = (rudp_packet*)buf;
+	}
+	*len = sizeof(struct rudp_hdr)+(end-p);
+	packet->header.version = htons(RUDP_VERSION2);
+	packet->header.type = htons(type);
+	packet->header.seqno = htonl(seqno+conn->synseqno);
+	return packet;
 }
 
-void handleCLOSINGState(struct rudp_socket* skt, rudp_packet* packet, 
-		struct sockaddr_in* dest,int datalen){
-	switch(ntohs(packet->header.type)){
-	case RUDP_ACK:
-		if(ntohl(packet->header.seqno) == skt->synseqno+1){
-			skt->head = removeNode(skt->head);
-			skt->hack = skt->hack+1;
-			skt->window_size = RUDP_WINDOW;
-			send_data(skt, dest);
-		}
-		if(skt->reachedEnd ==  1){
-			if(ntohl(packet->header.seqno) == skt->seqno){
-				do{
-					skt->head = removeNode(skt->head);
-					skt->hack = skt->hack+1;
-					skt->window_size = skt->window_size+1;	
-				}while(ntohl(packet->header.seqno) > skt->hack);
-				send_data(skt, dest);
-				skt->state = WAIT_FIN_ACK;
-			}else{	
-				do{
-					skt->head = removeNode(skt->head);
-					skt->hack = skt->hack+1;
-					skt->window_size = skt->window_size+1;	
-				}while(ntohl(packet->header.seqno) > skt->hack);
-			}
+/*
+ * rudp_output: transmit a packet (header and data, len bytes in total),
+ * through the event loop, which may queue it until its next wait.
+ * A data packet to a peer that is owed an ACK carries it, flagged
+ * RUDP_FLAG_ACK. If checksums are on for the socket, the RUDP_FLAG_CSUM
+ * flag is set and a CRC32C over everything before it is appended. Peers
+ * that speak version 2 get the compact header. The stored packet is left
+ * untouched so it can be retransmitted as is.
+ */
+int rudp_output(struct rudp_conn* conn, void* packet, int len, struct sockaddr_in* dest){
+	return outputData(conn, (struct rudp_hdr*)packet, (char*)packet+sizeof(struct rudp_hdr),
+			len-sizeof(struct rudp_hdr), dest);
+}
+
+/*
+ * outputData: rudp_output for a header and data that are apart, as when
+ * the data is shared by several peers.
+ */
+int outputData(struct rudp_conn* conn, struct rudp_hdr* hdr, char* data, int datalen, struct sockaddr_in* dest){
+	struct rudp_hdr header;
+	struct rudp_ackhdr ackhdr;
+	struct rudp_conn* rcv = NULL;
+	struct iovec iov[4];
+	u_char hdr2[RUDP_V2_HDRMAX];
+	u_int32_t crc, ack = 0;
+	u_int16_t wnd = 0;
+	int n, i;
+	int ret;
+	memcpy(&header, hdr, sizeof(struct rudp_hdr));
+	if(conn->piggyback && (ntohs(header.type) & RUDP_TYPE_MASK) == RUDP_DATA){
+		rcv = findConn(conn->skt, dest, 0);
+	}
+	if(!conn->csum && !conn->v2 && (rcv == NULL || !rcv->ackpending)){
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(struct rudp_hdr);
+		n = 1;
+		if(data != (char*)hdr+sizeof(struct rudp_hdr)){
+			iov[n].iov_base = data;		// Shared data; the kernel gathers it.
+			iov[n].iov_len = datalen;
+			n++;
 		}else{
-			if((ntohl(packet->header.seqno) > skt->hack) && 
-					(ntohl(packet->header.seqno) <= 
-						(skt->hack+RUDP_WINDOW-skt->window_size))){
-				do{
-					skt->head = removeNode(skt->head);
-					skt->hack = skt->hack+1;
-					skt->window_size = skt->window_size+1;	
-				}while(ntohl(packet->header.seqno) > skt->hack);
-			}
-			send_data(skt,dest);
-		}			
-		break;
-	default:
-		break;
-	
+			iov[0].iov_len = sizeof(struct rudp_hdr)+datalen;
+		}
+		return event_sendmsg(conn->skt->fd, iov, n, (struct sockaddr*)dest, sizeof(struct sockaddr_in));
+	}
+	if(rcv != NULL && rcv->ackpending){
+		header.type = htons(ntohs(header.type) | RUDP_FLAG_ACK);
+		rcv->rcv_wnd = rcvWindow(rcv);
+		rcv->ackpending = 0;
+		ack = rcv->hack-rcv->synseqno;
+		wnd = rcv->rcv_wnd | RUDP_WND_ACKOK;
+		ackhdr.ack = htonl(rcv->hack);
+		ackhdr.wnd = htons(wnd);
+	}
+	if(conn->csum){
+		header.type = htons(ntohs(header.type) | RUDP_FLAG_CSUM);
+	}
+	n = 0;
+	if(conn->v2 && (ntohs(header.type) & RUDP_TYPE_MASK) != RUDP_SYN){
+		iov[n].iov_base = hdr2;
+		iov[n].iov_len = encodeHeader(hdr2, &header, ntohl(header.seqno)-conn->synseqno, ack, wnd);
+		n++;
+	}else{
+		iov[n].iov_base = &header;
+		iov[n].iov_len = sizeof(struct rudp_hdr);
+		n++;
+		if(ntohs(header.type) & RUDP_FLAG_ACK){
+			iov[n].iov_base = &ackhdr;
+			iov[n].iov_len = sizeof(struct rudp_ackhdr);
+			n++;
+		}
+	}
+	iov[n].iov_base = data;
+	iov[n].iov_len = datalen;
+	n++;
+	if(conn->csum){
+		crc = 0;
+		for(i=0; i<n; i++){
+			crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+		}
+		crc = htonl(crc);
+		iov[n].iov_base = &crc;
+		iov[n].iov_len = sizeof(crc);
+		n++;
+	}
+	ret = event_sendmsg(conn->skt->fd, iov, n, (struct sockaddr*)dest, sizeof(struct sockaddr_in));
+	if(ret > 0){
+		ret = sizeof(struct rudp_hdr)+datalen;	// As stored.
 	}
+	return ret;
 }
 
-int rudp_receive_data(int fd, void *arg){
-	struct rudp_socket* skt = (struct rudp_socket*)arg;
-        struct sockaddr_in dest;
-	rudp_packet rudp_data;
-	int addr_size;
-	int bytes;
-	memset(&rudp_data, 0x0, sizeof(rudp_packet));
-	addr_size = sizeof(struct sockaddr_in);
-	bytes = recvfrom((int)fd, (void*)&rudp_data, sizeof(rudp_data), 0, 
-		(struct sockaddr*)&dest, (socklen_t*)&addr_size);
-	if(bytes <= 0){
-		printf("[Error]: recvfrom failed(fd=%d).\n", fd);
+/*
+ * rudp_verify: check and strip the CRC32C of a received packet.
+ * Returns the packet length without the checksum, or -1 if it is corrupt.
+ */
+int rudp_verify(char* buf, int len){
+	u_int32_t crc;
+	if(len < (int)sizeof(crc)+2){
 		return -1;
 	}
-	switch(skt->state){
-	case INIT:
-		handleINITState(skt, &rudp_data, &dest);
-		break;
-	case DATA:
-		handleDATAState(skt, &rudp_data, &dest, bytes-sizeof(struct rudp_hdr));
-		break;
-	case CLOSING:
-		handleCLOSINGState(skt, &rudp_data, &dest, bytes-sizeof(struct rudp_hdr));
-		break;
-	case WAIT_FIN_ACK:
-		handleWAITFINACKState(skt, &rudp_data, &dest);
-	case FIN:
-		break;
-	default:
-		break;
+	len = len-sizeof(crc);
+	memcpy(&crc, buf+len, sizeof(crc));
+	if(ntohl(crc) != crc32c(0, buf, len)){
+		return -1;
 	}
-	return 0;
+	return len;
 }
 
+int send_ack(struct rudp_conn* conn, struct sockaddr_in* dest, u_int32_t seqnum){
+	int ret = 0;
+	rudp_packet packet;
+	u_int16_t wnd;
+	conn->rcv_wnd = rcvWindow(conn);
+	conn->ackpending = 0;
+	packet.header = createRUDPHeader(RUDP_ACK, seqnum);
+	wnd = htons(conn->rcv_wnd | RUDP_WND_ACKOK);
+	memcpy(packet.data, &wnd, RUDP_WNDLEN);
+	ret = rudp_output(conn, (void*)&packet, sizeof(struct rudp_hdr)+RUDP_WNDLEN, dest);
+	if(ret <= 0){
+		fprintf(stderr, "rudp: sendto fail(%d)\n", ret);
+		return -1;
+	}
+	return 0;
+}
 
-
-/* 
- * rudp_socket: Create a RUDP socket. 
- * May use a random port by setting port to zero. 
+/*
+ * ackOwed: the peer of a sending connection is owed an ACK for the
+ * datagram being processed. Data sent meanwhile waits for the end of it,
+ * to carry the ACK; see flushAck.
  */
+int ackOwed(struct rudp_conn* conn){
+	struct rudp_conn* rcv;
+	if(!conn->piggyback){
+		return 0;
+	}
+	rcv = findConn(conn->skt, &conn->peer, 0);
+	return rcv != NULL && rcv->ackpending;
+}
 
-rudp_socket_t rudp_socket(int port){
-        struct rudp_socket* skt;
-	int fd;
-	struct sockaddr_in* in;	
-	int eventRet;
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if(fd < 0){
-		fprintf(stderr, "rudp: socket error : ");
-		return NULL;
+/*
+ * flushAck: send the ACK owed to dest for the datagram just processed: on
+ * the next data packet the window lets out to it, else on its own.
+ */
+void flushAck(struct rudp_socket* skt, struct sockaddr_in* dest){
+	struct rudp_conn *rcv, *snd;
+	int quota;
+	rcv = findConn(skt, dest, 0);
+	if(rcv == NULL || !rcv->ackpending){
+		return;
 	}
-        if(port == 0){
-		port = rand()%60000 + 4711; 			// Randomize a number between 4711 and 64711.
-    	}
-    	printf("rudp_socket: Socketfd: %d, Port number: %d\n",fd, port);
-        in = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
-	bzero(in, sizeof(struct sockaddr_in));			// Reset all values inside the allocated sockadder_in structure.
-	in->sin_family = AF_INET;				// Set the socket internet family to be AF_INET.
-	in->sin_addr.s_addr = htonl(INADDR_ANY);		// Set the socket address in network byte order.
-	in->sin_port = htons(port);				// Set the socket port in network byte order.
-	if(bind(fd, (struct sockaddr*)in, sizeof(struct sockaddr_in)) == -1){
-		fprintf(stderr, "rudp: bind error\n");
-		return NULL;
+	snd = findConn(skt, dest, 1);
+	if(snd != NULL && snd->piggyback && (snd->state == DATA || snd->state == CLOSING) &&
+			snd->hack != snd->synseqno){
+		quota = RUDP_MAXPKTSIZE+sizeof(struct rudp_hdr);
+		if(sendBurst(snd, &snd->peer, &quota) == 1){	// One packet now to carry the ACK ...
+			send_data(snd, &snd->peer);		// ... the rest in turn.
+		}
 	}
-	free(in);						// Free the allocated space.
-        skt = (struct rudp_socket*)malloc(sizeof(struct rudp_socket));
-	skt->fd = fd;						// Register the socket file descriptor.
-	skt->dest = NULL;					// Set the destination to be NULL.
-	skt->state = INIT;					// Make the socket start in the INIT socket state.
-	skt->window_size = RUDP_WINDOW;				// Set the socket window size to 3.
-	skt->reachedEnd = 0;					// |-(==1): The next packtet to send is RUDP FIN.
-								// |-(==0): There are still buffered packets to send.
-	eventRet = event_fd((int)fd, &rudp_receive_data, (void*)skt, "rudp_receive_data");
-	if(eventRet < 0){
-		printf("[Error] event_fd failed: rudp_receive_data()\n");
-		return NULL;
+	if(rcv->ackpending){
+		send_ack(rcv, dest, rcv->hack);
 	}
-	return (rudp_socket_t*)skt;
 }
 
-/* 
- *rudp_close: Close socket 
- */ 
+/*
+ * rcvWindow: packets the receiver has room for: the out-of-order buffer,
+ * bounded, with application receive buffers, by the free ones and those
+ * the connection's out-of-order packets take up already.
+ */
+int rcvWindow(struct rudp_conn* conn){
+	struct recv_data_list_buffer* node;
+	int wnd = RCVBUF_SIZE;
+	int n;
+	if(conn->skt->rxmem != NULL){
+		n = conn->skt->rxnfree;
+		for(node=conn->rcvhead; node!=NULL; node=node->next){
+			n++;
+		}
+		if(n < wnd){
+			wnd = n;
+		}
+	}
+	return wnd;
+}
 
-int rudp_close(rudp_socket_t rsocket){
-	struct rudp_socket* skt;
-	struct send_data_list_buffer* node;
-	skt = (struct rudp_socket*)rsocket;
-	skt->seqno = skt->seqno+1;				// Increment the socket sequence number to be used by the FIN.
-	rudp_packet* fin = createRUDPPacket(RUDP_FIN, skt->seqno, NULL, 0);
-	node = createNodeBuffer(fin, skt, 0, skt->dest);	// Create a buffer structure for the RUDP FIN packet.
-	addNode(skt->head, node);				// Add the RUDP FIN to the buffer list.
-	skt->state = CLOSING;					// Set the state of the socket to CLOSING.
-	return 0;
+/*
+ * windowUpdate: tell the senders whose window has opened up since it was
+ * last advertised: from zero, or by a quarter of the buffer.
+ */
+void windowUpdate(struct rudp_socket* skt){
+	struct rudp_conn* conn;
+	int wnd;
+	for(conn=skt->conns; conn!=NULL; conn=conn->next){
+		if(conn->sender || conn->state != DATA){
+			continue;
+		}
+		wnd = rcvWindow(conn);
+		if(wnd > conn->rcv_wnd && (conn->rcv_wnd == 0 || wnd-conn->rcv_wnd >= RCVBUF_SIZE/4)){
+			send_ack(conn, &conn->peer, conn->hack);
+		}
+	}
 }
 
-/* 
+/*
+ * fec_flush: send the parity packet of the group being built, if any.
+ * Called when the group is full, when the sender sees a duplicate ACK (the
+ * receiver has a gap it may be able to repair), and before the FIN.
+ */
+int fec_flush(struct rudp_conn* conn, struct sockaddr_in* dest){
+	struct fec_encoder* enc = conn->fec_tx;
+	rudp_parity_packet packet;
+	int ret;
+	if(enc == NULL || enc->count == 0){
+		return 0;
+	}
+	packet.header = createRUDPHeader(RUDP_PARITY, enc->base);
+	packet.fec.k = htons(enc->count | enc->frag);
+	packet.fec.lenxor = htons(enc->lenxor);
+	memcpy(packet.data, enc->parity, enc->len);
+	enc->count = 0;
+	ret = rudp_output(conn, (void*)&packet, sizeof(struct rudp_hdr)+sizeof(struct rudp_fechdr)+enc->len, dest);
+	if(ret <= 0){
+		fprintf(stderr, "rudp: sendto fail(%d)\n", ret);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * fec_encode: add a data packet, on its first transmission, to the parity
+ * of the current group. Sends the parity packet once the group is full.
+ */
+int fec_encode(struct rudp_conn* conn, struct sockaddr_in* dest, struct send_data_list_buffer* node){
+	struct fec_encoder* enc = conn->fec_tx;
+	if(enc == NULL){
+		enc = conn->fec_tx = (struct fec_encoder *)allocMem(sizeof(struct fec_encoder));
+		memset(enc, 0, sizeof(struct fec_encoder));
+	}
+	if(enc->count > 0 && ntohl(node->packet->header.seqno) != enc->base+enc->count){
+		fec_flush(conn, dest);			// A group covers consecutive sequence numbers only.
+	}
+	if(enc->count == 0){
+		enc->base = ntohl(node->packet->header.seqno);
+		enc->len = 0;
+		enc->lenxor = 0;
+		enc->frag = 0;
+		memset(enc->parity, 0, RUDP_MAXPKTSIZE);
+	}
+	fec_xor(enc->parity, nodeData(node), node->datalen);
+	enc->lenxor ^= node->datalen;
+	enc->frag ^= ntohs(node->packet->header.type) & RUDP_FRAG_MASK;
+	if(node->datalen > enc->len){
+		enc->len = node->datalen;
+	}
+	enc->count = enc->count+1;
+	if(enc->count >= conn->skt->fec_k){
+		return fec_flush(conn, dest);
+	}
+	return 0;
+}
+
+/*
+ * armRetransmit: (re)start the retransmission timer of a sending
+ * connection to expire one retransmission timeout after from, the time
+ * the oldest unacknowledged packet was last sent. The timeout is
+ * srtt+4*rttvar (RFC 6298), doubling with every expiry that brings no
+ * new ACK, or a fixed RUDP_TIMEOUT before the first sample.
+ */
+void armRetransmit(struct rudp_conn* conn, struct timeval* from){
+	struct timeval t, t1;
+	long rto;
+	if(conn->cc.srtt == 0){				// Not backed off, so that a peer that never
+		rto = RUDP_TIMEOUT*1000L;		// answers is given up on in RUDP_MAXRETRANS+1 of them.
+	}else{
+		rto = conn->cc.srtt+4*conn->cc.rttvar;
+		if(rto < RUDP_MINRTO*1000L){
+			rto = RUDP_MINRTO*1000L;
+		}
+		rto = rto << (conn->rto_backoff < 16 ? conn->rto_backoff : 16);
+		if(rto > RUDP_MAXRTO*1000L){
+			rto = RUDP_MAXRTO*1000L;
+		}
+	}
+	t.tv_sec = rto/1000000;
+	t.tv_usec = rto%1000000;
+	timeradd(from, &t, &t1);
+	if(conn->head != NULL && conn->head->expire.tv_sec != 0 && timercmp(&conn->head->expire, &t1, <)){
+		t1 = conn->head->expire;		// Come back to give up on it instead.
+	}
+	event_timeout_delete(&rudp_retransmit, (void*)conn);
+	if(event_timeout(t1, &rudp_retransmit, conn, "timer_callback") == -1){
+		fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+		return;
+	}
+	conn->rto_armed = 1;
+}
+
+/*
+ * stopRetransmit: nothing is in flight any more.
+ */
+void stopRetransmit(struct rudp_conn* conn){
+	if(conn->rto_armed){
+		event_timeout_delete(&rudp_retransmit, (void*)conn);
+		conn->rto_armed = 0;
+	}
+}
+
+/*
+ * sendSkip: tell the receiver not to wait for the packets before hack.
+ */
+void sendSkip(struct rudp_conn* conn){
+	struct rudp_hdr header = createRUDPHeader(RUDP_SKIP, conn->hack);
+	if(rudp_output(conn, &header, sizeof(struct rudp_hdr), &conn->peer) <= 0){
+		fprintf(stderr, "rudp: sendto fail\n");
+	}
+}
+
+/*
+ * abandonHead: partial reliability. Drop the packets at the head of the
+ * send buffer whose deadline has passed, or, if lost is set, whose last
+ * retransmission was lost too, and move the receiver past them with a
+ * RUDP_SKIP. Returns the number of packets given up on.
+ */
+int abandonHead(struct rudp_conn* conn, int lost){
+	struct send_data_list_buffer* node;
+	struct timeval now;
+	int n = 0;
+	event_gettime(&now);
+	while((node = conn->head) != NULL && ntohl(node->packet->header.seqno) == conn->hack &&
+			conn->hack != conn->synseqno){
+		if(!(node->expire.tv_sec != 0 && !timercmp(&now, &node->expire, <)) &&
+				!(lost && n == 0 && node->maxretrans >= 0 && node->retransCount >= node->maxretrans)){
+			break;
+		}
+		conn->head = removeNode(conn->head);
+		conn->hack = conn->hack+1;
+		n++;
+	}
+	if(n == 0){
+		return 0;
+	}
+	if(SEQ_LT(conn->snd_nxt, conn->hack)){
+		conn->snd_nxt = conn->hack;
+	}
+	if(SEQ_LT(conn->snd_max, conn->hack)){
+		conn->snd_max = conn->hack;
+	}
+	if(conn->cc.recovery && SEQ_GEQ(conn->hack, conn->recover)){
+		conn->cc.recovery = 0;
+	}
+	conn->dupacks = 0;
+	conn->rto_backoff = 0;
+	conn->skipped = 1;
+	sendSkip(conn);
+	if(conn->snd_nxt != conn->hack && conn->head != NULL){
+		armRetransmit(conn, &conn->head->sent);
+	}else{
+		stopRetransmit(conn);
+	}
+	return n;
+}
+
+/*
+ * sndWindow: packets the sender may have in flight: the congestion window,
+ * bounded by the window the receiver advertised. A zero window still lets
+ * one packet go, the probe, which is resent on timeout until the window
+ * opens, or until the receiver stops answering it.
+ */
+int sndWindow(struct rudp_conn* conn){
+	int wnd = rudp_cc_window(&conn->cc);
+	if(conn->snd_wnd < wnd){
+		wnd = conn->snd_wnd > 0 ? conn->snd_wnd : 1;
+	}
+	return wnd;
+}
+
+/*
+ * send_data: the connection has packets it may be able to send. They go
+ * out on the next turn of the transmit scheduler, which serves all
+ * connections of the process by deficit round robin: each round, a
+ * connection may send RUDP_TXQUANTUM full packets times the weight of its
+ * socket, and one that has more waits for the others' turns. A bulk
+ * transfer then delays another connection's packets by at most one
+ * round. While no connection is waiting, it is served at once.
+ */
+int send_data(struct rudp_conn *conn, struct sockaddr_in *dest){
+	if(conn->txqueued){
+		return 0;
+	}
+	conn->deficit = 0;
+	if(rudp_txq == NULL){				// No one is waiting: its turn is now.
+		conn->deficit = txQuantum(conn);
+		if(sendBurst(conn, dest, &conn->deficit) != 1){
+			conn->deficit = 0;
+			return 0;
+		}
+	}
+	return schedule(conn);
+}
+
+/*
+ * txQuantum: bytes the connection may send per transmit scheduler round.
+ */
+int txQuantum(struct rudp_conn* conn){
+	return RUDP_TXQUANTUM*(RUDP_MAXPKTSIZE+sizeof(struct rudp_hdr))*conn->skt->weight;
+}
+
+/*
+ * schedule: put the connection at the back of the transmit scheduler's
+ * queue, and have the scheduler run if it is not due already.
+ */
+int schedule(struct rudp_conn* conn){
+	struct timeval t;
+	conn->txqueued = 1;
+	conn->txnext = NULL;
+	if(rudp_txtail == NULL){
+		rudp_txq = conn;
+	}else{
+		rudp_txtail->txnext = conn;
+	}
+	rudp_txtail = conn;
+	if(!rudp_txarmed){
+		event_gettime(&t);
+		if(event_timeout(t, &rudp_txrun, NULL, "txrun") == -1){
+			fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+			return -1;
+		}
+		rudp_txarmed = 1;
+	}
+	return 0;
+}
+
+/*
+ * unschedule: take the connection off the transmit scheduler's queue.
+ */
+void unschedule(struct rudp_conn* conn){
+	struct rudp_conn** prev;
+	if(!conn->txqueued){
+		return;
+	}
+	for(prev=&rudp_txq; *prev!=conn; prev=&(*prev)->txnext){
+		if(*prev == NULL){
+			return;
+		}
+	}
+	*prev = conn->txnext;
+	if(rudp_txtail == conn){
+		rudp_txtail = NULL;
+		for(conn=rudp_txq; conn!=NULL; conn=conn->txnext){
+			rudp_txtail = conn;
+		}
+	}
+}
+
+/*
+ * rudp_txrun: timer callback; one round of the transmit scheduler. Every
+ * connection queued when it starts gets its quantum; those stopped by
+ * it, not by their window or pacing, go to the back of the queue for the
+ * next round, after the loop has looked for input.
+ */
+int rudp_txrun(int argc, void* arg){
+	struct rudp_conn* conn;
+	struct rudp_conn* last = rudp_txtail;
+	int ret;
+	rudp_txarmed = 0;
+	while((conn = rudp_txq) != NULL){
+		rudp_txq = conn->txnext;
+		if(rudp_txq == NULL){
+			rudp_txtail = NULL;
+		}
+		conn->txnext = NULL;
+		conn->txqueued = 0;
+		conn->deficit = conn->deficit+txQuantum(conn);
+		ret = 0;
+		if(conn->state == DATA || conn->state == CLOSING){
+			ret = sendBurst(conn, &conn->peer, &conn->deficit);
+		}
+		if(ret == 1){
+			schedule(conn);				// Keeps what is left of its deficit.
+		}else{
+			conn->deficit = 0;			// Nothing more it may send now.
+		}
+		if(conn == last){
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * sendBurst: send the queued packets the congestion window allows, paced
+ * if the congestion control asks for it, and, unless quota is NULL, as
+ * long as *quota bytes cover the next one. The FIN goes out only once
+ * everything before it is acknowledged, and moves the connection to
+ * WAIT_FIN_ACK. Packets below snd_max are being sent again after a
+ * retransmission timeout. Returns 1 when stopped by the quota.
+ */
+int sendBurst(struct rudp_conn *conn, struct sockaddr_in *dest, int* quota){
+	int ret;
+	struct send_data_list_buffer* node;
+	struct timeval t, t1;
+	double rate;
+	abandonHead(conn, 0);
+	while((int)(conn->snd_nxt-conn->hack) < sndWindow(conn)){
+		node = findNode(conn->head, conn->snd_nxt);
+		if(node == NULL){
+			return -1;
+		}
+		if(quota != NULL && *quota < node->datalen+(int)sizeof(struct rudp_hdr)){
+			return 1;
+		}
+		node->fd = conn->skt->fd;
+		if(ntohs(node->packet->header.type) == RUDP_FIN){
+			if(conn->reachedEnd == 0){
+				conn->reachedEnd = 1;	
+				fec_flush(conn, dest);	// Protect the tail of the stream.
+			}
+			if(conn->hack != conn->snd_nxt){
+				return 2;		// to know its a fin
+			}
+		}
+		event_gettime(&t1);     			// Get the current time of the event loop.
+		rate = conn->cc.ops->pacing_rate(&conn->cc);
+		if(rate > 0 && ntohs(node->packet->header.type) != RUDP_FIN){
+			if(timercmp(&t1, &conn->pace_next, <)){
+				if(!conn->pacing){	// Come back when the pacing gap has passed.
+					conn->pacing = 1;
+					event_timeout(conn->pace_next, &rudp_pace, conn, "pace");
+				}
+				return 0;
+			}
+			t.tv_sec = 0;
+			t.tv_usec = 1000000/rate < 1000000 ? 1000000/rate : 999999;
+			timeradd(&t1, &t, &conn->pace_next);
+		}
+		ret = outputData(conn, &node->packet->header, nodeData(node), node->datalen, dest);
+		if(ret <= 0){
+			fprintf(stderr, "rudp: sendto fail(%d)\n", ret);
+			return -1;
+		}
+		if(quota != NULL){
+			*quota = *quota-ret;
+		}
+		if(SEQ_LT(conn->snd_nxt, conn->snd_max)){
+			node->retransCount = node->retransCount+1;	// Keeps it out of the RTT samples.
+		}else{
+			if(conn->skt->fec_k > 0 && (ntohs(node->packet->header.type) & RUDP_TYPE_MASK) == RUDP_DATA){
+				fec_encode(conn, dest, node);
+			}
+			conn->snd_max = conn->snd_nxt+1;
+		}
+		node->sent = t1;
+		node->delivered = conn->delivered;
+		node->delivered_stamp = conn->delivered > 0 ? conn->delivered_stamp : t1;
+		if(!conn->rto_armed){
+			armRetransmit(conn, &t1);		// The window was empty; this is now the oldest.
+		}
+		conn->snd_nxt = conn->snd_nxt+1;
+		if(ntohs(node->packet->header.type) == RUDP_FIN){
+			conn->state = WAIT_FIN_ACK;
+			return 2;
+		}
+	}
+	return 0;
+}
+
+/*
+ * rudp_pace: timer callback; the pacing gap has passed.
+ */
+int rudp_pace(int argc, void* arg){
+	struct rudp_conn* conn = (struct rudp_conn*)arg;
+	conn->pacing = 0;
+	if(conn->state == DATA || conn->state == CLOSING){
+		send_data(conn, &conn->peer);
+	}
+	return 0;
+}
+
+/*
+ * retransmitHead: resend the oldest unacknowledged packet (fast
+ * retransmit, and NewReno partial ACKs).
+ */
+void retransmitHead(struct rudp_conn* conn, struct sockaddr_in* dest){
+	struct send_data_list_buffer* node;
+	if(abandonHead(conn, 1) > 0){
+		return;					// Lost for good; the caller sends what follows.
+	}
+	node = conn->head;
+	if(node == NULL || ntohl(node->packet->header.seqno) != conn->hack){
+		return;
+	}
+	if(outputData(conn, &node->packet->header, nodeData(node), node->datalen, dest) <= 0){
+		fprintf(stderr, "rudp: sendto fail\n");
+		return;
+	}
+	node->retransCount = node->retransCount+1;	// Also keeps it out of the RTT samples.
+	event_gettime(&node->sent);
+}
+
+/*
+ * handleAck: an ACK on a sending connection. Releases the packets it
+ * acknowledges and feeds the congestion control with round trip time and
+ * delivery rate samples; DUPACK_THRESH duplicate ACKs mean the packet the
+ * receiver waits for was lost. The caller sends what the window allows.
+ */
+void handleAck(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen){
+	u_int32_t ack = ntohl(packet->header.seqno);
+	int acked;
+	int update = 0;
+	u_int16_t wnd = htons(RUDP_MAXWINDOW);
+	struct send_data_list_buffer* node;
+	struct timeval now, t;
+	double rate = 0;
+	event_gettime(&now);
+	if(datalen >= RUDP_WNDLEN){
+		memcpy(&wnd, packet->data, RUDP_WNDLEN);
+	}
+	wnd = ntohs(wnd);
+	conn->piggyback = (wnd & RUDP_WND_ACKOK) != 0;
+	wnd = wnd & RUDP_WND_MASK;
+	if(SEQ_GEQ(ack, conn->hack)){
+		conn->probes = 0;			// The receiver is there, even if its window stays shut.
+	}
+	if(SEQ_GEQ(ack, conn->hack) && wnd != conn->snd_wnd){	// Older ACKs may carry an older window.
+		if(conn->snd_wnd == 0){
+			conn->rto_backoff = 0;		// Done probing.
+		}
+		update = conn->snd_wnd == 0 || wnd-conn->snd_wnd >= RUDP_MAXWINDOW/4;	// As windowUpdate sends them;
+		conn->snd_wnd = wnd;			// duplicate ACKs move the window a little too.
+	}
+	if(ack == conn->synseqno+1 && conn->hack == conn->synseqno){
+		if(conn->head != NULL && conn->head->retransCount == 0){
+			timersub(&now, &conn->head->sent, &t);
+			rudp_cc_rtt(&conn->cc, t.tv_sec*1000000L + t.tv_usec);
+		}
+		conn->head = removeNode(conn->head);
+		conn->hack = conn->hack+1;
+		conn->snd_nxt = conn->hack;
+		conn->snd_max = conn->hack;
+		conn->rto_backoff = 0;
+		stopRetransmit(conn);			// The caller sends the data, which arms it again.
+		return;
+	}
+	if(conn->skipped && SEQ_LT(ack, conn->hack)){
+		sendSkip(conn);				// The receiver missed a RUDP_SKIP.
+		return;
+	}
+	if(ack == conn->hack && conn->hack != conn->synseqno){
+		if(update || conn->snd_wnd == 0){
+			return;				// A window update, or the answer to a probe; not a duplicate.
+		}
+		fec_flush(conn, dest);		// Duplicate ACK: the receiver has a gap.
+		if(conn->snd_nxt != conn->hack && ++conn->dupacks == DUPACK_THRESH){
+			if(!conn->cc.recovery){
+				conn->cc.ops->on_loss(&conn->cc, conn->snd_nxt-conn->hack);
+				conn->cc.recovery = 1;
+				conn->recover = conn->snd_max;
+			}
+			retransmitHead(conn, dest);
+		}
+		return;
+	}
+	if(SEQ_GT(ack, conn->hack) && SEQ_LEQ(ack, conn->snd_max)){
+		acked = ack-conn->hack;
+		node = findNode(conn->head, ack-1);	// The newest packet acknowledged.
+		if(node != NULL){
+			if(node->retransCount == 0 && SEQ_LEQ(ack, conn->snd_nxt)){	// Else held up by a resent packet.
+				timersub(&now, &node->sent, &t);
+				rudp_cc_rtt(&conn->cc, t.tv_sec*1000000L + t.tv_usec);
+			}
+			timersub(&now, &node->delivered_stamp, &t);
+			if(t.tv_sec*1000000L + t.tv_usec > 0){
+				rate = (conn->delivered+acked-node->delivered)*1000000.0/(t.tv_sec*1000000L + t.tv_usec);
+			}
+		}
+		while(SEQ_GT(ack, conn->hack)){
+			conn->head = removeNode(conn->head);
+			conn->hack = conn->hack+1;
+		}
+		if(SEQ_LT(conn->snd_nxt, conn->hack)){
+			conn->snd_nxt = conn->hack;	// Resent up to here after a timeout; the rest had arrived.
+		}
+		conn->delivered = conn->delivered+acked;
+		conn->delivered_stamp = now;
+		conn->dupacks = 0;
+		conn->rto_backoff = 0;
+		if(conn->snd_nxt != conn->hack && conn->head != NULL){
+			armRetransmit(conn, &conn->head->sent);	// A new oldest packet.
+		}else{
+			stopRetransmit(conn);
+		}
+		if(conn->cc.recovery){
+			if(SEQ_GEQ(ack, conn->recover)){
+				conn->cc.recovery = 0;		// Everything sent before the loss is in.
+			}else{
+				retransmitHead(conn, dest);	// Partial ACK: the next hole.
+			}
+		}
+		conn->cc.ops->on_ack(&conn->cc, acked, conn->snd_nxt-conn->hack, rate);
+	}
+}
+
+/*
+ * rxbufOf: the receive buffer a packet lies in, or NULL if it is not in one.
+ */
+struct rudp_rxbuf* rxbufOf(struct rudp_socket* skt, void* p){
+	long off = (char*)p-skt->rxmem;
+	if(skt->rxmem == NULL || off < 0 || off >= (long)skt->nrxbufs*RUDP_RXBUFSIZE){
+		return NULL;
+	}
+	return &skt->rxbufs[off/RUDP_RXBUFSIZE];
+}
+
+/*
+ * rxbufMem: the memory of a receive buffer.
+ */
+char* rxbufMem(struct rudp_socket* skt, struct rudp_rxbuf* b){
+	return skt->rxmem+(b-skt->rxbufs)*RUDP_RXBUFSIZE;
+}
+
+/*
+ * takeRxbuf: take a free receive buffer, or NULL if all are in use.
+ */
+struct rudp_rxbuf* takeRxbuf(struct rudp_socket* skt){
+	struct rudp_rxbuf* b = skt->rxfree;
+	if(b != NULL){
+		skt->rxfree = b->next;
+		skt->rxnfree--;
+		b->refs = 1;
+	}
+	return b;
+}
+
+/*
+ * unrefRxbuf: drop a use of a receive buffer; it is free after the last.
+ */
+void unrefRxbuf(struct rudp_socket* skt, struct rudp_rxbuf* b){
+	if(--b->refs == 0){
+		b->next = skt->rxfree;
+		skt->rxfree = b;
+		skt->rxnfree++;
+	}
+}
+
+/*
+ * dropPacket: release a buffered packet, which is either in a receive
+ * buffer or a copy.
+ */
+void dropPacket(struct rudp_socket* skt, rudp_packet* packet){
+	struct rudp_rxbuf* b = rxbufOf(skt, packet);
+	if(b != NULL){
+		unrefRxbuf(skt, b);
+	}else{
+		freeMem(packet, sizeof(rudp_packet));
+	}
+}
+
+/*
+ * bufferPacket: keep an out-of-order data packet, with its fragment flags,
+ * until the packets before it have arrived, in the receive buffer it
+ * arrived in if the application gave buffers, else as a copy. Duplicates
+ * are dropped.
+ */
+void bufferPacket(struct rudp_conn* conn, rudp_packet* packet, int datalen, int frag){
+	struct rudp_socket* skt = conn->skt;
+	struct recv_data_list_buffer *node, *tmp, **prev;
+	struct rudp_rxbuf* b;
+	u_int32_t seqno = ntohl(packet->header.seqno);
+	prev = &conn->rcvhead;
+	for(tmp=conn->rcvhead; tmp!=NULL; tmp=tmp->next){
+		if(ntohl(tmp->packet->header.seqno) == seqno){
+			return;				// Already buffered.
+		}
+		if(SEQ_GT(ntohl(tmp->packet->header.seqno), seqno)){
+			break;
+		}
+		prev = &tmp->next;
+	}
+	if(skt->rxmem == NULL && memFull()){
+		return;					// Shed; wait for a retransmission.
+	}
+	node = (struct recv_data_list_buffer *)allocMem(sizeof(struct recv_data_list_buffer));
+	if(skt->rxmem == NULL){
+		node->packet = (rudp_packet*)allocMem(sizeof(rudp_packet));
+		memcpy(node->packet, packet, sizeof(struct rudp_hdr)+datalen);
+	}else if((b = rxbufOf(skt, packet)) != NULL){
+		b->refs++;				// Held where it was received.
+		node->packet = packet;
+	}else if((b = takeRxbuf(skt)) != NULL){		// Rebuilt by FEC.
+		node->packet = (rudp_packet*)rxbufMem(skt, b);
+		memcpy(node->packet, packet, sizeof(struct rudp_hdr)+datalen);
+	}else{
+		freeMem(node, sizeof(struct recv_data_list_buffer));				// Out of buffers; wait for a retransmission.
+		return;
+	}
+	node->datalen = datalen;
+	node->frag = frag;
+	node->next = tmp;
+	*prev = node;
+}
+
+/*
+ * findBuffered: look up a buffered out-of-order packet by sequence number.
+ */
+struct recv_data_list_buffer* findBuffered(struct rudp_conn* conn, u_int32_t seqno){
+	struct recv_data_list_buffer* tmp;
+	for(tmp=conn->rcvhead; tmp!=NULL; tmp=tmp->next){
+		if(ntohl(tmp->packet->header.seqno) == seqno){
+			return tmp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * deliverData: pass data to the application: to the receive handler, or
+ * as a descriptor for the batch handler, which keeps the receive buffer
+ * the data is in until it is released. frag links the descriptors of the
+ * fragments of a message.
+ */
+void deliverData(struct rudp_conn* conn, struct sockaddr_in* dest, char* data, int len, int frag){
+	struct rudp_socket* skt = conn->skt;
+	struct rudp_rxbuf* b;
+	struct rudp_rxdesc* d;
+	if(skt->rxmem == NULL){
+		skt->recvfrom_handler_callback((rudp_socket_t*)skt, dest, data, len);
+		return;
+	}
+	if((b = rxbufOf(skt, data)) == NULL){
+		return;
+	}
+	if(skt->nrxdesc == skt->rxdesclen){
+		skt->rxdesclen = skt->rxdesclen > 0 ? 2*skt->rxdesclen : RUDP_RXBATCH;
+		skt->rxdesc = (struct rudp_rxdesc *)realloc(skt->rxdesc, skt->rxdesclen*sizeof(struct rudp_rxdesc));
+	}
+	d = &skt->rxdesc[skt->nrxdesc++];
+	d->buf = rxbufMem(skt, b);
+	d->data = data;
+	d->len = len;
+	d->from = *dest;
+	d->seqno = skt->rcvseq;
+	d->more = (frag & RUDP_FLAG_MORE) != 0;
+	d->cont = (frag & RUDP_FLAG_CONT) != 0;
+	b->refs++;
+	skt->rxlent++;
+}
+
+/*
+ * flushDeliveries: call the batch handler with the data received so far.
+ */
+void flushDeliveries(struct rudp_socket* skt){
+	int n = skt->nrxdesc;
+	if(n > 0){
+		skt->nrxdesc = 0;
+		skt->rxbatch_handler_callback((rudp_socket_t*)skt, skt->rxdesc, n);
+	}
+}
+
+/*
+ * deliverMessages: split the payload of a coalescing connection's packet
+ * back into the messages the sender passed to rudp_sendto.
+ */
+void deliverMessages(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen){
+	u_int16_t len;
+	int off = 0;
+	while(off+RUDP_MSGHDRLEN <= datalen){
+		memcpy(&len, packet->data+off, RUDP_MSGHDRLEN);
+		len = ntohs(len);
+		off = off+RUDP_MSGHDRLEN;
+		if(off+len > datalen){
+			fprintf(stderr, "rudp: dropped truncated message\n");
+			return;
+		}
+		deliverData(conn, dest, (char*)packet->data+off, len, 0);
+		off = off+len;
+	}
+}
+
+/*
+ * deliverPacket: hand the next in-order packet to the application. Once the
+ * sender is known to use FEC, a copy is kept for rebuilding later packets
+ * of the same group.
+ */
+void deliverPacket(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen, int frag){
+	handOver(conn, packet, dest, datalen, conn->hack, frag);
+	conn->hack = conn->hack+1;
+}
+
+/*
+ * handOver: pass packet seqno to the application, and keep a copy for FEC
+ * once the sender is known to use it. Fragments go to reassemble; on an
+ * ordered connection, a message still on the way when a packet of another
+ * arrives was cut short by a skip.
+ */
+void handOver(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen, u_int32_t seqno,
+		int frag){
+	struct fec_history* hist = conn->fec_hist;
+	int slot;
+	conn->skt->rcvseq = seqno-conn->synseqno;
+	if(ntohs(packet->header.type) != RUDP_KEEPALIVE &&
+			(conn->skt->rxmem != NULL || conn->skt->recvfrom_handler_callback != NULL)){
+		if(frag == 0 && conn->reasmlen > 0 && !conn->unordered){
+			dropMessage(conn);
+		}
+		if(frag != 0){
+			reassemble(conn, packet, dest, datalen, seqno, frag);
+		}else if(conn->batch){
+			deliverMessages(conn, packet, dest, datalen);
+		}else{
+			deliverData(conn, dest, (char*)packet->data, datalen, 0);
+		}
+	}
+	if(hist != NULL){
+		slot = seqno%RUDP_FEC_MAXK;
+		hist->valid[slot] = 1;
+		hist->seqno[slot] = seqno;
+		hist->datalen[slot] = datalen;
+		hist->frag[slot] = frag;
+		memcpy(hist->data[slot], packet->data, datalen);
+	}
+}
+
+/*
+ * reassemble: take the next fragment of a message. The fragments are
+ * copied together and the message handed over with the last of them;
+ * with receive buffers, each is handed over as it comes, as a link of a
+ * descriptor chain. A fragment that does not follow the one before, which
+ * the sender gave up on, ends the message on the way, and the rest of a
+ * message cut short is dropped.
+ */
+void reassemble(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen,
+		u_int32_t seqno, int frag){
+	struct rudp_socket* skt = conn->skt;
+	char* data = packet->data;
+	u_int32_t len;
+	if(conn->reasmlen > 0 && (!(frag & RUDP_FLAG_CONT) || seqno != conn->reasmnext)){
+		dropMessage(conn);
+	}
+	if(!(frag & RUDP_FLAG_CONT)){			// The first: the length of the message, then data.
+		if(datalen < RUDP_FRAGHDRLEN){
+			return;
+		}
+		memcpy(&len, data, RUDP_FRAGHDRLEN);
+		len = ntohl(len);
+		data = data+RUDP_FRAGHDRLEN;
+		datalen = datalen-RUDP_FRAGHDRLEN;
+		if(len <= datalen || len > RUDP_MAXMSGSIZE){
+			fprintf(stderr, "rudp: dropped message of bad length\n");
+			return;
+		}
+		if(skt->rxmem == NULL && (conn->reasm = (char*)allocMem(len)) == NULL){
+			return;
+		}
+		conn->reasmlen = len;
+		conn->reasmoff = 0;
+	}
+	if(conn->reasmlen == 0){
+		return;					// The rest of a message cut short.
+	}
+	if(conn->reasmoff+datalen > conn->reasmlen ||
+			(!(frag & RUDP_FLAG_MORE) && conn->reasmoff+datalen != conn->reasmlen)){
+		fprintf(stderr, "rudp: dropped truncated message\n");
+		dropMessage(conn);
+		return;
+	}
+	conn->reasmnext = seqno+1;
+	if(skt->rxmem != NULL){
+		deliverData(conn, dest, data, datalen, frag);
+	}else{
+		memcpy(conn->reasm+conn->reasmoff, data, datalen);
+	}
+	conn->reasmoff = conn->reasmoff+datalen;
+	if(!(frag & RUDP_FLAG_MORE)){
+		data = conn->reasm;
+		len = conn->reasmlen;
+		conn->reasm = NULL;
+		conn->reasmlen = 0;
+		if(data != NULL){
+			deliverData(conn, dest, data, len, 0);
+			freeMem(data, len);
+		}
+	}
+}
+
+/*
+ * dropMessage: give up on the fragmented message being put together.
+ */
+void dropMessage(struct rudp_conn* conn){
+	freeMem(conn->reasm, conn->reasmlen);
+	conn->reasm = NULL;
+	conn->reasmlen = 0;
+}
+
+/*
+ * holdBack: on an unordered connection, a packet with fragment flags frag
+ * must wait for the packets before it: fragments are put together in
+ * order, and with receive buffers nothing may come between the
+ * descriptors of a message.
+ */
+int holdBack(struct rudp_conn* conn, int frag){
+	return frag != 0 || (conn->reasmlen > 0 && conn->skt->rxmem != NULL);
+}
+
+/*
+ * receiveUnordered: deliver a data packet right away unless it is a
+ * duplicate, which the bitmap of the receive window tells. hack still
+ * moves over the packets delivered without a gap, for the ACKs. Some
+ * packets wait for those before them, see holdBack.
+ */
+void receiveUnordered(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen,
+		int frag){
+	u_int32_t seqno = ntohl(packet->header.seqno);
+	u_int32_t off = seqno-conn->hack;		// Wraps around for older packets.
+	if(off >= RCVBUF_SIZE || (conn->rcvmap >> off) & 1){
+		return;					// Old, duplicate, or beyond the window.
+	}
+	if(off > 0 && holdBack(conn, frag)){
+		bufferPacket(conn, packet, datalen, frag);
+		return;
+	}
+	conn->rcvmap |= (u_int64_t)1 << off;
+	handOver(conn, packet, dest, datalen, seqno, frag);
+	while(conn->rcvmap & 1){
+		conn->rcvmap >>= 1;
+		conn->hack = conn->hack+1;
+	}
+}
+
+/*
+ * isDelivered: the packet has been handed to the application.
+ */
+int isDelivered(struct rudp_conn* conn, u_int32_t seqno){
+	u_int32_t off = seqno-conn->hack;
+	if(SEQ_LT(seqno, conn->hack)){
+		return 1;
+	}
+	return conn->unordered && off < RCVBUF_SIZE && (conn->rcvmap >> off) & 1;
+}
+
+/*
+ * deliverBuffered: deliver buffered packets that are now in order.
+ */
+void deliverBuffered(struct rudp_conn* conn, struct sockaddr_in* dest){
+	struct recv_data_list_buffer *node, **prev;
+	prev = &conn->rcvhead;
+	while(conn->unordered && (node = *prev) != NULL){	// Only packets held back or rebuilt by FEC wait here.
+		if(ntohl(node->packet->header.seqno) != conn->hack && holdBack(conn, node->frag)){
+			prev = &node->next;		// Not its turn yet.
+			continue;
+		}
+		*prev = node->next;
+		receiveUnordered(conn, node->packet, dest, node->datalen, node->frag);
+		dropPacket(conn->skt, node->packet);
+		freeMem(node, sizeof(struct recv_data_list_buffer));
+		prev = &conn->rcvhead;			// hack may have moved.
+	}
+	while(conn->rcvhead != NULL && ntohl(conn->rcvhead->packet->header.seqno) == conn->hack){
+		node = conn->rcvhead;
+		conn->rcvhead = node->next;
+		deliverPacket(conn, node->packet, dest, node->datalen, node->frag);
+		dropPacket(conn->skt, node->packet);
+		freeMem(node, sizeof(struct recv_data_list_buffer));
+	}
+}
+
+/*
+ * skipTo: the sender gave up on the packets before seqno. Those that did
+ * arrive are delivered, the others are never waited for.
+ */
+void skipTo(struct rudp_conn* conn, u_int32_t seqno, struct sockaddr_in* dest){
+	struct recv_data_list_buffer* node;
+	while(conn->rcvhead != NULL && SEQ_LT(ntohl(conn->rcvhead->packet->header.seqno), seqno)){
+		node = conn->rcvhead;
+		conn->rcvhead = node->next;
+		moveTo(conn, ntohl(node->packet->header.seqno));
+		if(conn->unordered){
+			receiveUnordered(conn, node->packet, dest, node->datalen, node->frag);
+		}else{
+			deliverPacket(conn, node->packet, dest, node->datalen, node->frag);
+		}
+		dropPacket(conn->skt, node->packet);
+		freeMem(node, sizeof(struct recv_data_list_buffer));
+	}
+	moveTo(conn, seqno);
+	deliverBuffered(conn, dest);
+}
+
+/*
+ * moveTo: make seqno the next expected sequence number, if it is ahead.
+ */
+void moveTo(struct rudp_conn* conn, u_int32_t seqno){
+	if(!SEQ_GT(seqno, conn->hack)){
+		return;
+	}
+	if(SEQ_LT(seqno, conn->hack+RCVBUF_SIZE)){
+		conn->rcvmap >>= seqno-conn->hack;
+	}else{
+		conn->rcvmap = 0;
+	}
+	conn->hack = seqno;
+	while(conn->rcvmap & 1){			// Unordered: delivered beyond it already.
+		conn->rcvmap >>= 1;
+		conn->hack = conn->hack+1;
+	}
+}
+
+/*
+ * fec_store: keep a received parity packet until its group is complete
+ * or can be repaired.
+ */
+void fec_store(struct rudp_conn* conn, rudp_parity_packet* packet, int datalen){
+	struct fec_group *group, *tmp, **prev;
+	int k = ntohs(packet->fec.k) & RUDP_FEC_KMASK;
+	int n = 0;
+	datalen = datalen-sizeof(struct rudp_fechdr);
+	if(k <= 0 || k > RUDP_FEC_MAXK || datalen < 0 ||
+			SEQ_LEQ(ntohl(packet->header.seqno)+k, conn->hack)){
+		return;					// Bad, or the group is already delivered.
+	}
+	if(memFull()){
+		return;					// Shed; retransmissions repair the group instead.
+	}
+	if(conn->fec_hist == NULL){
+		conn->fec_hist = (struct fec_history *)allocMem(sizeof(struct fec_history));
+		memset(conn->fec_hist, 0, sizeof(struct fec_history));
+	}
+	for(tmp=conn->fec_groups; tmp!=NULL; tmp=tmp->next){
+		if(tmp->base == ntohl(packet->header.seqno)){
+			return;				// Duplicate.
+		}
+		n++;
+	}
+	if(n >= FEC_MAXGROUPS){				// Drop the oldest group.
+		tmp = conn->fec_groups;
+		conn->fec_groups = tmp->next;
+		freeMem(tmp, sizeof(struct fec_group));
+	}
+	for(prev=&conn->fec_groups; *prev!=NULL; prev=&(*prev)->next){}
+	group = (struct fec_group *)allocMem(sizeof(struct fec_group));
+	group->base = ntohl(packet->header.seqno);
+	group->k = k;
+	group->len = datalen;
+	group->lenxor = ntohs(packet->fec.lenxor);
+	group->frag = ntohs(packet->fec.k) & RUDP_FRAG_MASK;
+	memcpy(group->parity, packet->data, datalen);
+	group->next = NULL;
+	*prev = group;
+}
+
+/*
+ * fec_recover: rebuild lost data packets from stored parity. A group can be
+ * repaired when exactly one of its packets is missing; the missing packet
+ * is the XOR of the parity and the others. Rebuilt packets go into the
+ * out-of-order buffer. Returns the number of packets rebuilt.
+ */
+int fec_recover(struct rudp_conn* conn){
+	struct fec_group *group, **prev;
+	struct recv_data_list_buffer* node;
+	struct fec_history* hist = conn->fec_hist;
+	rudp_packet packet;
+	u_int32_t seqno, missing = 0;
+	int nmissing, unusable, len, frag, slot, i;
+	int recovered = 0;
+	prev = &conn->fec_groups;
+	while((group = *prev) != NULL){
+		if(SEQ_LEQ(group->base+group->k, conn->hack)){
+			*prev = group->next;		// Complete; parity no longer needed.
+			freeMem(group, sizeof(struct fec_group));
+			continue;
+		}
+		nmissing = 0;
+		unusable = 0;
+		for(i=0; i<group->k; i++){
+			seqno = group->base+i;
+			if(isDelivered(conn, seqno)){
+				slot = seqno%RUDP_FEC_MAXK;
+				if(!hist->valid[slot] || hist->seqno[slot] != seqno){
+					unusable = 1;	// Delivered before the parity was seen.
+				}
+			}else if(findBuffered(conn, seqno) == NULL){
+				nmissing++;
+				missing = seqno;
+			}
+		}
+		if(unusable){
+			*prev = group->next;
+			freeMem(group, sizeof(struct fec_group));
+			continue;
+		}
+		if(nmissing != 1){
+			prev = &group->next;		// Nothing to do, or too many losses.
+			continue;
+		}
+		memset(&packet, 0, sizeof(rudp_packet));
+		memcpy(packet.data, group->parity, group->len);
+		len = group->lenxor;
+		frag = group->frag;
+		for(i=0; i<group->k; i++){
+			seqno = group->base+i;
+			if(seqno == missing){
+				continue;
+			}
+			if(isDelivered(conn, seqno)){
+				slot = seqno%RUDP_FEC_MAXK;
+				fec_xor(packet.data, hist->data[slot], hist->datalen[slot]);
+				len ^= hist->datalen[slot];
+				frag ^= hist->frag[slot];
+			}else{
+				node = findBuffered(conn, seqno);
+				fec_xor(packet.data, node->packet->data, node->datalen);
+				len ^= node->datalen;
+				frag ^= node->frag;
+			}
+		}
+		*prev = group->next;
+		freeMem(group, sizeof(struct fec_group));
+		if(len < 0 || len > RUDP_MAXPKTSIZE){
+			continue;
+		}
+		packet.header = createRUDPHeader(RUDP_DATA, missing);
+		bufferPacket(conn, &packet, len, frag);
+		recovered++;
+	}
+	return recovered;
+}
+
+/*
+ * dropBuffered: drop the out-of-order packets; the sender retransmits them.
+ */
+void dropBuffered(struct rudp_conn* conn){
+	struct recv_data_list_buffer* node;
+	while((node = conn->rcvhead) != NULL){
+		conn->rcvhead = node->next;
+		dropPacket(conn->skt, node->packet);
+		freeMem(node, sizeof(struct recv_data_list_buffer));
+	}
+}
+
+/*
+ * resetReceiver: drop all receive-side buffering, e.g. when the connection
+ * is finished.
+ */
+void resetReceiver(struct rudp_conn* conn){
+	struct fec_group* group;
+	dropBuffered(conn);
+	while((group = conn->fec_groups) != NULL){
+		conn->fec_groups = group->next;
+		freeMem(group, sizeof(struct fec_group));
+	}
+	freeMem(conn->fec_hist, sizeof(struct fec_history));
+	conn->fec_hist = NULL;
+	conn->rcvmap = 0;
+	dropMessage(conn);
+}
+
+void handleINITState(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest, int datalen){	
+	switch(ntohs(packet->header.type)){
+	case RUDP_SYN:
+		if(conn->synseqno != 0 && ntohl(packet->header.seqno) == conn->synseqno){
+			break;				// Stray duplicate of a finished connection; don't deliver again.
+		}
+		conn->state = DATA;
+		conn->synseqno = ntohl(packet->header.seqno);
+		conn->hack = conn->synseqno;
+		if(conn->skt->idle > 0){
+			armReap(conn, conn->skt->idle*1000);
+		}
+		if(datalen > 0){			// The SYN carries the first message.
+			deliverPacket(conn, packet, dest, datalen, 0);
+		}else{
+			conn->hack = conn->hack+1;
+		}
+		send_ack(conn, dest, conn->hack);
+		break;
+	case RUDP_FIN:
+		if(conn->synseqno != 0 && ntohl(packet->header.seqno) == conn->hack-1){
+			send_ack(conn, dest, conn->hack);	// Our FIN ACK was lost.
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void handleWAITFINACKState(struct rudp_conn* conn, rudp_packet* packet, struct sockaddr_in* dest){
+	switch(ntohs(packet->header.type)){
+	case RUDP_ACK:
+		if(conn->skipped && SEQ_LT(ntohl(packet->header.seqno), conn->hack)){
+			sendSkip(conn);			// The receiver missed a RUDP_SKIP.
+		}
+		if(ntohl(packet->header.seqno) == conn->hack+1){
+			conn->state = FIN;
+			conn->head = removeNode(conn->head);
+			flushDeliveries(conn->skt);	// Data received before goes first.
+			conn->skt->event_handler_callback((rudp_socket_t*)conn->skt,RUDP_EVENT_CLOSED,dest);
+			freeConn(conn);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void handleDATAState(struct rudp_conn* conn, rudp_packet* packet, 
+		struct sockaddr_in* dest, int datalen, int frag){
+	switch(ntohs(packet->header.type)){
+	case RUDP_DATA:
+	case RUDP_KEEPALIVE:
+		conn->ackpending = 1;			// Sent once the datagram is processed; see flushAck.
+		if(conn->unordered){
+			receiveUnordered(conn, packet, dest, datalen, frag);
+			deliverBuffered(conn, dest);
+		}else if(ntohl(packet->header.seqno) == conn->hack){
+			deliverPacket(conn, packet, dest, datalen, frag);
+			deliverBuffered(conn, dest);
+		}else if(SEQ_GT(ntohl(packet->header.seqno), conn->hack) &&
+				SEQ_LT(ntohl(packet->header.seqno), conn->hack+RCVBUF_SIZE)){
+			bufferPacket(conn, packet, datalen, frag);
+		}
+		if(conn->fec_groups != NULL && fec_recover(conn) > 0){
+			deliverBuffered(conn, dest);
+		}
+		break;
+	case RUDP_SYN:
+		if(ntohl(packet->header.seqno) == conn->synseqno){
+			send_ack(conn, dest, conn->hack);	// Our SYN ACK was lost; the payload was delivered already.
+		}
+		break;
+	case RUDP_SKIP:
+		if(SEQ_GT(ntohl(packet->header.seqno), conn->hack)){
+			skipTo(conn, ntohl(packet->header.seqno), dest);
+		}
+		send_ack(conn, dest, conn->hack);
+		break;
+	case RUDP_PARITY:
+		fec_store(conn, (rudp_parity_packet*)packet, datalen);
+		if(conn->fec_groups != NULL && fec_recover(conn) > 0){
+			deliverBuffered(conn, dest);
+			send_ack(conn, dest, conn->hack);
+		}
+		break;
+	case RUDP_ACK:
+		handleAck(conn, packet, dest, datalen);
+		send_data(conn,dest);			
+		break;
+	case RUDP_FIN:
+		if(ntohl(packet->header.seqno) == conn->hack){
+			conn->state = FIN;
+			flushDeliveries(conn->skt);	// Data received before goes first.
+			conn->skt->event_handler_callback((rudp_socket_t*)conn->skt, RUDP_EVENT_CLOSED, dest);
+			conn->hack = conn->hack+1;
+			send_ack(conn, dest, conn->hack);
+			resetReceiver(conn);
+			conn->state = INIT;		// hack is kept to answer a retransmitted FIN.
+			conn->seqno = 0;
+			armReap(conn, conn->skt->closing ? 0 : RUDP_TIMEWAIT);
+		}else{
+			send_ack(conn, dest, conn->hack);
+		}
+		break;
+	default:
+		break;
+	
+	}
+}
+
+void handleCLOSINGState(struct rudp_conn* conn, rudp_packet* packet, 
+		struct sockaddr_in* dest,int datalen){
+	switch(ntohs(packet->header.type)){
+	case RUDP_ACK:
+		handleAck(conn, packet, dest, datalen);
+		send_data(conn, dest);			// Sends the FIN once everything before it is acknowledged.
+		break;
+	default:
+		break;
+	
+	}
+}
+
+/*
+ * dispatch: pass a received packet, len bytes in total, to its
+ * connection. A SYN opens a receiving connection.
+ */
+void dispatch(struct rudp_socket* skt, rudp_packet* packet, int len, struct sockaddr_in* dest,
+		int flags){
+	struct rudp_conn* conn;
+	conn = findConn(skt, dest, ntohs(packet->header.type) == RUDP_ACK);	// ACKs are for our sending side.
+	if(conn == NULL){
+		if(ntohs(packet->header.type) != RUDP_SYN || skt->closing || memFull()){
+			return;					// Not part of any connection, or no room for one.
+		}
+		conn = createConn(skt, dest, 0);
+	}
+	if(!conn->sender){
+		if(skt->closing){
+			return;					// Freed by rudp_reap.
+		}
+		conn->heard = 1;
+	}
+	if(flags & RUDP_FLAG_CSUM){
+		conn->csum = 1;					// Checksummed; answer in kind.
+	}
+	if(flags & FLAG_V2){
+		conn->v2 = 1;					// The peer speaks version 2.
+	}
+	if(conn->state == INIT && ntohs(packet->header.type) == RUDP_SYN){
+		conn->batch = (flags & RUDP_FLAG_BATCH) != 0;	// The SYN says how its data are framed,
+		conn->v2 = ntohs(packet->header.version) >= RUDP_VERSION2;	// and which headers to answer with.
+	}
+	switch(conn->state){
+	case INIT:
+		handleINITState(conn, packet, dest, len-sizeof(struct rudp_hdr));
+		break;
+	case DATA:
+		handleDATAState(conn, packet, dest, len-sizeof(struct rudp_hdr), flags & RUDP_FRAG_MASK);
+		break;
+	case CLOSING:
+		handleCLOSINGState(conn, packet, dest, len-sizeof(struct rudp_hdr));
+		break;
+	case WAIT_FIN_ACK:
+		handleWAITFINACKState(conn, packet, dest);
+	case FIN:
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * rudp_input: process one received datagram of bytes bytes from dest.
+ * The data of a packet with a piggybacked ACK go first, so that their own
+ * ACK can ride on the data the piggybacked one lets out.
+ */
+void rudp_input(struct rudp_socket* skt, rudp_packet* rudp_data, int bytes, struct sockaddr_in* dest){
+	struct rudp_ackhdr ackhdr;
+	rudp_packet ack;
+	u_char* p = (u_char*)rudp_data;
+	int flags;
+	int piggy;
+	int busy;
+	if(bytes < 2 || (p[0] != 0 && p[0] >> 5 != RUDP_VERSION2) ||
+			(p[0] == 0 && bytes < (int)sizeof(struct rudp_hdr))){
+		return;						// Runt, or not a version we speak.
+	}
+	flags = p[0] != 0 ? p[1] << 8 : ntohs(rudp_data->header.type) & ~RUDP_TYPE_MASK;
+	if(flags & RUDP_FLAG_CSUM){
+		if((bytes = rudp_verify((char*)rudp_data, bytes)) < 0){
+			fprintf(stderr, "rudp: dropped packet with bad checksum\n");
+			return;
+		}
+	}
+	if(p[0] != 0){
+		if((rudp_data = decodeHeader(skt, (char*)rudp_data, &bytes, dest, &flags, &ackhdr)) == NULL){
+			return;
+		}
+	}else{
+		rudp_data->header.type = htons(ntohs(rudp_data->header.type) & RUDP_TYPE_MASK);
+		if((flags & RUDP_FLAG_ACK) && ntohs(rudp_data->header.type) == RUDP_DATA){
+			if(bytes < (int)(sizeof(struct rudp_hdr)+sizeof(struct rudp_ackhdr))){
+				return;
+			}
+			memcpy(&ackhdr, rudp_data->data, sizeof(struct rudp_ackhdr));
+			memmove((char*)rudp_data+sizeof(struct rudp_ackhdr), rudp_data, sizeof(struct rudp_hdr));
+			rudp_data = (rudp_packet*)((char*)rudp_data+sizeof(struct rudp_ackhdr));
+			bytes = bytes-sizeof(struct rudp_ackhdr);
+		}
+	}
+	piggy = (flags & RUDP_FLAG_ACK) && ntohs(rudp_data->header.type) == RUDP_DATA;
+	if(bytes-(int)sizeof(struct rudp_hdr) > (ntohs(rudp_data->header.type) == RUDP_PARITY ?
+			(int)sizeof(struct rudp_fechdr)+RUDP_MAXPKTSIZE : RUDP_MAXPKTSIZE)){
+		return;						// Oversized; not one of ours.
+	}
+	busy = skt->rxbusy;
+	skt->rxbusy = 1;				// Keep the socket while handlers may close it.
+	dispatch(skt, rudp_data, bytes, dest, flags);
+	if(piggy){
+		ack.header = createRUDPHeader(RUDP_ACK, ntohl(ackhdr.ack));
+		memcpy(ack.data, &ackhdr.wnd, RUDP_WNDLEN);
+		dispatch(skt, &ack, sizeof(struct rudp_hdr)+RUDP_WNDLEN, dest, flags & FLAG_V2);
+	}
+	flushAck(skt, dest);
+	skt->rxbusy = busy;
+	freeSocket(skt);
+}
+
+/*
+ * rudp_receive_data: the socket has receive buffers and is readable. Read
+ * up to RUDP_RXBATCH datagrams straight into free receive buffers and
+ * process them, then hand the data over to the batch handler in one
+ * call. When no buffer is left free, the socket is not read until one is
+ * released; buffers only held by out-of-order packets are reclaimed
+ * first, or nothing would ever release them.
+ */
+int rudp_receive_data(int fd, void *arg){
+	struct rudp_socket* skt = (struct rudp_socket*)arg;
+	struct mmsghdr msgs[RUDP_RXBATCH];
+	struct iovec iov[RUDP_RXBATCH];
+	struct sockaddr_in from[RUDP_RXBATCH];
+	struct rudp_rxbuf* bufs[RUDP_RXBATCH];
+	struct rudp_conn* conn;
+	int n, got, i;
+	for(n=0; n<RUDP_RXBATCH && skt->rxfree!=NULL; n++){
+		bufs[n] = takeRxbuf(skt);
+		iov[n].iov_base = rxbufMem(skt, bufs[n]);
+		iov[n].iov_len = RUDP_RXBUFSIZE;
+		memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[n].msg_hdr.msg_name = &from[n];
+		msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+	got = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+	if(got < 0){
+		for(i=0; i<n; i++){
+			unrefRxbuf(skt, bufs[i]);
+		}
+		if(errno == EAGAIN){
+			return 0;
+		}
+		printf("[Error]: recvmmsg failed(fd=%d).\n", fd);
+		return -1;
+	}
+	skt->rxbusy = 1;				// Keep the socket while handlers may close it.
+	for(i=0; i<got; i++){
+		rudp_input(skt, (rudp_packet*)iov[i].iov_base, msgs[i].msg_len, &from[i]);
+	}
+	for(i=0; i<n; i++){
+		unrefRxbuf(skt, bufs[i]);		// Free unless buffered or handed over.
+	}
+	flushDeliveries(skt);
+	skt->rxbusy = 0;
+	if(skt->rxfree == NULL && skt->rxlent == 0){
+		for(conn=skt->conns; conn!=NULL; conn=conn->next){
+			dropBuffered(conn);
+		}
+	}
+	if(skt->rxfree == NULL && !skt->rxpaused){
+		event_fd_delete(&rudp_receive_data, (void*)skt);
+		skt->rxpaused = 1;
+		armPersist(skt);
+	}
+	freeSocket(skt);				// If it was closed meanwhile.
+	return 0;
+}
+
+/*
+ * armPersist: run rudp_persist on a paused socket RUDP_TIMEOUT ms from now.
+ */
+void armPersist(struct rudp_socket* skt){
+	struct timeval t, t1, t2;
+	t.tv_sec = RUDP_TIMEOUT/1000;
+	t.tv_usec = (RUDP_TIMEOUT%1000)*1000;
+	event_gettime(&t1);
+	timeradd(&t1, &t, &t2);
+	if(event_timeout(t2, &rudp_persist, skt, "persist") == -1){
+		fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+	}
+}
+
+/*
+ * rudp_persist: timer callback of a socket that is not read, see
+ * rudp_receive_data. The zero-window probes of its senders go unanswered
+ * meanwhile, so its receiving connections advertise their window again,
+ * which tells the senders they are still there.
+ */
+int rudp_persist(int argc, void* arg){
+	struct rudp_socket* skt = (struct rudp_socket*)arg;
+	struct rudp_conn* conn;
+	for(conn=skt->conns; conn!=NULL; conn=conn->next){
+		if(!conn->sender && conn->state == DATA){
+			send_ack(conn, &conn->peer, conn->hack);
+		}
+	}
+	armPersist(skt);
+	return 0;
+}
+
+/*
+ * rudp_received: a datagram read by the event loop.
+ */
+int rudp_received(int fd, void *arg, char *buf, int len, struct sockaddr *from){
+	rudp_input((struct rudp_socket*)arg, (rudp_packet*)buf, len, (struct sockaddr_in*)from);
+	return 0;
+}
+
+
+
+/* 
+ * rudp_socket: Create a RUDP socket. 
+ * May use a random port by setting port to zero. 
+ */
+
+rudp_socket_t rudp_socket(int port){
+        struct rudp_socket* skt;
+	int fd;
+	struct sockaddr_in* in;	
+	int eventRet;
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0){
+		fprintf(stderr, "rudp: socket error : ");
+		return NULL;
+	}
+        if(port == 0){
+		port = nextRandom()%60000 + 4711; 			// Randomize a number between 4711 and 64711.
+    	}
+    	printf("rudp_socket: Socketfd: %d, Port number: %d\n",fd, port);
+        in = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
+	bzero(in, sizeof(struct sockaddr_in));			// Reset all values inside the allocated sockadder_in structure.
+	in->sin_family = AF_INET;				// Set the socket internet family to be AF_INET.
+	in->sin_addr.s_addr = htonl(INADDR_ANY);		// Set the socket address in network byte order.
+	in->sin_port = htons(port);				// Set the socket port in network byte order.
+	if(bind(fd, (struct sockaddr*)in, sizeof(struct sockaddr_in)) == -1){
+		fprintf(stderr, "rudp: bind error\n");
+		return NULL;
+	}
+	free(in);						// Free the allocated space.
+        skt = (struct rudp_socket*)malloc(sizeof(struct rudp_socket));
+	memset(skt, 0, sizeof(struct rudp_socket));
+	skt->fd = fd;						// Register the socket file descriptor.
+	skt->conns = NULL;					// Connections are made by rudp_sendto or an incoming SYN.
+	skt->cc_ops = &rudp_cc_newreno;
+	skt->weight = 1;
+	eventRet = event_recv((int)fd, &rudp_received, (void*)skt, "rudp_receive_data");
+	if(eventRet < 0){
+		printf("[Error] event_recv failed: rudp_received()\n");
+		return NULL;
+	}
+	return (rudp_socket_t*)skt;
+}
+
+/*
+ * closeConn: queue a FIN behind the data of a sending connection. If
+ * everything sent so far is already acknowledged, nothing else will
+ * trigger the FIN, so send it right away.
+ */
+void closeConn(struct rudp_conn* conn){
+	struct send_data_list_buffer* node;
+	flushBatch(conn);					// Messages still waiting for company go first.
+	conn->seqno = conn->seqno+1;				// Increment the sequence number to be used by the FIN.
+	rudp_packet* fin = createRUDPPacket(RUDP_FIN, conn->seqno, NULL, 0);
+	node = createNodeBuffer(fin, conn, 0, &conn->peer);	// Create a buffer structure for the RUDP FIN packet.
+	conn->head = addNode(conn->head, node);			// Add the RUDP FIN to the buffer list.
+	conn->state = CLOSING;					// Set the state of the connection to CLOSING.
+	if(conn->head == node && conn->hack != conn->synseqno){
+		send_data(conn, &conn->peer);			// Sends the FIN and waits for its ACK.
+	}
+}
+
+/* 
+ *rudp_close: Close socket. Sending connections finish their data and
+ * FIN handshake first; the socket is released after the last of them.
+ * Receiving connections are released from a timer, so that rudp_close
+ * may be called from the socket's own callbacks.
+ */ 
+
+int rudp_close(rudp_socket_t rsocket){
+	struct rudp_socket* skt;
+	struct rudp_conn* conn;
+	skt = (struct rudp_socket*)rsocket;
+	if(skt->closing){
+		return -1;
+	}
+	skt->closing = 1;
+	for(conn=skt->conns; conn!=NULL; conn=conn->next){
+		if(conn->sender && conn->state == DATA){
+			closeConn(conn);
+		}else if(!conn->sender){
+			armReap(conn, 0);			// Nothing of ours in flight; freed outside any callback.
+		}
+	}
+	freeSocket(skt);
+	return 0;
+}
+
+/* 
  *rudp_recvfrom_handler: Register receive callback function 
  */ 
 
@@ -400,6 +2330,62 @@ int rudp_recvfrom_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t,
 	return 0;	
 }
 
+/*
+ * rudp_recv_buffers: Receive into n buffers of RUDP_RXBUFSIZE bytes at mem,
+ * handing the data over to handler in batches.
+ */
+
+int rudp_recv_buffers(rudp_socket_t rsocket, void *mem, int n, 
+		int (*handler)(rudp_socket_t, struct rudp_rxdesc *, int)){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	int i;
+	if(skt->rxmem != NULL || mem == NULL || n <= 0 || handler == NULL){
+		return -1;
+	}
+	skt->rxbufs = (struct rudp_rxbuf *)malloc(n*sizeof(struct rudp_rxbuf));
+	for(i=0; i<n; i++){
+		skt->rxbufs[i].refs = 0;
+		skt->rxbufs[i].next = i+1 < n ? &skt->rxbufs[i+1] : NULL;
+	}
+	skt->rxmem = (char*)mem;
+	skt->nrxbufs = n;
+	skt->rxfree = skt->rxbufs;
+	skt->rxnfree = n;
+	skt->rxbatch_handler_callback = handler;
+	event_recv_delete(&rudp_received, (void*)skt);		// Read by rudp_receive_data from now on.
+	if(event_fd(skt->fd, &rudp_receive_data, (void*)skt, "rudp_receive_data") < 0){
+		printf("[Error] event_fd failed: rudp_receive_data()\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * rudp_release: Give back the receive buffer of a descriptor. The socket is
+ * read again if it had run out of buffers.
+ */
+
+int rudp_release(rudp_socket_t rsocket, char *buf){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	struct rudp_rxbuf* b = rxbufOf(skt, buf);
+	if(b == NULL || b->refs == 0 || skt->rxlent == 0){
+		return -1;
+	}
+	skt->rxlent--;
+	unrefRxbuf(skt, b);
+	windowUpdate(skt);
+	if(skt->rxpaused && skt->rxfree != NULL){
+		skt->rxpaused = 0;
+		event_timeout_delete(&rudp_persist, (void*)skt);
+		if(event_fd(skt->fd, &rudp_receive_data, (void*)skt, "rudp_receive_data") < 0){
+			printf("[Error] event_fd failed: rudp_receive_data()\n");
+			return -1;
+		}
+	}
+	freeSocket(skt);				// Closed and waiting for its buffers.
+	return 0;
+}
+
 /* 
  *rudp_event_handler: Register event handler callback function 
  */ 
@@ -411,59 +2397,520 @@ int rudp_event_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, rudp
 }
 
 /* 
- * rudp_sendto: Send a block of data to the receiver. 
+ * rudp_set_fec: Send a parity packet for every k data packets (0 turns FEC off).
  */
 
-int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* dest){
-	struct rudp_socket* skt;
+int rudp_set_fec(rudp_socket_t rsocket, int k){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	if(k < 0 || k > RUDP_FEC_MAXK){
+		return -1;
+	}
+	skt->fec_k = k;
+	return 0;
+}
+
+/* 
+ * rudp_set_checksum: Turn CRC32C packet checksums on or off.
+ */
+
+int rudp_set_checksum(rudp_socket_t rsocket, int on){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	skt->csum = on ? 1 : 0;
+	return 0;
+}
+
+/* 
+ * rudp_set_keepalive: Send a keepalive on sending connections that have
+ * been idle for secs seconds (0 turns it off). A peer that stops answering
+ * is reported with RUDP_EVENT_TIMEOUT like any other lost packet.
+ * Applies to connections opened after the call.
+ */
+
+int rudp_set_keepalive(rudp_socket_t rsocket, int secs){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	if(secs < 0){
+		return -1;
+	}
+	skt->keepalive = secs;
+	return 0;
+}
+
+/*
+ * rudp_set_weight: Share of the transmit scheduler of the socket's sending
+ * connections, relative to other connections of the process: each round,
+ * one may send weight times RUDP_TXQUANTUM full packets.
+ */
+
+int rudp_set_weight(rudp_socket_t rsocket, int weight){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	if(weight < 1 || weight > RUDP_MAXWEIGHT){
+		return -1;
+	}
+	skt->weight = weight;
+	return 0;
+}
+
+/*
+ * rudp_set_idle: Drop receiving connections that have heard nothing from
+ * their peer for secs seconds (0 turns it off), with RUDP_EVENT_TIMEOUT.
+ * Applies to connections opened by peers after the call.
+ */
+
+int rudp_set_idle(rudp_socket_t rsocket, int secs){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	if(secs < 0){
+		return -1;
+	}
+	skt->idle = secs;
+	return 0;
+}
+
+/*
+ * rudp_set_memlimit: Shed load once all sockets together hold bytes of
+ * packets and connection state (0 is no limit).
+ */
+
+int rudp_set_memlimit(long bytes){
+	if(bytes < 0){
+		return -1;
+	}
+	rudp_memlimit = bytes;
+	return 0;
+}
+
+/*
+ * rudp_memused: Bytes of packets and connection state held now.
+ */
+
+long rudp_memused(){
+	return rudp_mem;
+}
+
+/*
+ * rudp_set_unordered: Deliver data as it arrives instead of in order.
+ * Applies to connections opened by peers after the call.
+ */
+
+int rudp_set_unordered(rudp_socket_t rsocket, int on){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	skt->unordered = on ? 1 : 0;
+	return 0;
+}
+
+/*
+ * rudp_seqno: Packet number of the data being delivered, counted from the
+ * SYN of its connection.
+ */
+
+u_int32_t rudp_seqno(rudp_socket_t rsocket){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	return skt->rcvseq;
+}
+
+/*
+ * rudp_set_cc: Select the congestion control of sending connections by
+ * name: "newreno" (default), "cubic", "bbr", or "fixed" for the classic
+ * RUDP_WINDOW packets in flight. Applies to connections opened after the
+ * call.
+ */
+
+int rudp_set_cc(rudp_socket_t rsocket, char *name){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	struct rudp_cc_ops* ops = rudp_cc_find(name);
+	if(ops == NULL){
+		return -1;
+	}
+	skt->cc_ops = ops;
+	return 0;
+}
+
+/*
+ * frameMessage: copy a message with its length prefix to buf.
+ */
+void frameMessage(char* buf, void* data, int len){
+	u_int16_t hdr = htons(len);
+	memcpy(buf, &hdr, RUDP_MSGHDRLEN);
+	memcpy(buf+RUDP_MSGHDRLEN, data, len);
+}
+
+/*
+ * flushBatch: queue the messages coalesced so far as one data packet, and
+ * send it if the window allows.
+ */
+void flushBatch(struct rudp_conn* conn){
+	struct send_data_list_buffer* node;
+	if(conn->batching){
+		event_timeout_delete(&rudp_coalesce, (void*)conn);
+		conn->batching = 0;
+	}
+	if(conn->batchlen == 0){
+		return;
+	}
+	conn->seqno = conn->seqno+1;
+	conn->batchpkt->header = createRUDPHeader(RUDP_DATA, conn->seqno);
+	node = createNodeBuffer(conn->batchpkt, conn, conn->batchlen, &conn->peer);
+	conn->batchpkt = NULL;
+	conn->batchlen = 0;
+	conn->head = addNode(conn->head, node);
+	if(conn->hack != conn->synseqno && !ackOwed(conn)){
+		send_data(conn, &conn->peer);
+	}
+}
+
+/*
+ * rudp_coalesce: timer callback; the oldest coalesced message has waited
+ * long enough.
+ */
+int rudp_coalesce(int argc, void* arg){
+	struct rudp_conn* conn = (struct rudp_conn*)arg;
+	conn->batching = 0;
+	flushBatch(conn);
+	return 0;
+}
+
+/*
+ * rudp_set_coalesce: Let messages wait up to ms milliseconds to share a
+ * packet with the messages sent after them (0 turns it off). Applies to
+ * connections opened after the call.
+ */
+
+int rudp_set_coalesce(rudp_socket_t rsocket, int ms){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	if(ms < 0){
+		return -1;
+	}
+	skt->coalesce = ms;
+	return 0;
+}
+
+/*
+ * rudp_flush: Send the messages coalescing connections are holding back.
+ */
+
+int rudp_flush(rudp_socket_t rsocket){
+	struct rudp_socket* skt = (struct rudp_socket*)rsocket;
+	struct rudp_conn* conn;
+	for(conn=skt->conns; conn!=NULL; conn=conn->next){
+		if(conn->sender && conn->state == DATA){
+			flushBatch(conn);
+		}
+	}
+	return 0;
+}
+
+/*
+ * sendMessage: queue a message on the sending connection to dest, opening
+ * it if needed. A message with a lifetime (ms, 0 for none) or maxretrans
+ * (-1 for none) is partially reliable: it is given up on when it cannot
+ * be delivered in time. It is never coalesced with other messages, so
+ * that they don't share its fate. With shared set, a message that goes
+ * out in a packet of its own takes its data from *shared, allocating it
+ * on first use, instead of from a copy of its own. A message too big for
+ * a packet goes in fragments.
+ */
+int sendMessage(struct rudp_socket* skt, void* data, int len, struct sockaddr_in* dest,
+		int lifetime, int maxretrans, struct rudp_buf** shared){
+	struct rudp_conn* conn;
 	struct send_data_list_buffer* node;
 	struct timeval t, t1, t2;
-	skt = (struct rudp_socket*)rsocket;
-	if(skt->state == CLOSING || skt->state == WAIT_FIN_ACK || skt->state == FIN){
+	char msg[RUDP_MAXPKTSIZE];
+	int partial = lifetime > 0 || maxretrans >= 0;
+	if(skt->closing){
 		return -1;
-	}else if(skt->state == INIT){
-		skt->dest = dest;				// Register the destination address of this socket.
-		int seqno = rand()%MAX_SEQ;			// Randomize a integer with modulo 2147483646. 
-		rudp_packet* syn = sendSYN(skt->fd, dest, seqno);
-		node = createNodeBuffer(syn, skt, len, skt->dest);
-		t.tv_sec = RUDP_TIMEOUT/1000;           	// Convert to seconds.
-		t.tv_usec = (RUDP_TIMEOUT%1000) * 1000; 	// Convert to microseconds.
-		gettimeofday(&t1, NULL);     			// Get current time of the day.
-		timeradd(&t1, &t, &t2);  			// Sum the timeout time with the current time of the day.
-								// Start the timeout callback with event_timeout.
-		if(event_timeout(t2, &rudp_retransmit, node, "timer_callback") == -1){
-			fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
-			return -1;
+	}
+	if(memFull() || (len > RUDP_MAXPKTSIZE &&		// All the fragments, before anything is queued.
+			!memFits((len/RUDP_MAXPKTSIZE+1)*(long)(sizeof(rudp_packet)+sizeof(struct send_data_list_buffer))))){
+		errno = ENOBUFS;				// Retry once data in flight is acknowledged.
+		return -1;
+	}
+	conn = findConn(skt, dest, 1);
+	if(conn == NULL){
+		conn = createConn(skt, dest, 1);
+	}
+	if(conn->state == CLOSING || conn->state == WAIT_FIN_ACK || conn->state == FIN){
+		return -1;
+	}
+	if(len > RUDP_MAXPKTSIZE-(conn->batch ? RUDP_MSGHDRLEN : 0)){
+		return sendFragments(conn, (char*)data, len, lifetime, maxretrans);
+	}
+	if(conn->state == INIT && len == 0 && !conn->batch){
+		openConn(conn, NULL, 0);			// An empty SYN carries no message; it follows as data.
+	}
+	if(conn->state == INIT){				// The SYN is always reliable.
+		if(conn->batch){				// The first message is framed like the rest.
+			frameMessage(msg, data, len);
+			data = msg;
+			len = len+RUDP_MSGHDRLEN;
 		}
-		skt->head = addNode(skt->head, node);		// Initialize the socket head pointer.
-		skt->hack = seqno;				// Initialize the socket hack to SYN sequence number + 1;
-		skt->seqno = seqno;				// Initialize the sequence number for the following packet.
-		skt->synseqno = seqno;				// Register the sequence number of the SYN for later use.
-		skt->state = DATA;				// Set the socket state.
+		openConn(conn, (char*)data, len);		// The first message rides on the SYN.
+		return 0;
+	}
+	if(conn->batch && !partial){
+		if(conn->batchlen+RUDP_MSGHDRLEN+len > RUDP_MAXPKTSIZE){
+			flushBatch(conn);			// No room; the packet is full enough.
+		}
+		if(conn->batchpkt == NULL){
+			conn->batchpkt = (rudp_packet*)allocMem(sizeof(rudp_packet));
+		}
+		frameMessage(conn->batchpkt->data+conn->batchlen, data, len);
+		conn->batchlen = conn->batchlen+RUDP_MSGHDRLEN+len;
+		if(conn->batchlen+RUDP_MSGHDRLEN >= RUDP_MAXPKTSIZE){
+			flushBatch(conn);
+		}else if(!conn->batching){			// Wait a little for more messages.
+			t.tv_sec = conn->skt->coalesce/1000;
+			t.tv_usec = (conn->skt->coalesce%1000) * 1000;
+			event_gettime(&t1);
+			timeradd(&t1, &t, &t2);
+			if(event_timeout(t2, &rudp_coalesce, conn, "coalesce") == -1){
+				fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+				return -1;
+			}
+			conn->batching = 1;
+		}
+		return 0;
+	}
+	if(conn->batch){					// A packet of its own, framed all the same.
+		flushBatch(conn);
+		frameMessage(msg, data, len);
+		data = msg;
+		len = len+RUDP_MSGHDRLEN;
 	}
 	rudp_packet* packet;
-	skt->seqno = skt->seqno+1;				// Increment the sequence number for the next packet.
-	packet = createRUDPPacket(RUDP_DATA, skt->seqno, (char*)data, len);
-	node = createNodeBuffer(packet, skt, len, skt->dest);
-	addNode(skt->head, node);			
+	conn->seqno = conn->seqno+1;				// Increment the sequence number for the next packet.
+	if(shared != NULL && !conn->batch){
+		if(*shared == NULL){
+			*shared = (struct rudp_buf*)allocMem(sizeof(struct rudp_buf)-RUDP_MAXPKTSIZE+len);
+			(*shared)->refs = 0;
+			(*shared)->len = len;
+			memcpy((*shared)->data, data, len);
+		}
+		packet = (rudp_packet*)allocMem(sizeof(struct rudp_hdr));
+		packet->header = createRUDPHeader(RUDP_DATA, conn->seqno);
+		node = createNodeBuffer(packet, conn, len, &conn->peer);
+		node->buf = *shared;
+		node->buf->refs++;
+	}else{
+		packet = createRUDPPacket(RUDP_DATA, conn->seqno, (char*)data, len);
+		node = createNodeBuffer(packet, conn, len, &conn->peer);
+	}
+	if(lifetime > 0){
+		t.tv_sec = lifetime/1000;
+		t.tv_usec = (lifetime%1000) * 1000;
+		event_gettime(&t1);
+		timeradd(&t1, &t, &node->expire);
+	}
+	node->maxretrans = maxretrans;
+	conn->head = addNode(conn->head, node);
+	if(conn->hack != conn->synseqno && !ackOwed(conn)){
+		send_data(conn, &conn->peer);			// Connection is up; don't wait for the next ACK.
+	}
 	return 0;
 }
 
+/*
+ * openConn: send the SYN of a new sending connection, with len bytes of
+ * data (possibly none) as its payload.
+ */
+void openConn(struct rudp_conn* conn, char* data, int len){
+	struct send_data_list_buffer* node;
+	u_int32_t seqno = nextRandom()%MAX_SEQ;			// Randomize a integer with modulo 2147483646. 
+	rudp_packet* syn = sendSYN(conn, &conn->peer, seqno, data, len);
+	node = createNodeBuffer(syn, conn, len, &conn->peer);
+	event_gettime(&node->sent);			// The SYN ACK gives the first RTT sample.
+	armRetransmit(conn, &node->sent);
+	conn->head = addNode(conn->head, node);		// Initialize the connection head pointer.
+	conn->hack = seqno;				// Initialize the connection hack to SYN sequence number + 1;
+	conn->seqno = seqno;				// Initialize the sequence number for the following packet.
+	conn->synseqno = seqno;				// Register the sequence number of the SYN for later use.
+	conn->state = DATA;				// Set the connection state.
+}
 
-rudp_packet* sendSYN(int fd, struct sockaddr_in* dest, int seqno){
+/*
+ * sendFragments: queue a message too big for a packet as a run of
+ * fragments (see rudp.h), each a data packet of its own with the
+ * message's lifetime and maxretrans. A new connection is opened with an
+ * empty SYN first; messages a coalescing connection holds go before.
+ */
+int sendFragments(struct rudp_conn* conn, char* data, int len, int lifetime, int maxretrans){
+	struct send_data_list_buffer *node, *first = NULL, *last = NULL;
 	rudp_packet* packet;
-	packet = createRUDPPacket(RUDP_SYN, seqno, NULL, 0);
-	if(sendto(fd, (char*)packet, sizeof(struct rudp_hdr), 0, (struct sockaddr*)dest,
-			sizeof(struct sockaddr_in)) < 0){
-		fprintf(stderr, "Sendto() failed\n");
-		return NULL;
+	struct timeval t, t1;
+	u_int32_t msglen = htonl(len);
+	int off = 0, n, datalen, frag;
+	if(len > RUDP_MAXMSGSIZE){
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if(conn->state == INIT){
+		openConn(conn, NULL, 0);
+	}else if(conn->batch){
+		flushBatch(conn);
+	}
+	event_gettime(&t1);
+	t.tv_sec = lifetime/1000;
+	t.tv_usec = (lifetime%1000) * 1000;
+	while(off < len){
+		conn->seqno = conn->seqno+1;
+		packet = (rudp_packet*)allocMem(sizeof(rudp_packet));
+		if(off == 0){				// The first starts with the length of the message.
+			memcpy(packet->data, &msglen, RUDP_FRAGHDRLEN);
+			n = RUDP_MAXPKTSIZE-RUDP_FRAGHDRLEN;
+			memcpy(packet->data+RUDP_FRAGHDRLEN, data, n);
+			datalen = RUDP_MAXPKTSIZE;
+			frag = RUDP_FLAG_MORE;
+		}else{
+			n = len-off < RUDP_MAXPKTSIZE ? len-off : RUDP_MAXPKTSIZE;
+			memcpy(packet->data, data+off, n);
+			datalen = n;
+			frag = off+n < len ? RUDP_FLAG_MORE|RUDP_FLAG_CONT : RUDP_FLAG_CONT;
+		}
+		off = off+n;
+		packet->header = createRUDPHeader(RUDP_DATA | frag, conn->seqno);
+		node = createNodeBuffer(packet, conn, datalen, &conn->peer);
+		if(lifetime > 0){
+			timeradd(&t1, &t, &node->expire);
+		}
+		node->maxretrans = maxretrans;
+		if(last != NULL){
+			last->next = node;
+		}else{
+			first = node;
+		}
+		last = node;
+	}
+	conn->head = addNode(conn->head, first);	// In one go; addNode walks the list.
+	if(conn->hack != conn->synseqno && !ackOwed(conn)){
+		send_data(conn, &conn->peer);
+	}
+	return 0;
+}
+
+/* 
+ * rudp_sendto: Send a block of data to the receiver. 
+ */
+
+int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* dest){
+	return sendMessage((struct rudp_socket*)rsocket, data, len, dest, 0, -1, NULL);
+}
+
+/*
+ * rudp_sendto_group: Send a block of data to each of nto receivers. The
+ * data is held once for all of them and freed when the last one has
+ * acknowledged it; each connection keeps its own sequence numbers, ACKs
+ * and retransmissions. Peers the message opens a connection to, or that
+ * coalesce messages, get a copy as with rudp_sendto, as does everyone if
+ * it goes in fragments.
+ */
+
+int rudp_sendto_group(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to, int nto){
+	struct rudp_buf* shared = NULL;
+	int i, ret = 0;
+	if(len < 0 || len > RUDP_MAXMSGSIZE){
+		return -1;
+	}
+	for(i=0; i<nto; i++){
+		if(sendMessage((struct rudp_socket*)rsocket, data, len, &to[i], 0, -1, &shared) < 0){
+			ret = -1;				// The others still get it.
+		}
+	}
+	return ret;
+}
+
+/*
+ * rudp_sendto_partial: Send a block of data that is worthless unless it
+ * arrives within lifetime ms, or with at most maxretrans retransmissions.
+ */
+
+int rudp_sendto_partial(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* dest,
+		int lifetime, int maxretrans){
+	if(lifetime < 0){
+		return -1;
+	}
+	return sendMessage((struct rudp_socket*)rsocket, data, len, dest, lifetime, maxretrans, NULL);
+}
+
+/*
+ * rudp_submitted: run a send submitted by another thread.
+ */
+int rudp_submitted(int argc, void* arg){
+	struct rudp_submission* req = (struct rudp_submission*)arg;
+	if(rudp_sendto((rudp_socket_t)req->skt, req->data, req->len, &req->to) < 0){
+		fprintf(stderr, "rudp: submitted send failed\n");
+	}
+	free(req);
+	return 0;
+}
+
+/*
+ * rudp_submit_sendto: Thread-safe rudp_sendto. A copy of the data is
+ * queued for the event loop thread, which sends it.
+ */
+
+int rudp_submit_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to){
+	struct rudp_submission* req;
+	if(len < 0 || len > RUDP_MAXMSGSIZE){
+		return -1;
+	}
+	req = (struct rudp_submission*)malloc(sizeof(struct rudp_submission)-RUDP_MAXPKTSIZE+len);
+	if(req == NULL){
+		return -1;
+	}
+	req->skt = (struct rudp_socket*)rsocket;
+	req->to = *to;
+	req->len = len;
+	memcpy(req->data, data, len);
+	if(event_submit(&rudp_submitted, req) < 0){
+		free(req);				// Queue full: the caller decides.
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * rudp_keepalive: timer callback for idle sending connections. Queues a
+ * RUDP_KEEPALIVE, which the receiver acknowledges like data but does not
+ * deliver.
+ */
+int rudp_keepalive(int argc, void* arg){
+	struct rudp_conn* conn = (struct rudp_conn*)arg;
+	struct send_data_list_buffer* node;
+	struct timeval t, t1, t2;
+	if(conn->state == DATA && conn->head == NULL){
+		conn->seqno = conn->seqno+1;
+		node = createNodeBuffer(createRUDPPacket(RUDP_KEEPALIVE, conn->seqno, NULL, 0),
+				conn, 0, &conn->peer);
+		conn->head = addNode(conn->head, node);
+		send_data(conn, &conn->peer);
+	}
+	t.tv_sec = conn->skt->keepalive;
+	t.tv_usec = 0;
+	event_gettime(&t1);
+	timeradd(&t1, &t, &t2);
+	if(event_timeout(t2, &rudp_keepalive, conn, "keepalive") == -1){
+		fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * sendSYN: open the connection. The SYN carries the application's first
+ * message, so it reaches the receiver without waiting a round trip.
+ */
+rudp_packet* sendSYN(struct rudp_conn* conn, struct sockaddr_in* dest, u_int32_t seqno, char* data, int datalen){
+	rudp_packet* packet;
+	packet = createRUDPPacket(RUDP_SYN | (conn->batch ? RUDP_FLAG_BATCH : 0), seqno, data, datalen);
+	packet->header.version = htons(RUDP_VERSION2);		// Offer the compact header.
+	if(rudp_output(conn, (char*)packet, sizeof(struct rudp_hdr)+datalen, dest) < 0){
+		fprintf(stderr, "Sendto() failed\n");	// Retransmitted by the timer.
 	}
 	return packet;
 }
 
 rudp_packet* createRUDPPacket(u_int16_t type, u_int32_t seqno, char* data, int datalen){
 	rudp_packet* packet;
-	packet = malloc(sizeof(rudp_packet));
+	packet = allocMem(sizeof(rudp_packet));
 	packet->header = createRUDPHeader(type, seqno);
 	memcpy((void*)&(packet->data), (void*)data, datalen);
 	return packet;
@@ -477,28 +2924,58 @@ struct rudp_hdr createRUDPHeader(u_int16_t type, u_int32_t seqno){
 	return header;
 }
 
+/*
+ * rudp_retransmit: the retransmission timer of a sending connection
+ * expired; the oldest unacknowledged packet is resent. Everything else in
+ * flight is presumed lost too and is resent as the (collapsed) window
+ * opens again. After RUDP_MAXRETRANS expiries without progress, or
+ * RUDP_MAXRETRANS zero-window probes in a row that go unanswered, the
+ * connection is freed with everything it had queued, and the application
+ * gets an RUDP_EVENT_TIMEOUT.
+ */
 int rudp_retransmit(int argc, void* arg){
-	struct send_data_list_buffer* node = (struct send_data_list_buffer*)arg;
-	struct timeval t, t1, t2;
-	if(node->retransCount < RUDP_MAXRETRANS){		// It's still possible to retransmit the packet.
-		if(sendto(node->fd, (char*)node->packet, node->datalen+sizeof(struct rudp_hdr), 
-				0, (struct sockaddr*)node->dest, sizeof(struct sockaddr_in)) < 0){		
-			fprintf(stderr, "Error(retransmission of packet): %s\n", strerror(errno));
-			return -1;
+	struct rudp_conn* conn = (struct rudp_conn*)arg;
+	struct rudp_socket* skt = conn->skt;
+	struct send_data_list_buffer* node = conn->head;
+	struct sockaddr_in peer;
+	int busy;
+	conn->rto_armed = 0;
+	if(node == NULL){
+		return 0;
+	}
+	if(abandonHead(conn, 1) > 0){
+		if(conn->state == DATA || conn->state == CLOSING){
+			send_data(conn, &conn->peer);
 		}
-		node->retransCount = node->retransCount+1;	// Increment the counter for number of retransmissions for
+		return 0;
+	}
+	if((conn->snd_wnd > 0 ? conn->rto_backoff : conn->probes) >= RUDP_MAXRETRANS){	// Call back to application with an RUDP_EVENT_TIMEOUT.
+		peer = conn->peer;
+		busy = skt->rxbusy;
+		skt->rxbusy = 1;			// Keep the socket for the callback.
+		freeConn(conn);				// The peer is gone; so is what was queued for it.
+		skt->event_handler_callback((rudp_socket_t*)skt, RUDP_EVENT_TIMEOUT, &peer);
+		skt->rxbusy = busy;
+		freeSocket(skt);
+		return 0;
+	}
+	if(conn->snd_wnd > 0){
+		conn->cc.ops->on_rto(&conn->cc);
+	}else{
+		conn->probes = conn->probes+1;		// A zero-window probe; no sign of congestion.
+	}
+	conn->cc.recovery = 0;
+	conn->dupacks = 0;
+	conn->rto_backoff = conn->rto_backoff+1;
+	if(outputData(conn, &node->packet->header, nodeData(node), node->datalen, node->dest) < 0){		
+		fprintf(stderr, "Error(retransmission of packet): %s\n", strerror(errno));
+	}
+	node->retransCount = node->retransCount+1;		// Increment the counter for number of retransmissions for
 								// this packet.	
-		t.tv_sec = RUDP_TIMEOUT/1000;           	// Convert to seconds.
-		t.tv_usec = (RUDP_TIMEOUT%1000) * 1000; 	// Convert to microseconds.
-		gettimeofday(&t1, NULL);     			// Get current time of the day.
-		timeradd(&t1, &t, &t2);  			// Sum the timeout time with the current time of the day.
-								// Start the timeout callback with event_timeout.
-		if(event_timeout(t2, &rudp_retransmit, node, "timer_callback") == -1){
-			fprintf(stderr,"Error(event): wasn't able to register event to the eventloop.\n");
-			return -1;
-		}
-	}else{							// Call back to application with an RUDP_EVENT_TIMEOUT.
-		node->skt->event_handler_callback((rudp_socket_t*)node->skt, RUDP_EVENT_TIMEOUT, node->dest);
+	event_gettime(&node->sent);
+	if(conn->hack != conn->synseqno){
+		conn->snd_nxt = conn->hack+1;			// Go back to the packet after it.
 	}
+	armRetransmit(conn, &node->sent);
 	return 0;
 }
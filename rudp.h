@@ -2,10 +2,18 @@
 #define	RUDP_PROTO_H
 
 #define RUDP_VERSION	1	/* Protocol version */
+#define RUDP_VERSION2	2	/* Protocol version with the compact header; offered on the SYN */
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a packet, RUDP header not included */
 #define RUDP_MAXRETRANS 5	/* Max. number of retransmissions */
-#define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds */
-#define RUDP_WINDOW	3	/* Max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_TIMEOUT	2000	/* Retransmission timeout in milliseconds until a round trip time is measured */
+#define RUDP_MINRTO	200	/* Least retransmission timeout in milliseconds */
+#define RUDP_MAXRTO	60000	/* Largest retransmission timeout in milliseconds, backoff included */
+#define RUDP_TIMEWAIT	60000	/* Milliseconds a finished receiving connection answers a retransmitted FIN */
+#define RUDP_WINDOW	3	/* Initial number of unacknowledged packets that can be sent to the network */
+#define RUDP_MAXWINDOW	64	/* Max. number of unacknowledged packets; receivers buffer as many out of order */
+#define RUDP_RXBATCH	32	/* Max. number of datagrams read per wakeup into receive buffers */
+#define RUDP_TXQUANTUM	8	/* Full packets a connection of weight 1 may send per transmit scheduler round */
+#define RUDP_MAXWEIGHT	64	/* Largest transmit scheduler weight of a socket */
 
 /* Packet types */
 
@@ -13,16 +21,64 @@
 #define RUDP_ACK	2
 #define RUDP_SYN	4
 #define RUDP_FIN	5
+#define RUDP_PARITY	6	/* FEC repair packet: XOR of the RUDP_DATA packets in a group */
+#define RUDP_KEEPALIVE	7	/* Sequenced and acknowledged like RUDP_DATA, but not delivered */
+#define RUDP_SKIP	8	/* The sender gave up on the packets before seqno; not sequenced */
+
+/* Packet flags, carried in the high byte of the type field */
+
+#define RUDP_TYPE_MASK	0x00ff
+#define RUDP_FLAG_CSUM	0x0100	/* Packet ends with a CRC32C of the header and data */
+#define RUDP_FLAG_BATCH	0x0200	/* On the SYN: the data of the connection are coalesced messages */
+#define RUDP_FLAG_ACK	0x0400	/* On RUDP_DATA: a struct rudp_ackhdr follows the header */
+#define RUDP_FLAG_OPT	0x0800	/* Compact header only: options follow the header fields */
+#define RUDP_FLAG_MORE	0x1000	/* On RUDP_DATA: a fragment; the message goes on in the next packet */
+#define RUDP_FLAG_CONT	0x2000	/* On RUDP_DATA: a fragment; the message began in an earlier packet */
+#define RUDP_FRAG_MASK	(RUDP_FLAG_MORE|RUDP_FLAG_CONT)
+
+/*
+ * On a coalescing connection the payload of the SYN and of every
+ * RUDP_DATA packet is a sequence of application messages, each preceded
+ * by its length as a 16-bit integer in network byte order.
+ */
+
+#define RUDP_MSGHDRLEN	2	/* Length prefix of a coalesced message */
+
+/*
+ * A message too big for one packet is sent as a run of consecutive
+ * RUDP_DATA packets: the first flagged RUDP_FLAG_MORE, the last
+ * RUDP_FLAG_CONT and those in between both. The payload of the first
+ * starts with the length of the whole message as a 32-bit integer in
+ * network byte order. Fragments are never coalesced; the receiver hands
+ * the message over once the last has arrived.
+ */
+
+#define RUDP_FRAGHDRLEN	4	/* Length prefix of a fragmented message */
+
+/*
+ * A RUDP_ACK carries the receiver's advertised window: how many packets,
+ * counted from the acknowledged sequence number, it has room for, as a
+ * 16-bit integer in network byte order. A bare ACK advertises
+ * RUDP_MAXWINDOW. The top bit is a flag, which to older senders only
+ * makes the window look larger than their own.
+ */
+
+#define RUDP_WNDLEN	2	/* Length of the advertised window */
+#define RUDP_WND_MASK	0x7fff
+#define RUDP_WND_ACKOK	0x8000	/* The receiver takes ACKs on the data sent back to it */
+
+#define RUDP_FEC_MAXK	16	/* Max. number of data packets covered by one parity packet */
+#define RUDP_FEC_KMASK	0x00ff	/* Group size bits of the k field of the parity header */
 
 /*
  * Sequence numbers are 32-bit integers operated on with modular arithmetic.
  * These macros can be used to compare sequence numbers.
  */
 
-#define	SEQ_LT(a,b)	((short)((a)-(b)) < 0)
-#define	SEQ_LEQ(a,b)	((short)((a)-(b)) <= 0)
-#define	SEQ_GT(a,b)	((short)((a)-(b)) > 0)
-#define	SEQ_GEQ(a,b)	((short)((a)-(b)) >= 0)
+#define	SEQ_LT(a,b)	((int32_t)((a)-(b)) < 0)
+#define	SEQ_LEQ(a,b)	((int32_t)((a)-(b)) <= 0)
+#define	SEQ_GT(a,b)	((int32_t)((a)-(b)) > 0)
+#define	SEQ_GEQ(a,b)	((int32_t)((a)-(b)) >= 0)
 
 /* RUDP packet header */
 
@@ -32,4 +88,55 @@ struct rudp_hdr {
 	u_int32_t seqno;
 }__attribute__ ((packed));
 
+/*
+ * RUDP parity header, follows the RUDP header in RUDP_PARITY packets.
+ * The RUDP header seqno is the sequence number of the first data packet
+ * in the group; the group covers k consecutive sequence numbers.
+ * The parity payload is the XOR of the (zero padded) data payloads, and
+ * lenxor the XOR of their lengths. The XOR of the fragment flags of the
+ * packets is carried in the bits of k above RUDP_FEC_KMASK.
+ */
+
+struct rudp_fechdr {
+	u_int16_t k;
+	u_int16_t lenxor;
+}__attribute__ ((packed));
+
+/*
+ * Piggybacked ACK header, follows the RUDP header in RUDP_DATA packets
+ * flagged RUDP_FLAG_ACK. A peer that sends data back over its own
+ * connection acknowledges our data with it, once our ACKs have said
+ * RUDP_WND_ACKOK: ack and wnd mean what the seqno and window of a
+ * RUDP_ACK would.
+ */
+
+struct rudp_ackhdr {
+	u_int32_t ack;
+	u_int16_t wnd;
+}__attribute__ ((packed));
+
+/*
+ * Compact (version 2) header. The SYN always has the header above, with
+ * the highest version the sender speaks in the version field; older
+ * receivers don't look at it. A receiver that speaks version 2 answers
+ * with compact headers, and the sender uses them from then on. The first
+ * byte tells the two apart: it is 0 in the header above.
+ *
+ *	byte 0		version (top 3 bits) and packet type (low 5 bits)
+ *	byte 1		flags: the high byte of RUDP_FLAG_*
+ *	varint		seqno, counted from the sequence number of the SYN
+ *	varint		RUDP_FLAG_ACK: ack, counted from the SYN of the
+ *			connection in the other direction
+ *	varint		RUDP_FLAG_ACK: wnd
+ *	options		RUDP_FLAG_OPT: kind, length and length bytes of value
+ *			each, up to RUDP_OPT_END; unknown kinds are skipped
+ *
+ * Varints are little endian, 7 bits a byte, the top bit set in all but
+ * the last byte. The payload follows, as after the header above.
+ */
+
+#define RUDP_V2_TYPE	0x1f	/* Packet type bits of byte 0 */
+#define RUDP_V2_HDRMAX	15	/* Longest compact header without options */
+#define RUDP_OPT_END	0	/* End of the options; no length */
+
 #endif /* RUDP_PROTO_H */
@@ -3,6 +3,10 @@
 
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a
 				 * packet, RUDP header not included */
+#define RUDP_MAXMSGSIZE	(16*1024*1024)	/* Largest datagram rudp_sendto takes;
+				 * bigger than a packet, it goes in fragments */
+#define RUDP_RXBUFSIZE	1024	/* Size of a receive buffer given with
+				 * rudp_recv_buffers; any RUDP datagram fits */
 
 /*
  * Event types for callback notifications
@@ -19,26 +23,80 @@ typedef enum {
 
 typedef void *rudp_socket_t;
 
+/*
+ * Received data handed over in a receive buffer (see rudp_recv_buffers)
+ */
+
+struct rudp_rxdesc {
+	char *buf;		/* The receive buffer; give back with rudp_release */
+	char *data;		/* The data, inside buf */
+	int len;		/* Length of data */
+	struct sockaddr_in from;	/* Sender */
+	u_int32_t seqno;	/* Packet number, as rudp_seqno */
+	int more;		/* Boolean: the datagram goes on in the next descriptor */
+	int cont;		/* Boolean: this goes on from the previous descriptor */
+};
+
 /*
  * Prototypes
  */
 
 /* 
  * Socket creation 
+ * A socket holds one connection per remote peer: connections are opened
+ * by rudp_sendto to a new destination, or by a SYN from a new peer, and
+ * can carry any number of messages back-to-back. Sending to a peer that
+ * is sending to us opens a second connection in the reverse direction,
+ * e.g. for replies.
  */
 rudp_socket_t rudp_socket(int port);
 
 /* 
  * Socket termination
+ * Outstanding data is delivered and each connection closed with a FIN
+ * before the socket is released.
  */
 int rudp_close(rudp_socket_t rsocket);
 
 /* 
- * Send a datagram 
+ * Send a datagram of up to RUDP_MAXMSGSIZE bytes. One too big for a
+ * packet is split into fragments and put back together by the receiver,
+ * which hands it over whole.
  */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, 
 		struct sockaddr_in* to);
 
+/*
+ * Send a datagram to each of nto receivers. The data is held once and
+ * shared by their send buffers until the slowest has acknowledged it.
+ * Returns -1 if it could not be queued for one of them or more. A
+ * datagram too big for a packet is copied for each receiver.
+ */
+int rudp_sendto_group(rudp_socket_t rsocket, void* data, int len, 
+		struct sockaddr_in* to, int nto);
+
+/*
+ * Send a datagram with partial reliability: it is given up on once it is
+ * lifetime ms old (0 for no limit), or once it has been retransmitted
+ * maxretrans times and is lost again (-1 for no limit). The receiver
+ * skips what was given up on, so later data is not held back by it.
+ * The first datagram to a peer rides on the SYN and is always reliable.
+ * A fragmented datagram missing a fragment given up on is dropped whole.
+ */
+int rudp_sendto_partial(rudp_socket_t rsocket, void* data, int len, 
+		struct sockaddr_in* to, int lifetime, int maxretrans);
+
+/*
+ * Send a datagram from a thread other than the one running eventloop().
+ * The data is copied and the send made by the loop thread, through the
+ * event submission queue, which the loop thread must have opened with
+ * event_submit_open(). Never blocks; returns -1 if the queue is full.
+ * Every other call must be made on the loop thread; to run other work
+ * there (e.g. rudp_close), submit it with event_submit().
+ */
+int rudp_submit_sendto(rudp_socket_t rsocket, void* data, int len, 
+		struct sockaddr_in* to);
+
 /* 
  * Register callback function for packet receiption 
  * Note: data and len arguments to callback function 
@@ -48,11 +106,118 @@ int rudp_recvfrom_handler(rudp_socket_t rsocket,
 			  int (*handler)(rudp_socket_t, 
 					 struct sockaddr_in *, 
 					 char *, int));
+/*
+ * Receive into application buffers: mem holds n buffers of RUDP_RXBUFSIZE
+ * bytes each, which datagrams are read into directly, several per wakeup.
+ * Instead of the receive handler, handler is called once per wakeup with
+ * an array of descriptors of the data received, which point into the
+ * buffers without copying; the array itself is only valid during the
+ * call. Every descriptor must be given back with rudp_release(buf) once
+ * done with its data; a buffer may hold several messages. A fragmented
+ * message is not copied together: its fragments are handed over as they
+ * come in order, as a chain of descriptors linked by more and cont. If a
+ * descriptor without cont follows one with more, the sender gave up on a
+ * fragment and the part of the chain received should be discarded.
+ * While all buffers are held, the socket is not read. Out-of-order
+ * packets are held in buffers too, so there should be well over
+ * RUDP_MAXWINDOW of them.
+ * Call before the socket receives any data; the socket is released on
+ * rudp_close only after the last buffer is given back.
+ */
+int rudp_recv_buffers(rudp_socket_t rsocket, void *mem, int n,
+		      int (*handler)(rudp_socket_t, 
+				     struct rudp_rxdesc *, int));
+int rudp_release(rudp_socket_t rsocket, char *buf);
+
 /*
  * Register callback handler for event notifications
+ * RUDP_EVENT_TIMEOUT on a sending connection means the peer stopped
+ * acknowledging: the connection has been dropped with the data it still
+ * held, and sending to the peer again opens a new one.
  */
 int rudp_event_handler(rudp_socket_t rsocket, 
 		       int (*handler)(rudp_socket_t, 
 				      rudp_event_t, 
 				      struct sockaddr_in *));
+
+/*
+ * Unordered delivery: hand each packet to the receive handler as soon as
+ * it arrives, rather than holding it until the packets before it are in.
+ * Duplicates are still dropped. Off by default.
+ */
+int rudp_set_unordered(rudp_socket_t rsocket, int on);
+
+/*
+ * Number of the packet whose data the receive handler is called with,
+ * counted from 0 at the SYN of the connection; e.g. to put data
+ * delivered out of order back in place. Only valid during the call.
+ */
+u_int32_t rudp_seqno(rudp_socket_t rsocket);
+
+/*
+ * Forward error correction: send one XOR parity packet for every k
+ * data packets, so that the receiver can rebuild a single lost packet
+ * per group without a retransmission. k = 0 turns FEC off (default).
+ */
+int rudp_set_fec(rudp_socket_t rsocket, int k);
+
+/*
+ * Packet integrity: append a CRC32C to every packet sent on the socket.
+ * Corrupt packets are dropped on receipt. A receiver answers with
+ * checksums once it sees a checksummed packet.
+ */
+int rudp_set_checksum(rudp_socket_t rsocket, int on);
+
+/*
+ * Keepalive: probe sending connections that have been idle for secs
+ * seconds (0 turns it off), so a dead peer is reported with
+ * RUDP_EVENT_TIMEOUT while the connection is held open for later use.
+ */
+int rudp_set_keepalive(rudp_socket_t rsocket, int secs);
+
+/*
+ * Transmit scheduling: the sending connections of all sockets take turns,
+ * by deficit round robin. Each turn a connection may send weight times
+ * RUDP_TXQUANTUM full packets (1 <= weight <= RUDP_MAXWEIGHT; 1 is the
+ * default), so a socket of weight 4 gets four times the share of one of
+ * weight 1 when both have more to send than their windows let out at
+ * once, and no transfer holds up the others for more than a turn.
+ */
+int rudp_set_weight(rudp_socket_t rsocket, int weight);
+
+/*
+ * Idle timeout: drop receiving connections whose peer has sent nothing
+ * for secs seconds (0 turns it off, the default), reported with
+ * RUDP_EVENT_TIMEOUT. Finished connections are dropped RUDP_TIMEWAIT ms
+ * after their FIN either way.
+ */
+int rudp_set_idle(rudp_socket_t rsocket, int secs);
+
+/*
+ * Memory ceiling shared by all sockets: once packets and connection state
+ * take bytes or more (0 is no limit, the default), rudp_sendto fails
+ * with ENOBUFS, new peers are refused and out-of-order packets are not
+ * kept until acknowledgements free memory again. So does a datagram whose
+ * fragments would take it past the ceiling. rudp_memused tells the bytes
+ * held now.
+ */
+int rudp_set_memlimit(long bytes);
+long rudp_memused(void);
+
+/*
+ * Congestion control for sending connections: "newreno" (default),
+ * "cubic", "bbr" (paced, model based) or "fixed" (RUDP_WINDOW packets
+ * in flight). Returns -1 for an unknown name.
+ */
+int rudp_set_cc(rudp_socket_t rsocket, char *name);
+
+/*
+ * Coalescing: pack small messages into shared packets. A message waits up
+ * to ms milliseconds for others (0 turns it off, the default); a full
+ * packet, rudp_flush or closing the socket sends it at once. Message
+ * boundaries are kept; a message of more than RUDP_MAXPKTSIZE-2 bytes
+ * goes in fragments of its own.
+ */
+int rudp_set_coalesce(rudp_socket_t rsocket, int ms);
+int rudp_flush(rudp_socket_t rsocket);
 #endif /* RUDP_API_H */
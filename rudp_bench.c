@@ -0,0 +1,468 @@
+/*
+ * rudp_bench: microbenchmarks of the event loop and RUDP internals.
+ * Each benchmark is run at 10, 100, ... entries up to -n and reports the
+ * cost per operation in nanoseconds, in TSC ticks on x86, and in CPU
+ * cycles and instructions where perf counters can be opened.
+ *
+ * rudp.c is compiled into this file, so that the internal functions and
+ * structures are reached without being exported from the library.
+ */
+
+#include "rudp.c"			/* First: it sets _GNU_SOURCE */
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/perf_event.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define BENCH_MAXN 1000000		/* Default largest scale (-n) */
+#define BENCH_TIME 200			/* Default ms of operations per scale (-t) */
+#define BENCH_MEM 512			/* Default MB of packets a scale may take (-m) */
+#define BENCH_BATCH 64			/* Operations between looks at the clock */
+
+/*
+ * Accumulated measurements of one benchmark at one scale
+ */
+
+struct mark {
+	long ops;			/* Operations timed */
+	long ns;			/* Wall time of them */
+	u_int64_t tsc;			/* TSC ticks */
+	u_int64_t cycles;		/* Perf counters */
+	u_int64_t insns;
+	struct timespec t0;		/* Start of the current timed section */
+	u_int64_t tsc0;
+	u_int64_t cycles0, insns0;
+};
+
+struct bench {
+	char *name;
+	void (*run)(long n);
+	int packets;			/* Holds n packets; limited by -m */
+};
+
+/*
+ * Prototypes
+ */
+
+int usage();
+static void bench_timeout(long n);
+static void bench_fd(long n);
+static void bench_findnode(long n);
+static void bench_addnode(long n);
+static void bench_packet(long n);
+static void bench_ack(long n);
+
+/*
+ * Global variables
+ */
+
+struct bench benches[] = {
+	{ "timeout", bench_timeout, 0 },	/* event_timeout + event_timeout_delete among n timers */
+	{ "fd", bench_fd, 0 },			/* eventloop dispatch of one ready fd among n */
+	{ "findNode", bench_findnode, 1 },	/* findNode of a random packet in a queue of n */
+	{ "addNode", bench_addnode, 1 },	/* addNode at the tail of a queue of n */
+	{ "createRUDPPacket", bench_packet, 1 },	/* createRUDPPacket and free, n live at once */
+	{ "ack", bench_ack, 1 },		/* handleDATAState on an ACK and its send, n packets queued */
+	{ NULL, NULL, 0 }
+};
+long budget = BENCH_TIME;		/* ms of operations per scale */
+int perf_fd = -1;			/* Perf group leader (cycles), or -1 */
+int perf_fd2 = -1;			/* Instructions */
+struct mark m;				/* Measurements of the running benchmark */
+
+/*
+ * usage: how to use program
+ */
+
+int usage() {
+	struct bench *b;
+
+	fprintf(stderr, "Usage: rudp_bench [-u] [-n max] [-t ms] [-m mbytes] [benchmark...]\n");
+	fprintf(stderr, "Benchmarks:");
+	for (b = benches; b->name; b++)
+		fprintf(stderr, " %s", b->name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/*
+ * perf_open: count user space cycles and instructions of this thread,
+ * if the kernel lets us.
+ */
+
+static void perf_open() {
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.size = sizeof(pe);
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+	if (perf_fd < 0)
+		return;
+	pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+	pe.disabled = 0;
+	perf_fd2 = syscall(__NR_perf_event_open, &pe, 0, -1, perf_fd, 0);
+	if (perf_fd2 < 0) {
+		close(perf_fd);
+		perf_fd = -1;
+		return;
+	}
+	ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_read(u_int64_t *cycles, u_int64_t *insns) {
+	*cycles = *insns = 0;
+	if (perf_fd < 0)
+		return;
+	if (read(perf_fd, cycles, sizeof(*cycles)) != sizeof(*cycles) ||
+	    read(perf_fd2, insns, sizeof(*insns)) != sizeof(*insns))
+		*cycles = *insns = 0;
+}
+
+static u_int64_t tsc() {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * start, stop: time a section of operations; sections add up in m.
+ */
+
+static void start() {
+	perf_read(&m.cycles0, &m.insns0);
+	clock_gettime(CLOCK_MONOTONIC, &m.t0);
+	m.tsc0 = tsc();
+}
+
+static void stop(long ops) {
+	struct timespec t1;
+	u_int64_t t = tsc();
+	u_int64_t cycles, insns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	perf_read(&cycles, &insns);
+	m.tsc += t - m.tsc0;
+	m.ns += (t1.tv_sec - m.t0.tv_sec) * 1000000000L + t1.tv_nsec - m.t0.tv_nsec;
+	m.cycles += cycles - m.cycles0;
+	m.insns += insns - m.insns0;
+	m.ops += ops;
+}
+
+/*
+ * done: the time budget of the scale is used up.
+ */
+
+static int done() {
+	return m.ns >= budget * 1000000L;
+}
+
+static void report(char *name, long n) {
+	printf("%-18s %8ld %10ld %10.1f", name, n, m.ops, m.ops ? (double)m.ns / m.ops : 0.0);
+#ifdef HAVE_TSC
+	printf(" %10.1f", m.ops ? (double)m.tsc / m.ops : 0.0);
+#else
+	printf(" %10s", "-");
+#endif
+	if (perf_fd >= 0)
+		printf(" %10.1f %10.1f\n", m.ops ? (double)m.cycles / m.ops : 0.0,
+		       m.ops ? (double)m.insns / m.ops : 0.0);
+	else
+		printf(" %10s %10s\n", "-", "-");
+	fflush(stdout);
+}
+
+/*
+ * rnd: pseudo random number below n, the same sequence on every run.
+ */
+
+static unsigned long rnd_state = 1;
+
+static long rnd(long n) {
+	rnd_state = rnd_state * 6364136223846793005UL + 1442695040888963407UL;
+	return (rnd_state >> 33) % n;
+}
+
+static int nop(int fd, void *arg) {
+	return 0;
+}
+
+/*
+ * bench_timeout: n timers are pending; one with a random deadline among
+ * them is added and deleted again. Both walk the sorted list.
+ */
+
+static void bench_timeout(long n) {
+	struct timeval base, t;
+	long i, k;
+
+	event_gettime(&base);
+	base.tv_sec += 3600;
+	/* Latest first: each goes to the head of the list */
+	for (i = n - 1; i >= 0; i--) {
+		t = base;
+		t.tv_usec = 0;
+		t.tv_sec += i;
+		event_timeout(t, nop, (void *)(i + 1), "bench");
+	}
+	while (!done()) {
+		start();
+		for (k = 0; k < BENCH_BATCH; k++) {
+			t = base;
+			t.tv_usec = 0;
+			t.tv_sec += rnd(n);
+			event_timeout(t, nop, NULL, "bench");
+			event_timeout_delete(nop, NULL);
+		}
+		stop(BENCH_BATCH);
+	}
+	for (i = 0; i < n; i++)
+		event_timeout_delete(nop, (void *)(i + 1));
+}
+
+/*
+ * bench_fd: n file descriptor events are registered, of which only the
+ * first is ready; every pass of the loop dispatches it once. The idle
+ * ones share a pipe, so n is not limited by the number of descriptors.
+ */
+
+static long fd_n;
+static int fd_idle[2];
+static int fd_ready;
+
+static int fd_dispatched(int fd, void *arg) {
+	long i;
+
+	m.ops++;
+	if ((m.ops % BENCH_BATCH) != 0)
+		return 0;
+	stop(0);
+	if (!done()) {
+		start();
+		return 0;
+	}
+	/* Newest first, so that each is found at the head */
+	for (i = fd_n - 1; i >= 1; i--)
+		event_fd_delete(nop, (void *)i);
+	event_fd_delete(fd_dispatched, NULL);
+	return 0;
+}
+
+static void bench_fd(long n) {
+	long i;
+
+	if (pipe(fd_idle) < 0 || (fd_ready = eventfd(1, 0)) < 0) {
+		perror("rudp_bench: pipe");
+		exit(1);
+	}
+	fd_n = n;
+	event_fd(fd_ready, fd_dispatched, NULL, "bench");
+	for (i = 1; i < n; i++)
+		event_fd(fd_idle[0], nop, (void *)i, "bench");
+	start();
+	eventloop();
+	close(fd_ready);
+	close(fd_idle[0]);
+	close(fd_idle[1]);
+}
+
+/*
+ * queue: a send queue of n data packets from seqno on, as rudp_sendto
+ * builds it.
+ */
+
+static struct send_data_list_buffer *queue(struct rudp_conn *conn, long n, u_int32_t seqno) {
+	struct send_data_list_buffer *head = NULL, *tail = NULL, *node;
+	static char data[RUDP_MAXPKTSIZE];
+	long i;
+
+	for (i = 0; i < n; i++) {
+		node = createNodeBuffer(createRUDPPacket(RUDP_DATA, seqno + i, data, sizeof(data)),
+					conn, sizeof(data), conn ? &conn->peer : NULL);
+		/* Appended directly: addNode would walk the queue each time */
+		if (tail)
+			tail->next = node;
+		else
+			head = node;
+		tail = node;
+	}
+	return head;
+}
+
+static void bench_findnode(long n) {
+	struct send_data_list_buffer *head = queue(NULL, n, 1);
+	long k;
+
+	while (!done()) {
+		start();
+		for (k = 0; k < BENCH_BATCH; k++) {
+			if (findNode(head, 1 + rnd(n)) == NULL)
+				fprintf(stderr, "rudp_bench: findNode failed\n");
+		}
+		stop(BENCH_BATCH);
+	}
+	while (head)
+		head = removeNode(head);
+}
+
+static void bench_addnode(long n) {
+	struct send_data_list_buffer *head = queue(NULL, n, 1), *node;
+	long k;
+
+	while (!done()) {
+		start();
+		for (k = 0; k < BENCH_BATCH; k++) {
+			node = head;		/* The head goes back in at the tail */
+			head = head->next;
+			node->next = NULL;
+			head = addNode(head, node);
+		}
+		stop(BENCH_BATCH);
+	}
+	while (head)
+		head = removeNode(head);
+}
+
+/*
+ * bench_packet: n packets are created and then freed, as a burst of
+ * messages is queued and acknowledged.
+ */
+
+static void bench_packet(long n) {
+	rudp_packet **p = malloc(n * sizeof(rudp_packet *));
+	static char data[RUDP_MAXPKTSIZE];
+	long i;
+
+	while (!done()) {
+		start();
+		for (i = 0; i < n; i++)
+			p[i] = createRUDPPacket(RUDP_DATA, i, data, sizeof(data));
+		for (i = 0; i < n; i++)
+			freeMem(p[i], sizeof(rudp_packet));
+		stop(n);
+	}
+	free(p);
+}
+
+/*
+ * txturn: run the transmit scheduler's turn that is due, as the loop would.
+ */
+
+static void txturn() {
+	event_timeout_delete(rudp_txrun, NULL);
+	rudp_txrun(0, NULL);
+}
+
+/*
+ * bench_ack: a sending connection in DATA has n packets queued and a
+ * window in flight; each ACK acknowledges one packet, which lets out the
+ * next on the scheduler's turn. The packets go to the discard port of the
+ * loopback address.
+ */
+
+static void bench_ack(long n) {
+	struct rudp_socket *skt;
+	struct rudp_conn *conn;
+	struct sockaddr_in to;
+	rudp_packet ack;
+	u_int16_t wnd = htons(RUDP_MAXWINDOW | RUDP_WND_ACKOK);
+	long k;
+
+	skt = malloc(sizeof(struct rudp_socket));
+	memset(skt, 0, sizeof(struct rudp_socket));
+	if ((skt->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("rudp_bench: socket");
+		exit(1);
+	}
+	skt->cc_ops = &rudp_cc_newreno;
+	skt->weight = 1;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	to.sin_port = htons(9);
+	memcpy(ack.data, &wnd, RUDP_WNDLEN);
+	while (!done()) {
+		conn = createConn(skt, &to, 1);
+		conn->state = DATA;
+		conn->synseqno = 1;
+		conn->hack = conn->snd_nxt = conn->snd_max = 2;
+		conn->seqno = n + 1;
+		conn->head = queue(conn, n, 2);
+		send_data(conn, &to);
+		txturn();
+		start();
+		for (k = 0; conn->hack <= conn->seqno; k++) {
+			ack.header = createRUDPHeader(RUDP_ACK, conn->hack + 1);
+			handleDATAState(conn, &ack, &to, RUDP_WNDLEN, 0);
+			txturn();
+		}
+		stop(k);
+		freeConn(conn);
+	}
+	close(skt->fd);
+	free(skt);
+}
+
+int main(int argc, char *argv[]) {
+	long maxn = BENCH_MAXN;
+	long mem = BENCH_MEM;
+	long n;
+	int c, i;
+	struct bench *b;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "m:n:t:u")) != -1) {
+		if (c == 'm')
+			mem = atol(optarg);
+		else if (c == 'n')
+			maxn = atol(optarg);
+		else if (c == 't')
+			budget = atol(optarg);
+		else if (c == 'u') {
+			if (event_backend("io_uring") < 0)
+				fprintf(stderr, "rudp_bench: io_uring not available, using select\n");
+		}
+		else
+			usage();
+	}
+	if (maxn < 10 || budget <= 0 || mem <= 0)
+		usage();
+	for (i = optind; i < argc; i++) {
+		for (b = benches; b->name && strcmp(b->name, argv[i]) != 0; b++)
+			;
+		if (b->name == NULL)
+			usage();
+	}
+	perf_open();
+	printf("%-18s %8s %10s %10s %10s %10s %10s\n", "benchmark", "n", "ops", "ns/op",
+	       "tsc/op", "cycles/op", "insns/op");
+	for (b = benches; b->name; b++) {
+		for (i = optind; i < argc && strcmp(b->name, argv[i]) != 0; i++)
+			;
+		if (optind < argc && i == argc)
+			continue;
+		for (n = 10; n <= maxn; n *= 10) {
+			if (b->packets && n * (long)sizeof(rudp_packet) > mem * 1024 * 1024) {
+				printf("%-18s %8ld skipped: more than %ld MB of packets (-m)\n",
+				       b->name, n, mem);
+				continue;
+			}
+			memset(&m, 0, sizeof(m));
+			b->run(n);
+			report(b->name, n);
+		}
+	}
+	return 0;
+}
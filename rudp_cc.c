@@ -0,0 +1,365 @@
+/*
+ * rudp_cc.c: congestion control algorithms for RUDP senders.
+ * fixed keeps the window at RUDP_WINDOW, as RUDP always did; newreno and
+ * cubic follow RFC 6582 and RFC 8312 on a window counted in packets; bbr
+ * is a simplified model-based controller that paces at the measured
+ * bottleneck bandwidth and keeps about a bandwidth-delay product in
+ * flight.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "event.h"
+#include "rudp.h"
+#include "rudp_cc.h"
+
+#define CC_MINWINDOW	2		// Least window after a reduction.
+#define CUBIC_C		0.4		// CUBIC scaling constant.
+#define CUBIC_BETA	0.7		// CUBIC multiplicative decrease.
+#define BBR_STARTUP	0		// BBR states.
+#define BBR_DRAIN	1
+#define BBR_PROBE_BW	2
+#define BBR_PROBE_RTT	3
+#define BBR_HIGH_GAIN	2.885		// 2/ln(2): doubles the sending rate every round.
+#define BBR_MINWINDOW	4		// Window during PROBE_RTT, and the least otherwise.
+#define BBR_MINRTT_LIFE	10000000	// us a min_rtt sample is trusted without being refreshed.
+#define BBR_PROBE_RTT_TIME 200000	// us spent in PROBE_RTT.
+
+static double bbr_cycle_gain[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static struct rudp_cc_ops *rudp_cc_all[] = {
+	&rudp_cc_fixed, &rudp_cc_newreno, &rudp_cc_cubic, &rudp_cc_bbr, NULL
+};
+
+/*
+ * cc_usec: microseconds from a to b.
+ */
+static long cc_usec(struct timeval *a, struct timeval *b){
+	return (b->tv_sec-a->tv_sec)*1000000L + (b->tv_usec-a->tv_usec);
+}
+
+/*
+ * rudp_cc_find: look up an algorithm by name; NULL if there is none.
+ */
+struct rudp_cc_ops *rudp_cc_find(char *name){
+	int i;
+	for(i=0; rudp_cc_all[i]!=NULL; i++){
+		if(strcmp(rudp_cc_all[i]->name, name) == 0){
+			return rudp_cc_all[i];
+		}
+	}
+	return NULL;
+}
+
+void rudp_cc_init(struct rudp_cc *cc, struct rudp_cc_ops *ops){
+	memset(cc, 0, sizeof(struct rudp_cc));
+	cc->ops = ops;
+	cc->cwnd = RUDP_WINDOW;				// Initial window.
+	cc->ssthresh = RUDP_MAXWINDOW;
+	ops->init(cc);
+}
+
+/*
+ * rudp_cc_rtt: fold a round trip time sample (us) into the smoothed
+ * estimate (RFC 6298) and hand it to the algorithm.
+ */
+void rudp_cc_rtt(struct rudp_cc *cc, long rtt){
+	long err;
+	if(rtt <= 0){
+		rtt = 1;
+	}
+	if(cc->srtt == 0){
+		cc->srtt = rtt;
+		cc->rttvar = rtt/2;
+	}else{
+		err = rtt > cc->srtt ? rtt-cc->srtt : cc->srtt-rtt;
+		cc->rttvar = (3*cc->rttvar + err)/4;
+		cc->srtt = (7*cc->srtt + rtt)/8;
+	}
+	if(cc->min_rtt == 0 || rtt < cc->min_rtt){
+		cc->min_rtt = rtt;
+	}
+	cc->ops->on_rtt_sample(cc, rtt);
+}
+
+/*
+ * rudp_cc_window: packets the connection may have in flight.
+ */
+int rudp_cc_window(struct rudp_cc *cc){
+	int w = (int)cc->cwnd;
+	if(w < 1){
+		w = 1;
+	}
+	if(w > RUDP_MAXWINDOW){
+		w = RUDP_MAXWINDOW;
+	}
+	return w;
+}
+
+static void cc_nop_init(struct rudp_cc *cc){
+}
+
+static void cc_nop_rtt(struct rudp_cc *cc, long rtt){
+}
+
+static double cc_no_pacing(struct rudp_cc *cc){
+	return 0;
+}
+
+/*
+ * fixed: RUDP_WINDOW packets in flight, whatever happens.
+ */
+static void fixed_on_ack(struct rudp_cc *cc, int acked, int inflight, double rate){
+}
+
+static void fixed_on_loss(struct rudp_cc *cc, int inflight){
+}
+
+static void fixed_on_rto(struct rudp_cc *cc){
+}
+
+struct rudp_cc_ops rudp_cc_fixed = {
+	"fixed", cc_nop_init, fixed_on_ack, fixed_on_loss, fixed_on_rto, cc_nop_rtt, cc_no_pacing
+};
+
+/*
+ * newreno: slow start up to ssthresh, then one packet per window per
+ * round trip; halve on loss. The connection does the NewReno part, i.e.
+ * it stays in recovery, retransmitting on partial ACKs, until everything
+ * sent before the loss is acknowledged; the window does not grow then.
+ */
+static void newreno_on_ack(struct rudp_cc *cc, int acked, int inflight, double rate){
+	if(cc->recovery){
+		return;
+	}
+	if(cc->cwnd < cc->ssthresh){
+		cc->cwnd += acked;
+	}else{
+		cc->cwnd += (double)acked/cc->cwnd;
+	}
+	if(cc->cwnd > RUDP_MAXWINDOW){
+		cc->cwnd = RUDP_MAXWINDOW;		// Don't build up credit the window can't use.
+	}
+}
+
+static void newreno_on_loss(struct rudp_cc *cc, int inflight){
+	cc->ssthresh = inflight/2.0;
+	if(cc->ssthresh < CC_MINWINDOW){
+		cc->ssthresh = CC_MINWINDOW;
+	}
+	cc->cwnd = cc->ssthresh;
+}
+
+static void newreno_on_rto(struct rudp_cc *cc){
+	cc->ssthresh = cc->cwnd/2;
+	if(cc->ssthresh < CC_MINWINDOW){
+		cc->ssthresh = CC_MINWINDOW;
+	}
+	cc->cwnd = 1;
+}
+
+struct rudp_cc_ops rudp_cc_newreno = {
+	"newreno", cc_nop_init, newreno_on_ack, newreno_on_loss, newreno_on_rto, cc_nop_rtt, cc_no_pacing
+};
+
+/*
+ * cubic: after a loss the window follows W(t) = C(t-K)^3 + w_max, a cubic
+ * in the time since the loss that is flat around the old maximum, but
+ * never grows slower than Reno would.
+ */
+static double cubic_cbrt(double x){
+	double r = x > 1 ? x/3 : 1;
+	int i;
+	if(x <= 0){
+		return 0;
+	}
+	for(i=0; i<50; i++){
+		r = r - (r*r*r - x)/(3*r*r);
+	}
+	return r;
+}
+
+static void cubic_on_ack(struct rudp_cc *cc, int acked, int inflight, double rate){
+	struct timeval now;
+	double t, target, reno;
+	if(cc->recovery){
+		return;
+	}
+	if(cc->cwnd < cc->ssthresh){
+		cc->cwnd += acked;
+	}else{
+		event_gettime(&now);
+		if(!cc->u.cubic.epoch_valid){
+			cc->u.cubic.epoch = now;
+			cc->u.cubic.epoch_valid = 1;
+			if(cc->u.cubic.w_max < cc->cwnd){
+				cc->u.cubic.w_max = cc->cwnd;
+				cc->u.cubic.k = 0;
+			}else{
+				cc->u.cubic.k = cubic_cbrt((cc->u.cubic.w_max-cc->cwnd)/CUBIC_C);
+			}
+		}
+		t = cc_usec(&cc->u.cubic.epoch, &now)/1000000.0 + cc->srtt/1000000.0;
+		target = CUBIC_C*(t-cc->u.cubic.k)*(t-cc->u.cubic.k)*(t-cc->u.cubic.k) + cc->u.cubic.w_max;
+		if(cc->srtt > 0){
+			reno = cc->u.cubic.w_max*CUBIC_BETA + 3*(1-CUBIC_BETA)/(1+CUBIC_BETA)*t/(cc->srtt/1000000.0);
+			if(reno > target){
+				target = reno;
+			}
+		}
+		if(target > cc->cwnd){
+			cc->cwnd += (target-cc->cwnd)*acked/cc->cwnd;
+		}else{
+			cc->cwnd += 0.01*acked/cc->cwnd;
+		}
+	}
+	if(cc->cwnd > RUDP_MAXWINDOW){
+		cc->cwnd = RUDP_MAXWINDOW;
+	}
+}
+
+static void cubic_on_loss(struct rudp_cc *cc, int inflight){
+	if(cc->cwnd < cc->u.cubic.w_max){
+		cc->u.cubic.w_max = cc->cwnd*(1+CUBIC_BETA)/2;	// Fast convergence: yield to newer flows.
+	}else{
+		cc->u.cubic.w_max = cc->cwnd;
+	}
+	cc->cwnd = cc->cwnd*CUBIC_BETA;
+	if(cc->cwnd < CC_MINWINDOW){
+		cc->cwnd = CC_MINWINDOW;
+	}
+	cc->ssthresh = cc->cwnd;
+	cc->u.cubic.epoch_valid = 0;
+}
+
+static void cubic_on_rto(struct rudp_cc *cc){
+	cubic_on_loss(cc, (int)cc->cwnd);
+	cc->cwnd = 1;
+}
+
+struct rudp_cc_ops rudp_cc_cubic = {
+	"cubic", cc_nop_init, cubic_on_ack, cubic_on_loss, cubic_on_rto, cc_nop_rtt, cc_no_pacing
+};
+
+/*
+ * bbr: estimate the bottleneck bandwidth (max delivery rate over the last
+ * RUDP_CC_BBR_ROUNDS round trips) and the propagation delay (min_rtt),
+ * pace at gain times the bandwidth and allow gain times their product in
+ * flight. STARTUP doubles the rate each round until the bandwidth stops
+ * growing, DRAIN empties the queue that built, PROBE_BW cycles the gain
+ * around 1, and PROBE_RTT shrinks the window briefly when min_rtt is
+ * stale. Loss is not a signal. A round is one min_rtt of time rather
+ * than a delivered-packet count.
+ */
+static void bbr_init(struct rudp_cc *cc){
+	cc->u.bbr.state = BBR_STARTUP;
+	cc->u.bbr.pacing_gain = BBR_HIGH_GAIN;
+	cc->u.bbr.cwnd_gain = BBR_HIGH_GAIN;
+}
+
+static double bbr_bdp(struct rudp_cc *cc){
+	return cc->u.bbr.btl_bw*cc->min_rtt/1000000.0;
+}
+
+static void bbr_on_rtt_sample(struct rudp_cc *cc, long rtt){
+	struct timeval now;
+	event_gettime(&now);
+	if(rtt <= cc->min_rtt){
+		cc->u.bbr.min_rtt_stamp = now;
+	}
+}
+
+static void bbr_on_ack(struct rudp_cc *cc, int acked, int inflight, double rate){
+	struct timeval now;
+	int newround = 0;
+	int i;
+	event_gettime(&now);
+	if(cc->min_rtt > 0 && cc_usec(&cc->u.bbr.round_stamp, &now) >= cc->min_rtt){
+		cc->u.bbr.round = (cc->u.bbr.round+1)%RUDP_CC_BBR_ROUNDS;
+		cc->u.bbr.bw[cc->u.bbr.round] = 0;
+		cc->u.bbr.round_stamp = now;
+		newround = 1;
+	}
+	if(rate > cc->u.bbr.bw[cc->u.bbr.round]){
+		cc->u.bbr.bw[cc->u.bbr.round] = rate;
+	}
+	cc->u.bbr.btl_bw = 0;
+	for(i=0; i<RUDP_CC_BBR_ROUNDS; i++){
+		if(cc->u.bbr.bw[i] > cc->u.bbr.btl_bw){
+			cc->u.bbr.btl_bw = cc->u.bbr.bw[i];
+		}
+	}
+	switch(cc->u.bbr.state){
+	case BBR_STARTUP:
+		if(newround){
+			if(cc->u.bbr.btl_bw >= cc->u.bbr.full_bw*1.25){
+				cc->u.bbr.full_bw = cc->u.bbr.btl_bw;
+				cc->u.bbr.full_count = 0;
+			}else if(++cc->u.bbr.full_count >= 3){
+				cc->u.bbr.state = BBR_DRAIN;	// The pipe is full.
+				cc->u.bbr.pacing_gain = 1/BBR_HIGH_GAIN;
+			}
+		}
+		break;
+	case BBR_DRAIN:
+		if(inflight <= bbr_bdp(cc)){
+			cc->u.bbr.state = BBR_PROBE_BW;
+			cc->u.bbr.cycle = 0;
+			cc->u.bbr.cycle_stamp = now;
+			cc->u.bbr.pacing_gain = bbr_cycle_gain[0];
+			cc->u.bbr.cwnd_gain = 2;
+		}
+		break;
+	case BBR_PROBE_BW:
+		if(cc_usec(&cc->u.bbr.cycle_stamp, &now) >= cc->min_rtt){
+			cc->u.bbr.cycle = (cc->u.bbr.cycle+1)%8;
+			cc->u.bbr.cycle_stamp = now;
+			cc->u.bbr.pacing_gain = bbr_cycle_gain[cc->u.bbr.cycle];
+		}
+		break;
+	case BBR_PROBE_RTT:
+		if(cc_usec(&cc->u.bbr.probe_rtt_stamp, &now) >= BBR_PROBE_RTT_TIME){
+			cc->u.bbr.min_rtt_stamp = now;
+			cc->u.bbr.state = BBR_PROBE_BW;
+			cc->u.bbr.cycle_stamp = now;
+			cc->u.bbr.pacing_gain = 1;
+		}
+		break;
+	}
+	if(cc->u.bbr.state != BBR_PROBE_RTT && cc->min_rtt > 0 &&
+			cc_usec(&cc->u.bbr.min_rtt_stamp, &now) > BBR_MINRTT_LIFE){
+		cc->u.bbr.state = BBR_PROBE_RTT;	// Let the queue drain to see the real delay.
+		cc->u.bbr.probe_rtt_stamp = now;
+		cc->min_rtt = 0;			// The next sample sets it.
+	}
+	if(cc->u.bbr.state == BBR_PROBE_RTT){
+		cc->cwnd = BBR_MINWINDOW;
+	}else if(cc->u.bbr.btl_bw == 0 || cc->min_rtt == 0){
+		cc->cwnd += acked;			// No model yet: grow as slow start does.
+	}else{
+		cc->cwnd = cc->u.bbr.cwnd_gain*bbr_bdp(cc);
+		if(cc->cwnd < BBR_MINWINDOW){
+			cc->cwnd = BBR_MINWINDOW;
+		}
+	}
+	if(cc->cwnd > RUDP_MAXWINDOW){
+		cc->cwnd = RUDP_MAXWINDOW;
+	}
+}
+
+static void bbr_on_loss(struct rudp_cc *cc, int inflight){
+}
+
+static void bbr_on_rto(struct rudp_cc *cc){
+	cc->cwnd = BBR_MINWINDOW;			// The model is rebuilt from the next ACKs.
+}
+
+static double bbr_pacing_rate(struct rudp_cc *cc){
+	return cc->u.bbr.pacing_gain*cc->u.bbr.btl_bw;
+}
+
+struct rudp_cc_ops rudp_cc_bbr = {
+	"bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto, bbr_on_rtt_sample, bbr_pacing_rate
+};
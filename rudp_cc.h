@@ -0,0 +1,79 @@
+#ifndef RUDP_CC_H
+#define	RUDP_CC_H
+
+/*
+ * Congestion control for RUDP sending connections.
+ * Each sending connection keeps a struct rudp_cc and drives it through
+ * the operations of the algorithm selected for its socket:
+ *   on_ack		acked packets were newly (cumulatively) acknowledged;
+ *			rate is the delivery rate the ACK measured, in packets
+ *			per second, or 0 if there is no sample
+ *   on_loss		a loss was detected by duplicate ACKs; called once per
+ *			window of data, before fast recovery starts
+ *   on_rto		the retransmission timer of the oldest packet expired
+ *   on_rtt_sample	a round trip time (us) was measured on a packet that
+ *			was sent only once
+ *   pacing_rate	packets per second to spread transmissions over, or 0
+ *			to send as soon as the window allows
+ * cwnd is in packets. The connection keeps at most rudp_cc_window()
+ * packets in flight, which is also bounded by RUDP_MAXWINDOW.
+ */
+
+#define RUDP_CC_BBR_ROUNDS	10	/* Round trips the bottleneck bandwidth is the max over */
+
+struct rudp_cc;
+
+struct rudp_cc_ops {
+	char *name;
+	void (*init)(struct rudp_cc *cc);
+	void (*on_ack)(struct rudp_cc *cc, int acked, int inflight, double rate);
+	void (*on_loss)(struct rudp_cc *cc, int inflight);
+	void (*on_rto)(struct rudp_cc *cc);
+	void (*on_rtt_sample)(struct rudp_cc *cc, long rtt);
+	double (*pacing_rate)(struct rudp_cc *cc);
+};
+
+struct rudp_cc {
+	struct rudp_cc_ops *ops;
+	double cwnd;			/* Congestion window (packets) */
+	double ssthresh;		/* Slow start threshold (packets) */
+	int recovery;			/* Set by the connection during fast recovery */
+	long srtt;			/* Smoothed round trip time (us), 0 before the first sample */
+	long rttvar;			/* Round trip time variation (us) */
+	long min_rtt;			/* Least round trip time seen (us) */
+	union {
+		struct {
+			double w_max;		/* Window before the last reduction */
+			double k;		/* Time (s) to grow back to w_max */
+			struct timeval epoch;	/* Start of the current growth epoch */
+			int epoch_valid;
+		} cubic;
+		struct {
+			int state;		/* STARTUP, DRAIN, PROBE_BW or PROBE_RTT */
+			double btl_bw;		/* Bottleneck bandwidth estimate (packets/s) */
+			double bw[RUDP_CC_BBR_ROUNDS];	/* Max delivery rate of recent rounds */
+			int round;		/* Slot in bw of the current round */
+			struct timeval round_stamp;	/* Start of the current round */
+			double full_bw;		/* Startup: bandwidth at the last growth */
+			int full_count;		/* Startup: rounds without growth */
+			int cycle;		/* Probe bandwidth: phase of the gain cycle */
+			struct timeval cycle_stamp;	/* Start of the current phase */
+			struct timeval min_rtt_stamp;	/* When min_rtt was last lowered or refreshed */
+			struct timeval probe_rtt_stamp;	/* Start of the current PROBE_RTT */
+			double pacing_gain;
+			double cwnd_gain;
+		} bbr;
+	} u;
+};
+
+extern struct rudp_cc_ops rudp_cc_fixed;
+extern struct rudp_cc_ops rudp_cc_newreno;
+extern struct rudp_cc_ops rudp_cc_cubic;
+extern struct rudp_cc_ops rudp_cc_bbr;
+
+struct rudp_cc_ops *rudp_cc_find(char *name);
+void rudp_cc_init(struct rudp_cc *cc, struct rudp_cc_ops *ops);
+void rudp_cc_rtt(struct rudp_cc *cc, long rtt);
+int rudp_cc_window(struct rudp_cc *cc);
+
+#endif /* RUDP_CC_H */
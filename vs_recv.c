@@ -1,6 +1,8 @@
 /* 
  * A simple RUDP receiver to receive files from remote hosts.
  * It takes only one argument - local port to be used.
+ * In delta mode the new version of a file is built next to the old copy
+ * and renamed over it once complete.
  */
 
 #include <stdio.h>
@@ -11,7 +13,9 @@
 #include <errno.h>
 #include <syslog.h>
 #include <fcntl.h>
+#include <endian.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -19,6 +23,10 @@
 #include "rudp_api.h" 
 #include "event.h" 
 #include "vsftp.h"
+#include "crc32c.h"
+#include "delta.h"
+
+#define VS_TMPSUFFIX ".vs-tmp"		/* Suffix of files being rebuilt in delta mode */
 
 
 /*
@@ -31,6 +39,14 @@ struct rxfile {
 	int fd;				/* File descriptor */
 	struct sockaddr_in remote;	/* Peer */
 	char name[VS_FILENAMELENGTH+1]; /* Name of file */
+	u_int32_t digest;		/* CRC32C of the data written so far */
+	u_int64_t size;			/* Size of the file at the sender */
+	u_int64_t start;		/* Start of the range being sent ... */
+	u_int64_t end;			/* ... and its end */
+	int resume;			/* True if the sender picks up after what we have */
+	int srcfd;			/* Delta mode: the old copy, or -1 */
+	u_int32_t blocksize;		/* Delta mode: block size of the signatures */
+	char tmpname[VS_FILENAMELENGTH+sizeof(VS_TMPSUFFIX)]; /* Delta mode: file being built */
 
 };
 
@@ -40,13 +56,20 @@ struct rxfile {
 
 int filesender(int fd, void *arg);
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+int rudp_batch_receiver(rudp_socket_t rsocket, struct rudp_rxdesc *desc, int n);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 int usage();
+void spin_report();
 
 /* 
  * Global variables 
  */
 int debug = 0;				/* Print debug messages */
+int nrxbufs = 0;			/* Receive into this many buffers of our own (-z) */
+int uring = 0;				/* Use the io_uring event loop */
+int spincpu = -1;			/* Busy poll on this CPU (-B) */
+int idle = 0;				/* Drop peers silent for this many seconds (-i) */
+long memlimit = 0;			/* Memory ceiling of the RUDP layer in kbytes (-M) */
 struct rxfile *rxhead = NULL;		/* Pointer to linked list of rxfiles */
 
 /* 
@@ -54,10 +77,23 @@ struct rxfile *rxhead = NULL;		/* Pointer to linked list of rxfiles */
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_recv [-d] port\n");
+	fprintf(stderr, "Usage: vs_recv [-B cpu] [-d] [-u] [-i secs] [-M kbytes] [-z nbufs] port\n");
 	exit(1);
 }
 
+/*
+ * spin_report: how the busy-polling loop has spent its time so far.
+ */
+
+void spin_report() {
+	unsigned long polls, idle;
+	double busy;
+
+	event_spin_stats(&polls, &idle, &busy);
+	printf("vs_recv: spin: %lu polls, %lu idle, %.1f%% of the time busy\n",
+	       polls, idle, busy * 100);
+}
+
 int main(int argc, char* argv[]) {
 	rudp_socket_t rsock;
 	int port;
@@ -69,10 +105,33 @@ int main(int argc, char* argv[]) {
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	while ((c = getopt(argc, argv, "B:di:M:uz:")) != -1) {
 		if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 'B') {
+			spincpu = atoi(optarg);
+			if (spincpu < 0)
+				usage();
+		}
+		else if (c == 'i') {
+			idle = atoi(optarg);
+			if (idle <= 0)
+				usage();
+		}
+		else if (c == 'M') {
+			memlimit = atol(optarg);
+			if (memlimit <= 0)
+				usage();
+		}
+		else if (c == 'u') {
+			uring = 1;
+		}
+		else if (c == 'z') {
+			nrxbufs = atoi(optarg);
+			if (nrxbufs <= 0)
+				usage();
+		}
 		else 
 			usage();
 	}
@@ -90,6 +149,14 @@ int main(int argc, char* argv[]) {
 		printf("RUDP receiver waiting on port %i.\n",port);
 	}
 
+	if (uring && event_backend("io_uring") < 0) {
+		fprintf(stderr, "vs_recv: io_uring not available, using select\n");
+	}
+	else if (spincpu >= 0 && (event_backend("spin") < 0 || event_pin(spincpu) < 0)) {
+		fprintf(stderr, "vs_recv: cannot busy poll on CPU %d\n", spincpu);
+		exit(1);
+	}
+
 	/*
 	 * Create RUDP listener socket
 	 */
@@ -99,11 +166,24 @@ int main(int argc, char* argv[]) {
 		exit(1);
 	}
 
+	if (idle > 0)
+		rudp_set_idle(rsock, idle);
+	if (memlimit > 0)
+		rudp_set_memlimit(memlimit * 1024);
+
 	/*
 	 * Register receiver callback function
 	 */
 
-	rudp_recvfrom_handler(rsock, rudp_receiver);
+	if (nrxbufs > 0) {
+		if (rudp_recv_buffers(rsock, malloc(nrxbufs * RUDP_RXBUFSIZE), 
+				      nrxbufs, rudp_batch_receiver) < 0) {
+			fprintf(stderr,"vs_recv: rudp_recv_buffers() failed\n");
+			exit(1);
+		}
+	}
+	else
+		rudp_recvfrom_handler(rsock, rudp_receiver);
 
 	/*
 	 * Register event handler callback function
@@ -129,7 +209,8 @@ static struct rxfile *rxfind(struct sockaddr_in *addr) {
 	struct rxfile *rx;
 
 	for (rx = rxhead; rx != NULL; rx = rx->next) {
-		if (memcmp(&rx->remote, addr, sizeof(struct in_addr)) == 0)
+		if (rx->remote.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    rx->remote.sin_port == addr->sin_port)
 			return rx;
 	}
 	/* Not found, create new */
@@ -138,6 +219,8 @@ static struct rxfile *rxfind(struct sockaddr_in *addr) {
 		exit(1);
 	}
 	rx->fileopen = 0;
+	rx->srcfd = -1;
+	rx->tmpname[0] = '\0';
 	rx->remote = *addr;
 	rx->next = rxhead;
 	rxhead = rx;
@@ -162,6 +245,106 @@ static int rxdel(struct rxfile *rx) {
 	return 0;
 }
 
+/*
+ * rxabort: close a partially received file. A file being rebuilt in
+ * delta mode is removed; the old copy stays.
+ */
+
+static void rxabort(struct rxfile *rx) {
+	if (rx->fileopen) {
+		event_pwrite_wait(rx->fd);
+		close(rx->fd);
+		rx->fileopen = 0;
+		if (rx->tmpname[0] != '\0')
+			unlink(rx->tmpname);
+	}
+	if (rx->srcfd >= 0) {
+		close(rx->srcfd);
+		rx->srcfd = -1;
+	}
+}
+
+/*
+ * send_sigs: delta mode. Send the signatures of the whole blocks of the
+ * old copy of the file to the sender, VS_MAXSIGS per message. A file
+ * that does not exist has no blocks.
+ */
+
+static int send_sigs(rudp_socket_t rsocket, struct rxfile *rx, struct sockaddr_in *remote) {
+	struct vsftp vs;
+	struct stat st;
+	u_int32_t nblocks = 0, first = 0, count;
+	u_int32_t s1, s2;
+	u_int8_t *block;
+	int bytes;
+
+	rx->blocksize = 0;
+	if (rx->srcfd >= 0 && fstat(rx->srcfd, &st) == 0) {
+		rx->blocksize = delta_blocksize(st.st_size);
+		nblocks = st.st_size / rx->blocksize;
+	}
+	if ((block = malloc(rx->blocksize + 1)) == NULL) {
+		fprintf(stderr, "vs_recv: malloc failed\n");
+		exit(1);
+	}
+	if (debug) {
+		fprintf(stderr, "vs_recv: SIGS of %u blocks of \"%s\"\n", nblocks, rx->name);
+	}
+	vs.vs_type = htonl(VS_TYPE_SIGS);
+	vs.vs_info.vs_sigs.vs_blocksize = htonl(rx->blocksize);
+	vs.vs_info.vs_sigs.vs_nblocks = htonl(nblocks);
+	do {
+		for (count = 0; count < VS_MAXSIGS && first + count < nblocks; count++) {
+			bytes = pread(rx->srcfd, block, rx->blocksize, (off_t)(first + count) * rx->blocksize);
+			if (bytes != rx->blocksize) {
+				perror("vs_recv: read");
+				free(block);
+				return -1;
+			}
+			delta_sums(block, bytes, &s1, &s2);
+			vs.vs_info.vs_sigs.vs_sig[count].vs_weak = htonl(DELTA_WEAK(s1, s2));
+			vs.vs_info.vs_sigs.vs_sig[count].vs_strong = htobe64(delta_strong(block, bytes));
+		}
+		vs.vs_info.vs_sigs.vs_first = htonl(first);
+		vs.vs_info.vs_sigs.vs_count = htonl(count);
+		if (rudp_sendto(rsocket, (char *) &vs, VS_SIGSLEN + count * sizeof(struct vs_sig), remote) < 0) {
+			fprintf(stderr, "vs_recv: SIGS send failure\n");
+			free(block);
+			return -1;
+		}
+		first += count;
+	} while (first < nblocks);
+	free(block);
+	return 0;
+}
+
+/*
+ * copy_blocks: delta mode. Copy count blocks of the old copy, starting at
+ * block, to offset in the file being built.
+ */
+
+static int copy_blocks(struct rxfile *rx, u_int64_t offset, u_int32_t block, u_int32_t count) {
+	u_int8_t *buf;
+	int bytes;
+
+	if ((buf = malloc(rx->blocksize + 1)) == NULL) {
+		fprintf(stderr, "vs_recv: malloc failed\n");
+		exit(1);
+	}
+	while (count-- > 0) {
+		bytes = pread(rx->srcfd, buf, rx->blocksize, (off_t)block++ * rx->blocksize);
+		if (bytes != rx->blocksize || event_pwrite(rx->fd, buf, bytes, offset) != bytes) {
+			perror("vs_recv: copy");
+			free(buf);
+			return -1;
+		}
+		rx->digest = crc32c(rx->digest, buf, bytes);
+		offset += bytes;
+	}
+	free(buf);
+	return 0;
+}
+
 
 /* 
  * eventhandler: callback function for RUDP events
@@ -177,9 +360,7 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 				inet_ntoa(remote->sin_addr),
 				ntohs(remote->sin_port));
 			if ((rx = rxfind(remote))) {
-				if (rx->fileopen) {
-					close(rx->fd);
-				}
+				rxabort(rx);
 				rxdel(rx);
 			}
 		}
@@ -193,8 +374,8 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 				fprintf(stderr, "vs_recv: prematurely closed communication with %s:%d\n",
 					inet_ntoa(remote->sin_addr),
 					ntohs(remote->sin_port));
-				close(rx->fd);
 			}
+			rxabort(rx);
 			rxdel(rx);
 		} /* else ignore */
                 break;
@@ -212,7 +393,12 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
 	struct rxfile *rx;
+	struct vsftp reply;
+	struct stat st;
+	u_int32_t flags;
+	u_int64_t start, have;
 	int namelen;
+	int mismatch;
 	int i;
 
 	struct vsftp *vs = (struct vsftp *) buf;
@@ -224,10 +410,14 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 	rx = rxfind(remote);
 	switch (ntohl(vs->vs_type)) {
 	case VS_TYPE_BEGIN:
-		namelen = len - sizeof(vs->vs_type);
+		if (len < VS_BEGINLEN) {
+			fprintf(stderr, "vs_recv: Too short BEGIN (%d bytes)\n", len);
+			return 0;
+		}
+		namelen = len - VS_BEGINLEN;
 		if (namelen > VS_FILENAMELENGTH)
 			namelen = VS_FILENAMELENGTH;
-		strncpy(rx->name, vs->vs_info.vs_filename, namelen);
+		strncpy(rx->name, vs->vs_info.vs_begin.vs_filename, namelen);
 		rx->name[namelen] = '\0'; /* Null terminated */
 
 		/* Verify that file name is valid
@@ -238,7 +428,10 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 			if (!(isalnum(c) || c == '.' || c == '_' || c == '-')) {
 				fprintf(stderr, "vs_recv: Illegal file name \"%s\"\n", 
 					rx->name);
-				rudp_close(rsocket);
+				/* Only this peer's transfer is given up;
+				 * its DATA and END are ignored */
+				rxabort(rx);
+				rxdel(rx);
 				return 0;
 			}
 		}
@@ -247,12 +440,49 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 			fprintf(stderr, "vs_recv: BEGIN \"%s\" (%d bytes) from %s:%d\n", rx->name, len,
 				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		if ((rx->fd = creat(rx->name, 0644)) < 0) {
+		flags = ntohl(vs->vs_info.vs_begin.vs_flags);
+		rx->size = be64toh(vs->vs_info.vs_begin.vs_size);
+		start = be64toh(vs->vs_info.vs_begin.vs_start);
+		rx->end = be64toh(vs->vs_info.vs_begin.vs_end);
+		rx->start = start;
+		rx->resume = (flags & VS_FLAG_RESUME) != 0;
+		if (flags & VS_FLAG_DELTA) {
+			/* Build the new version next to the old one */
+			snprintf(rx->tmpname, sizeof(rx->tmpname), "%s%s", rx->name, VS_TMPSUFFIX);
+			rx->srcfd = open(rx->name, O_RDONLY);
+			rx->fd = creat(rx->tmpname, 0644);
+		}
+		/* Keep what is there unless the whole file is coming */
+		else if ((flags & VS_FLAG_RESUME) || start > 0 || rx->end < rx->size)
+			rx->fd = open(rx->name, O_WRONLY | O_CREAT, 0644);
+		else
+			rx->fd = creat(rx->name, 0644);
+		if (rx->fd < 0) {
 			perror("vs_recv: create");
-			rudp_close(rsocket);
+			rxabort(rx);
+			rxdel(rx);
+			break;
 		}
-		else {
-			rx->fileopen = 1;
+		rx->fileopen = 1;
+		rx->digest = 0;
+		if ((flags & VS_FLAG_DELTA) && send_sigs(rsocket, rx, remote) < 0) {
+			rxabort(rx);
+			break;
+		}
+		if (flags & VS_FLAG_RESUME) {
+			have = 0;
+			if (fstat(rx->fd, &st) == 0)
+				have = st.st_size < rx->size ? st.st_size : rx->size;
+			rx->start = have;
+			if (debug) {
+				fprintf(stderr, "vs_recv: HAVE %llu bytes of \"%s\"\n",
+					(unsigned long long)have, rx->name);
+			}
+			reply.vs_type = htonl(VS_TYPE_HAVE);
+			reply.vs_info.vs_have = htobe64(have);
+			if (rudp_sendto(rsocket, (char *) &reply, VS_MINLEN + sizeof(reply.vs_info.vs_have), remote) < 0) {
+				fprintf(stderr, "vs_recv: HAVE send failure\n");
+			}
 		}
 		break;
 	case VS_TYPE_DATA:
@@ -261,26 +491,90 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 				len, 
 				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		len -= sizeof(vs->vs_type);
-		/* len now is length of payload (data or file name) */
+		if (len < VS_DATALEN) {
+			fprintf(stderr, "vs_recv: Too short DATA (%d bytes)\n", len);
+			return 0;
+		}
+		len -= VS_DATALEN;
+		/* len now is length of file data */
 		if (rx->fileopen) {
-			if ((write(rx->fd, vs->vs_info.vs_filename, len)) < 0) {
+			if ((event_pwrite(rx->fd, vs->vs_info.vs_data.vs_data, len,
+					  be64toh(vs->vs_info.vs_data.vs_offset))) < 0) {
 				perror("vs_recv: write");
 			}
+			rx->digest = crc32c(rx->digest, vs->vs_info.vs_data.vs_data, len);
 		}
-		else {
+		/* A transfer given up on at BEGIN sends on regardless */
+		else if (debug) {
 			fprintf(stderr, "vs_recv: DATA ignored (file not open)\n");
 		}
 		break;
+	case VS_TYPE_COPY:
+		if (len < VS_COPYLEN) {
+			fprintf(stderr, "vs_recv: Too short COPY (%d bytes)\n", len);
+			return 0;
+		}
+		if (debug) {
+			fprintf(stderr, "vs_recv: COPY %u blocks from %s:%d\n", ntohl(vs->vs_info.vs_copy.vs_count),
+				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+		}
+		if (rx->fileopen && rx->srcfd >= 0) {
+			copy_blocks(rx, be64toh(vs->vs_info.vs_copy.vs_offset),
+				    ntohl(vs->vs_info.vs_copy.vs_block), ntohl(vs->vs_info.vs_copy.vs_count));
+		}
+		else {
+			fprintf(stderr, "vs_recv: COPY ignored (no old copy)\n");
+		}
+		break;
 	case VS_TYPE_END:
 		if (debug) {
 			fprintf(stderr, "vs_recv: END (%d bytes) from %s:%d\n",
 				len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		printf("vs_recv: received end of file \"%s\"\n", rx->name);
 		if (rx->fileopen) {
+			printf("vs_recv: received end of file \"%s\"\n", rx->name);
+			/* Writes may still be in flight */
+			if (event_pwrite_wait(rx->fd) < 0) {
+				perror("vs_recv: write");
+			}
+			/* Senders that predate digests send a bare END */
+			mismatch = len >= VS_MINLEN + sizeof(vs->vs_info.vs_digest) &&
+				ntohl(vs->vs_info.vs_digest) != rx->digest;
+			if (!mismatch) {
+				/* A resumed file may have been longer than the original */
+				if (rx->end == rx->size && fstat(rx->fd, &st) == 0 &&
+				    (u_int64_t)st.st_size > rx->size && ftruncate(rx->fd, rx->size) < 0) {
+					perror("vs_recv: ftruncate");
+				}
+			}
+			/* Only a file that was sent whole is ours to remove */
+			else if (rx->tmpname[0] != '\0' ||
+				 (!rx->resume && rx->start == 0 && rx->end == rx->size)) {
+				fprintf(stderr, "vs_recv: digest mismatch on \"%s\" (%08x, expected %08x), removed\n",
+					rx->name, rx->digest, ntohl(vs->vs_info.vs_digest));
+				unlink(rx->tmpname[0] != '\0' ? rx->tmpname : rx->name);
+			}
+			else if (rx->resume && rx->end == rx->size) {
+				fprintf(stderr, "vs_recv: digest mismatch on \"%s\" (%08x, expected %08x), "
+					"truncated to the %llu bytes it had\n", rx->name, rx->digest,
+					ntohl(vs->vs_info.vs_digest), (unsigned long long)rx->start);
+				if (ftruncate(rx->fd, rx->start) < 0)
+					perror("vs_recv: ftruncate");
+			}
+			else {
+				fprintf(stderr, "vs_recv: digest mismatch on bytes %llu-%llu of \"%s\" (%08x, expected %08x), "
+					"kept\n", (unsigned long long)rx->start, (unsigned long long)rx->end,
+					rx->name, rx->digest, ntohl(vs->vs_info.vs_digest));
+			}
 			close(rx->fd);
+			if (rx->srcfd >= 0)
+				close(rx->srcfd);
+			if (!mismatch && rx->tmpname[0] != '\0' && rename(rx->tmpname, rx->name) < 0) {
+				perror("vs_recv: rename");
+			}
 			rxdel(rx);
+			if (spincpu >= 0)
+				spin_report();
 		}
 		/* else ignore */
 		break;
@@ -290,3 +584,19 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 	}
 	return 0;
 }
+
+/*
+ * rudp_batch_receiver: callback function for the data received in our
+ * own buffers (-z); each piece is processed in place, then the buffer
+ * given back.
+ */
+
+int rudp_batch_receiver(rudp_socket_t rsocket, struct rudp_rxdesc *desc, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		rudp_receiver(rsocket, &desc[i].from, desc[i].data, desc[i].len);
+		rudp_release(rsocket, desc[i].buf);
+	}
+	return 0;
+}
@@ -2,6 +2,14 @@
  * vs_send: A simple RUDP sender that can be used to transfer files.
  * Arguments: destination address * (dot quadded or host.domain),  
  * remote port number, and a list of files
+ * Files are sent one after the other over one connection per peer.
+ * With -s, vs_send keeps running and takes further file names from a
+ * local control socket; with -i, connections stay open between jobs.
+ * With -r, receivers report how much of each file they already have and
+ * only the rest is sent; -R sends only a byte range of each file.
+ * With -D, the receiver signs the blocks of its old copy and only the
+ * differences are sent (rsync style). With -P n, a large file is split
+ * into n ranges sent in parallel over n connections to each peer.
  */
 
 #include <unistd.h>
@@ -10,24 +18,95 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
+#include <endian.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "rudp_api.h"
 #include "event.h"
 #include "vsftp.h"
+#include "crc32c.h"
+#include "delta.h"
 
 #define MAXPEERS 32			/* Max number of remote peers */
+#define MAXSTRIPES 16			/* Max number of connections per peer */
+#define STRIPE_MIN (64*1024)		/* Smallest range worth a connection of its own */
 #define MAXPEERNAMELEN 256		/* Max length of peer name */
+#define MAXJOBLEN 1024			/* Max length of a file name on the control socket */
+#define KEEPALIVE 10			/* Keepalive interval (s) for idle connections */
+#define THROTTLE 10			/* Pause (ms) of a sender near the memory ceiling */
+#define DELTA_HASHSIZE 65536		/* Buckets in the signature hash table */
+#define DELTA_HASH(weak) (((weak) ^ ((weak) >> 16)) & (DELTA_HASHSIZE - 1))
+
+/*
+ * Data structure for keeping track of a file being sent
+ */
+
+struct txfile {
+	struct txfile *next;		/* Next stripe of the same file */
+	int running;			/* First stripe: stripes still sending */
+	rudp_socket_t rsock;		/* RUDP socket for the transfer */
+	int fd;				/* File descriptor */
+	int (*sender)(int, void *);	/* filesender or deltasender, while throttled */
+	u_int32_t digest;		/* CRC32C of the data sent so far */
+	u_int64_t offset;		/* Next byte to send */
+	u_int64_t end;			/* End of the range to send */
+	u_int64_t resume;		/* Resume mode: least any peer has */
+	int answered[MAXPEERS];		/* Resume mode: peer has sent HAVE */
+	int waiting;			/* Resume and delta mode: peers yet to answer */
+	/* Delta mode; offset is the start of the window being matched */
+	u_int8_t *map;			/* The file, mapped */
+	u_int64_t size;			/* Size of the file */
+	u_int32_t blocksize;		/* Receiver's block size */
+	u_int32_t nblocks;		/* Blocks in the receiver's copy */
+	u_int32_t nsigs;		/* Signatures received so far */
+	struct vs_sig *sigs;		/* Signatures in host order, by block */
+	int *bucket;			/* First signature per hash bucket */
+	int *chain;			/* Next signature in the same bucket */
+	u_int32_t s1, s2;		/* Rolling checksum of the window */
+	int rolling;			/* s1 and s2 are valid */
+	u_int64_t literal;		/* First byte neither sent nor matched */
+	u_int64_t copyoff;		/* Pending COPY run: file offset */
+	u_int32_t copyblock;		/* Pending COPY run: first block */
+	u_int32_t copycount;		/* Pending COPY run: blocks */
+};
+
+/*
+ * Data structure for files waiting to be sent
+ */
+
+struct job {
+	struct job *next;		/* Next pointer for linked list */
+	char *filename;			/* File to send */
+};
+
 /* 
  * Prototypes 
  */
 
 int usage();
 int filesender(int fd, void *arg);
-void send_file(char *filename);
+int reply_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+void start_data(struct txfile *t);
+void stripe_done(struct txfile *t);
+int send_peers(struct vsftp *vs, int vslen, char *what);
+int delta_sigs(struct vsftp *vs, int len);
+int deltasender(int fd, void *arg);
+int throttle(struct txfile *t, int (*sender)(int, void *));
+int unthrottle(int fd, void *arg);
+int send_file(char *filename);
+void queue_file(char *filename);
+void send_next();
+static void close_sockets();
+int idle_close(int fd, void *arg);
+int ctl_receive(int fd, void *arg);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 
 /* 
@@ -35,15 +114,33 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
  */
 
 int debug = 0;				/* Debug flag */
+int fec = 0;				/* Data packets per FEC parity packet */
+int csum = 0;				/* Checksum RUDP packets */
+int idle = 0;				/* Seconds to keep connections open without jobs */
+int coalesce = 0;			/* Milliseconds messages may wait to share a packet */
+int resume = 0;				/* Skip data the receivers already have */
+int delta = 0;				/* Send differences to the receivers' copies */
+int nstripes = 1;			/* Connections per peer for one file */
+char *cc = NULL;			/* Congestion control algorithm */
+int uring = 0;				/* Use the io_uring event loop */
+int spincpu = -1;			/* Busy poll on this CPU */
+long memlimit = 0;			/* Memory ceiling of the RUDP layer in kbytes */
+u_int64_t range_start = 0;		/* Byte range of each file to send */
+u_int64_t range_end = (u_int64_t)-1;
+char *ctlpath = NULL;			/* Control socket for new jobs */
 struct sockaddr_in peers[MAXPEERS];	/* IP address and port */
 int npeers = 0;				/* Number of elements in peers */
+rudp_socket_t rsock[MAXSTRIPES];	/* Sockets shared by all transfers, one per stripe */
+struct txfile *tx = NULL;		/* Transfer in progress (its first stripe) */
+struct job *jobhead = NULL;		/* Files waiting to be sent */
+struct job **jobtail = &jobhead;
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_send [-d] host1:port1 [host2:port2] ... file1 [file2]... \n");
+	fprintf(stderr, "Usage: vs_send [-B cpu] [-d] [-c] [-f k] [-i idle] [-s ctlpath] [-r] [-R start-end] [-D] [-P n] [-C cc] [-b ms] [-M kbytes] [-u] host1:port1 [host2:port2] ... file1 [file2]... \n");
 	exit(1);
 }
 
@@ -54,16 +151,77 @@ int main(int argc, char* argv[]) {
 	struct in_addr *addr;
 	int c;
 	int i;
+	int ctlfd;
+	struct sockaddr_un ctladdr;
+	char *end;
 
 	/* 
 	 * Parse and collect arguments
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	while ((c = getopt(argc, argv, "B:b:cC:dDf:i:M:P:rR:s:u")) != -1) {
 		if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 'B') {
+			spincpu = atoi(optarg);
+			if (spincpu < 0)
+				usage();
+		}
+		else if (c == 'b') {
+			coalesce = atoi(optarg);
+		}
+		else if (c == 'c') {
+			csum = 1;
+		}
+		else if (c == 'C') {
+			cc = optarg;
+		}
+		else if (c == 'f') {
+			fec = atoi(optarg);
+		}
+		else if (c == 'i') {
+			idle = atoi(optarg);
+		}
+		else if (c == 'M') {
+			memlimit = atol(optarg);
+			if (memlimit <= 0)
+				usage();
+		}
+		else if (c == 's') {
+			ctlpath = optarg;
+		}
+		else if (c == 'r') {
+			resume = 1;
+		}
+		else if (c == 'D') {
+			delta = 1;
+		}
+		else if (c == 'u') {
+			uring = 1;
+		}
+		else if (c == 'P') {
+			nstripes = atoi(optarg);
+			if (nstripes < 1 || nstripes > MAXSTRIPES)
+				usage();
+		}
+		else if (c == 'R') {
+			/* start-end, start- or -end; strtoull would take signs */
+			end = optarg;
+			if (*end != '-') {
+				if (!isdigit((unsigned char)*end))
+					usage();
+				range_start = strtoull(end, &end, 0);
+			}
+			if (*end == '-' && *++end != '\0') {
+				if (!isdigit((unsigned char)*end))
+					usage();
+				range_end = strtoull(end, &end, 0);
+			}
+			if (*end != '\0' || range_end < range_start)
+				usage();
+		}
 		else 
 			usage();
 	}
@@ -101,17 +259,63 @@ int main(int argc, char* argv[]) {
 	/* Need at least one peer */
 	if (npeers == 0)
 		usage();
+	/* Signatures describe one receiver's copy */
+	if (delta && (npeers > 1 || resume || range_start > 0 || range_end != (u_int64_t)-1)) {
+		fprintf(stderr, "vs_send: -D takes one receiver and no -r or -R\n");
+		exit(1);
+	}
+	/* Resume and delta mode describe one contiguous stream */
+	if (nstripes > 1 && (resume || delta)) {
+		fprintf(stderr, "vs_send: -P cannot be combined with -r or -D\n");
+		exit(1);
+	}
 
-	if (optind >= argc) {
+	if (i >= argc && ctlpath == NULL) {
 		usage();
 	}
 
-	/* Launch senders for each file */
+	if (uring && event_backend("io_uring") < 0) {
+		fprintf(stderr, "vs_send: io_uring not available, using select\n");
+	}
+	else if (spincpu >= 0 && (event_backend("spin") < 0 || event_pin(spincpu) < 0)) {
+		fprintf(stderr, "vs_send: cannot busy poll on CPU %d\n", spincpu);
+		exit(1);
+	}
+
+	if (memlimit > 0)
+		rudp_set_memlimit(memlimit * 1024);
+
+	/* Jobs can be added at run time through a local datagram socket */
+	if (ctlpath) {
+		if ((ctlfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+			perror("vs_send: socket");
+			exit(1);
+		}
+		memset(&ctladdr, 0, sizeof(ctladdr));
+		ctladdr.sun_family = AF_UNIX;
+		strncpy(ctladdr.sun_path, ctlpath, sizeof(ctladdr.sun_path) - 1);
+		unlink(ctladdr.sun_path);
+		if (bind(ctlfd, (struct sockaddr *)&ctladdr, sizeof(ctladdr)) < 0) {
+			perror("vs_send: bind");
+			exit(1);
+		}
+		event_fd(ctlfd, ctl_receive, NULL, "ctl_receive");
+	}
+
+	/* Queue the files; they are sent one at a time */
 	while (i < argc) { 
-		send_file(argv[i++]);
+		queue_file(argv[i++]);
 	}
 
 	eventloop(0);
+	if (spincpu >= 0) {
+		unsigned long polls, idle;
+		double busy;
+
+		event_spin_stats(&polls, &idle, &busy);
+		printf("vs_send: spin: %lu polls, %lu idle, %.1f%% of the time busy\n",
+		       polls, idle, busy * 100);
+	}
 	return 0;
 }
 
@@ -142,34 +346,194 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 	return 0;
 }
 
+/*
+ * queue_file: add a file to the job queue, and start sending it if
+ * nothing else is in progress.
+ */
+
+void queue_file(char *filename) {
+	struct job *job;
+
+	if ((job = malloc(sizeof(struct job))) == NULL ||
+	    (job->filename = strdup(filename)) == NULL) {
+		fprintf(stderr, "vs_send: malloc failed\n");
+		exit(1);
+	}
+	job->next = NULL;
+	*jobtail = job;
+	jobtail = &job->next;
+	if (tx == NULL)
+		send_next();
+}
+
+/*
+ * send_next: start the next queued file. When the queue is empty, close
+ * the connections, either now or after they have been idle for a while.
+ */
+
+void send_next() {
+	struct job *job;
+	struct timeval t;
+
+	event_timeout_delete(idle_close, NULL);
+	while (tx == NULL && (job = jobhead) != NULL) {
+		jobhead = job->next;
+		if (jobhead == NULL)
+			jobtail = &jobhead;
+		send_file(job->filename);
+		free(job->filename);
+		free(job);
+	}
+	if (tx != NULL || rsock[0] == NULL)
+		return;
+	if (idle > 0) {
+		event_gettime(&t);
+		t.tv_sec += idle;
+		event_timeout(t, idle_close, NULL, "idle_close");
+	}
+	else {
+		close_sockets();
+	}
+}
+
+/*
+ * close_sockets: close the RUDP sockets of all stripes.
+ */
+
+static void close_sockets() {
+	int i;
+
+	for (i = 0; i < MAXSTRIPES; i++) {
+		if (rsock[i] != NULL) {
+			rudp_close(rsock[i]);
+			rsock[i] = NULL;
+		}
+	}
+}
+
+/*
+ * idle_close: timer callback, close connections that had no job for
+ * the idle period. The next job opens new ones.
+ */
+
+int idle_close(int fd, void *arg) {
+	if (tx == NULL && rsock[0] != NULL) {
+		if (debug) {
+			fprintf(stderr, "vs_send: closing idle connections\n");
+		}
+		close_sockets();
+	}
+	return 0;
+}
+
+/*
+ * ctl_receive: callback for the control socket. Each datagram is the
+ * name of a file to send.
+ */
+
+int ctl_receive(int fd, void *arg) {
+	char buf[MAXJOBLEN + 1];
+	int len;
+
+	if ((len = recv(fd, buf, MAXJOBLEN, 0)) < 0) {
+		perror("vs_send: recv");
+		return 0;
+	}
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\0'))
+		len--;
+	buf[len] = '\0';
+	if (len > 0)
+		queue_file(buf);
+	return 0;
+}
+
+/*
+ * open_socket: create the RUDP socket for a stripe.
+ */
+
+static rudp_socket_t open_socket() {
+	rudp_socket_t rs;
+
+	if ((rs = rudp_socket(0)) == NULL) {
+		fprintf(stderr, "vs_send: rudp_socket() failed\n");
+		exit(1);
+	}
+	rudp_event_handler(rs, eventhandler);
+	rudp_recvfrom_handler(rs, reply_receiver);
+	if (fec > 0 && rudp_set_fec(rs, fec) < 0) {
+		fprintf(stderr, "vs_send: bad FEC group size %d\n", fec);
+		exit(1);
+	}
+	if (cc != NULL && rudp_set_cc(rs, cc) < 0) {
+		fprintf(stderr, "vs_send: unknown congestion control \"%s\"\n", cc);
+		exit(1);
+	}
+	if (csum)
+		rudp_set_checksum(rs, 1);
+	if (idle > 0)
+		rudp_set_keepalive(rs, KEEPALIVE);
+	if (coalesce > 0)
+		rudp_set_coalesce(rs, coalesce);
+	return rs;
+}
+
 /*
  * send_file: initiate sending of a file. 
- * Create a RUDP socket for sending. Send the file name to the VS receiver.
+ * Create the RUDP sockets for sending if there are none. Split the range
+ * to send into stripes and send the file name, with the stripe's range,
+ * to the VS receivers over each stripe's socket.
  * Register a handler for input event, which will take care of sending
  * file data
  */
 
-void send_file(char *filename) {
+int send_file(char *filename) {
 	struct vsftp vs;
+	struct stat st;
+	struct txfile *t, **tp;
 	int vslen;
 	char *filename1;
 	int namelen;
 	int file = 0;
-	int p;
-	rudp_socket_t rsock;
+	int p, i, n;
+	u_int64_t start, end, chunk;
+	u_int8_t *map;
 
 	if ((file = open(filename, O_RDONLY)) < 0) {
 		perror("vs_sender: open");
-		exit(-1);
+		if (ctlpath == NULL)
+			exit(-1);
+		return -1;
 	}
-	rsock = rudp_socket(0);
-	if (rsock == NULL) {
-		fprintf(stderr, "vs_send: rudp_socket() failed\n");
-		exit(1);
+	if (fstat(file, &st) < 0) {
+		perror("vs_sender: fstat");
+		close(file);
+		return -1;
+	}
+	end = range_end < (u_int64_t)st.st_size ? range_end : (u_int64_t)st.st_size;
+	start = range_start < end ? range_start : end;
+	map = NULL;
+	if (delta && st.st_size > 0 &&
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0)) == MAP_FAILED) {
+		perror("vs_sender: mmap");
+		close(file);
+		return -1;
+	}
+
+	/* Small files do not need all the stripes */
+	n = (end - start) / STRIPE_MIN;
+	if (n > nstripes)
+		n = nstripes;
+	if (n < 1)
+		n = 1;
+	chunk = (end - start + n - 1) / n;
+	for (i = 0; i < n; i++) {
+		if (rsock[i] == NULL)
+			rsock[i] = open_socket();
 	}
-	rudp_event_handler(rsock, eventhandler);
 
 	vs.vs_type = htonl(VS_TYPE_BEGIN);
+	vs.vs_info.vs_begin.vs_flags = htonl(resume ? VS_FLAG_RESUME : delta ? VS_FLAG_DELTA : 0);
+	vs.vs_info.vs_begin.vs_size = htobe64(st.st_size);
 
 	/* strip of any leading path name */
 	filename1 = filename;
@@ -178,76 +542,466 @@ void send_file(char *filename) {
 	
 	/* Copy file name into VS data */
 	namelen = strlen(filename1) < VS_FILENAMELENGTH  ? strlen(filename1) : VS_FILENAMELENGTH;
-	strncpy(vs.vs_info.vs_filename, filename1, namelen);
+	strncpy(vs.vs_info.vs_begin.vs_filename, filename1, namelen);
 
-	vslen = sizeof(vs.vs_type) + namelen;
-	for (p = 0; p < npeers; p++) {
-		if (debug) {
-			fprintf(stderr, "vs_send: send BEGIN \"%s\" (%d bytes) to %s:%d\n",
-				filename, vslen, 
-				inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
+	vslen = VS_BEGINLEN + namelen;
+	tp = &tx;
+	for (i = 0; i < n; i++) {
+		if ((t = malloc(sizeof(struct txfile))) == NULL) {
+			fprintf(stderr, "vs_send: malloc failed\n");
+			exit(1);
 		}
-		if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-			fprintf(stderr,"rudp_sender: send failure\n");
-			rudp_close(rsock);		
-			return;
+		memset(t, 0, sizeof(struct txfile));
+		t->rsock = rsock[i];
+		t->fd = file;
+		t->digest = 0;
+		t->offset = start + i * chunk;
+		t->end = i == n - 1 ? end : start + (i + 1) * chunk;
+		*tp = t;
+		tp = &t->next;
+		vs.vs_info.vs_begin.vs_start = htobe64(t->offset);
+		vs.vs_info.vs_begin.vs_end = htobe64(t->end);
+		for (p = 0; p < npeers; p++) {
+			if (debug) {
+				fprintf(stderr, "vs_send: send BEGIN \"%s\" (%d bytes) to %s:%d\n",
+					filename, vslen, 
+					inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
+			}
+			if (rudp_sendto(rsock[i], (char *) &vs, vslen, &peers[p]) < 0) {
+				fprintf(stderr,"rudp_sender: send failure\n");
+				if (map)
+					munmap(map, st.st_size);
+				close(file);
+				while ((t = tx) != NULL) {
+					tx = t->next;
+					free(t);
+				}
+				return -1;
+			}
 		}
 	}
-	event_fd(file, filesender, rsock, "filesender");
+	tx->running = n;
+	tx->resume = end;
+	tx->waiting = resume || delta ? npeers : 0;
+	tx->map = map;
+	tx->size = st.st_size;
+	if (tx->waiting == 0) {
+		for (t = tx; t != NULL; t = t->next)
+			start_data(t);
+	}
+	else
+		rudp_flush(tx->rsock);	/* Don't hold back what the replies wait for */
+	return 0;
+}
+
+/*
+ * start_data: register the file sender for a stripe.
+ */
+
+void start_data(struct txfile *t) {
+	event_fd(t->fd, filesender, t, "filesender");
+}
+
+/*
+ * stripe_done: a stripe has sent its range. Once all have, the file is
+ * done and the next job starts.
+ */
+
+void stripe_done(struct txfile *t) {
+	event_fd_delete(filesender, t);
+	event_timeout_delete(unthrottle, t);
+	if (--tx->running > 0)
+		return;
+	close(tx->fd);
+	while ((t = tx) != NULL) {
+		tx = t->next;
+		free(t);
+	}
+	send_next();
+}
+
+/*
+ * reply_receiver: callback for messages from the VS receivers.
+ * In resume mode each receiver answers BEGIN with how much of the file
+ * it has; once all have answered, sending starts from the smallest.
+ * In delta mode the receiver answers with the signatures of its copy.
+ */
+
+int reply_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+	struct vsftp *vs = (struct vsftp *) buf;
+	u_int64_t have;
+	int p;
+
+	if (len >= VS_SIGSLEN && ntohl(vs->vs_type) == VS_TYPE_SIGS) {
+		if (delta && tx != NULL && tx->waiting > 0)
+			delta_sigs(vs, len);
+		return 0;
+	}
+	if (len < VS_MINLEN + sizeof(vs->vs_info.vs_have) || ntohl(vs->vs_type) != VS_TYPE_HAVE) {
+		fprintf(stderr, "vs_send: unexpected message (%d bytes) from %s:%d\n",
+			len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+		return 0;
+	}
+	if (tx == NULL || tx->waiting == 0 || !resume)
+		return 0;
+	for (p = 0; p < npeers; p++) {
+		if (peers[p].sin_addr.s_addr == remote->sin_addr.s_addr &&
+		    peers[p].sin_port == remote->sin_port)
+			break;
+	}
+	if (p == npeers || tx->answered[p])
+		return 0;
+	tx->answered[p] = 1;
+	have = be64toh(vs->vs_info.vs_have);
+	if (debug) {
+		fprintf(stderr, "vs_send: HAVE %llu bytes at %s:%d\n", (unsigned long long)have,
+			inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+	}
+	if (have < tx->offset)
+		have = tx->offset;
+	if (have < tx->resume)
+		tx->resume = have;
+	if (--tx->waiting == 0) {
+		tx->offset = tx->resume;
+		start_data(tx);
+	}
+	return 0;
+}
+
+/*
+ * throttle: the RUDP layer holds three quarters of its memory ceiling.
+ * Stop reading the file for THROTTLE ms, so that acknowledgements free
+ * what is in flight while END and other messages still fit. Returns 1 if
+ * the sender is to return at once.
+ */
+
+int throttle(struct txfile *t, int (*sender)(int, void *)) {
+	struct timeval now, delay, t1;
+
+	if (memlimit == 0 || rudp_memused() < memlimit * 1024 / 4 * 3)
+		return 0;
+	event_fd_delete(sender, t);
+	t->sender = sender;
+	delay.tv_sec = 0;
+	delay.tv_usec = THROTTLE * 1000;
+	event_gettime(&now);
+	timeradd(&now, &delay, &t1);
+	event_timeout(t1, unthrottle, t, "unthrottle");
+	return 1;
+}
+
+/*
+ * unthrottle: timer callback, register the throttled sender again.
+ */
+
+int unthrottle(int fd, void *arg) {
+	struct txfile *t = (struct txfile *) arg;
+
+	event_fd(t->fd, t->sender, t, "sender");
+	return 0;
 }
 
 /*
  * filesender: callback function for handling sending of the file.
  * Will be called when data is available on the file (which is always
  * true, until the file is closed...). 
- * Send file data. Detect end of file and tell VS peers that transfer is
- * complete
+ * Send the stripe's file data. Detect end of the stripe and tell VS peers
+ * that it is complete, along with a digest of its contents
  */
 
 int filesender(int file, void *arg) {
-    rudp_socket_t rsock = 	(rudp_socket_t) arg;
+    struct txfile *t = (struct txfile *) arg;
     int bytes;
     struct vsftp vs;
     int vslen;
     int p;
 
-    bytes = read(file, &vs.vs_info.vs_data,VS_MAXDATA);
+    if (throttle(t, filesender))
+	return 0;
+    bytes = t->end - t->offset < VS_MAXDATA ? t->end - t->offset : VS_MAXDATA;
+    if (bytes > 0)
+	bytes = pread(file, &vs.vs_info.vs_data.vs_data, bytes, t->offset);
     if (bytes < 0) {
 	perror("filesender: read");
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
+	stripe_done(t);
     }
     else if (bytes == 0) {
 	vs.vs_type = htonl(VS_TYPE_END);
-	vslen = sizeof(vs.vs_type);
+	vs.vs_info.vs_digest = htonl(t->digest);
+	vslen = sizeof(vs.vs_type) + sizeof(vs.vs_info.vs_digest);
 	for (p = 0; p < npeers; p++) {
 	    if (debug) {
 		fprintf(stderr, "vs_send: send END (%d bytes) to %s:%d\n", 
 			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
 	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
+	    if (rudp_sendto(t->rsock, (char *) &vs, vslen, &peers[p]) < 0) {
 		fprintf(stderr,"rudp_sender: send failure\n");
 		break;
 	    }
 	}
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
+	stripe_done(t);
     }
     else {
+	t->digest = crc32c(t->digest, vs.vs_info.vs_data.vs_data, bytes);
 	vs.vs_type = htonl(VS_TYPE_DATA);
-	vslen = sizeof(vs.vs_type) + bytes;
-	for (p = 0; p < npeers; p++) {
-	    if (debug) {
+	vs.vs_info.vs_data.vs_offset = htobe64(t->offset);
+	t->offset += bytes;
+	vslen = VS_DATALEN + bytes;
+	if (debug) {
+	    for (p = 0; p < npeers; p++)
 		fprintf(stderr, "vs_send: send DATA (%d bytes) to %s:%d\n", 
 			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));				
-	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-		fprintf(stderr,"rudp_sender: send failure\n");
-		event_fd_delete(filesender, rsock);
-		rudp_close(rsock);		
-		break;
-	    }
+	}
+	/* One copy of the block, shared by all the receivers */
+	if (rudp_sendto_group(t->rsock, (char *) &vs, vslen, peers, npeers) < 0) {
+	    fprintf(stderr,"rudp_sender: send failure\n");
+	    stripe_done(t);
 	}
     }
     return 0;
 }
+
+/*
+ * send_peers: send one VSFTP message to all VS receivers.
+ */
+
+int send_peers(struct vsftp *vs, int vslen, char *what) {
+	int p;
+
+	if (debug) {
+		for (p = 0; p < npeers; p++)
+			fprintf(stderr, "vs_send: send %s (%d bytes) to %s:%d\n",
+				what, vslen, inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
+	}
+	if (rudp_sendto_group(tx->rsock, (char *) vs, vslen, peers, npeers) < 0) {
+		fprintf(stderr,"rudp_sender: send failure\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * delta_start: index the receiver's signatures by weak checksum and
+ * register the delta sender.
+ */
+
+static void delta_start() {
+	u_int32_t i;
+	int h;
+
+	if (tx->nblocks > 0) {
+		if ((tx->bucket = malloc(DELTA_HASHSIZE * sizeof(int))) == NULL ||
+		    (tx->chain = malloc(tx->nblocks * sizeof(int))) == NULL) {
+			fprintf(stderr, "vs_send: malloc failed\n");
+			exit(1);
+		}
+		memset(tx->bucket, 0xff, DELTA_HASHSIZE * sizeof(int));
+		/* Backwards, so each bucket lists the lowest block first */
+		for (i = tx->nblocks; i-- > 0; ) {
+			h = DELTA_HASH(tx->sigs[i].vs_weak);
+			tx->chain[i] = tx->bucket[h];
+			tx->bucket[h] = i;
+		}
+	}
+	tx->offset = 0;
+	tx->literal = 0;
+	event_fd(tx->fd, deltasender, tx, "deltasender");
+}
+
+/*
+ * delta_sigs: collect the signatures from a SIGS message. Sending starts
+ * once the signatures of all blocks are in.
+ */
+
+int delta_sigs(struct vsftp *vs, int len) {
+	u_int32_t blocksize = ntohl(vs->vs_info.vs_sigs.vs_blocksize);
+	u_int32_t nblocks = ntohl(vs->vs_info.vs_sigs.vs_nblocks);
+	u_int32_t first = ntohl(vs->vs_info.vs_sigs.vs_first);
+	u_int32_t count = ntohl(vs->vs_info.vs_sigs.vs_count);
+	u_int32_t i;
+
+	if (count > VS_MAXSIGS || len < VS_SIGSLEN + count * sizeof(struct vs_sig) ||
+	    first > nblocks || count > nblocks - first || (nblocks > 0 && blocksize == 0) ||
+	    (tx->sigs != NULL && (nblocks != tx->nblocks || blocksize != tx->blocksize))) {
+		fprintf(stderr, "vs_send: bad SIGS message (%d bytes)\n", len);
+		return -1;
+	}
+	if (tx->sigs == NULL) {
+		tx->blocksize = blocksize;
+		tx->nblocks = nblocks;
+		if (debug) {
+			fprintf(stderr, "vs_send: receiver has %u blocks of %u bytes\n", nblocks, blocksize);
+		}
+		if ((tx->sigs = malloc((nblocks + 1) * sizeof(struct vs_sig))) == NULL) {
+			fprintf(stderr, "vs_send: malloc failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		tx->sigs[first + i].vs_weak = ntohl(vs->vs_info.vs_sigs.vs_sig[i].vs_weak);
+		tx->sigs[first + i].vs_strong = be64toh(vs->vs_info.vs_sigs.vs_sig[i].vs_strong);
+	}
+	tx->nsigs += count;
+	if (tx->nsigs >= tx->nblocks) {
+		tx->waiting = 0;
+		delta_start();
+	}
+	return 0;
+}
+
+/*
+ * delta_copy: send the pending COPY run, if any.
+ */
+
+static int delta_copy() {
+	struct vsftp vs;
+
+	if (tx->copycount == 0)
+		return 0;
+	vs.vs_type = htonl(VS_TYPE_COPY);
+	vs.vs_info.vs_copy.vs_offset = htobe64(tx->copyoff);
+	vs.vs_info.vs_copy.vs_block = htonl(tx->copyblock);
+	vs.vs_info.vs_copy.vs_count = htonl(tx->copycount);
+	tx->copycount = 0;
+	return send_peers(&vs, VS_COPYLEN, "COPY");
+}
+
+/*
+ * delta_literal: send up to VS_MAXDATA bytes of unmatched data, from
+ * tx->literal up to upto, after the COPY run that precedes them.
+ */
+
+static int delta_literal(u_int64_t upto) {
+	struct vsftp vs;
+	int bytes;
+
+	if (delta_copy() < 0)
+		return -1;
+	bytes = upto - tx->literal < VS_MAXDATA ? upto - tx->literal : VS_MAXDATA;
+	vs.vs_type = htonl(VS_TYPE_DATA);
+	vs.vs_info.vs_data.vs_offset = htobe64(tx->literal);
+	memcpy(vs.vs_info.vs_data.vs_data, tx->map + tx->literal, bytes);
+	tx->literal += bytes;
+	return send_peers(&vs, VS_DATALEN + bytes, "DATA");
+}
+
+/*
+ * delta_done: release the file and the signatures and go on with the
+ * next job.
+ */
+
+static void delta_done() {
+	event_fd_delete(deltasender, tx);
+	event_timeout_delete(unthrottle, tx);
+	if (tx->map)
+		munmap(tx->map, tx->size);
+	free(tx->sigs);
+	free(tx->bucket);
+	free(tx->chain);
+	close(tx->fd);
+	free(tx);
+	tx = NULL;
+	send_next();
+}
+
+/*
+ * deltasender: callback that replaces filesender in delta mode.
+ * Slides a window of one block over the file. Where the window matches a
+ * block of the receiver's copy, it becomes part of a COPY run and the
+ * window jumps past it; otherwise the window moves on by one byte and
+ * the byte it leaves becomes literal data. Each call sends at most a few
+ * messages and returns to the event loop.
+ */
+
+int deltasender(int file, void *arg) {
+	struct vsftp vs;
+	u_int32_t bs = tx->blocksize;
+	u_int8_t *window;
+	u_int32_t weak;
+	u_int64_t strong = 0;
+	int strongok;
+	int i;
+
+	if (throttle(tx, deltasender))
+		return 0;
+	for (;;) {
+		if (tx->nblocks == 0 || tx->offset + bs > tx->size) {
+			/* No whole block left to match */
+			if (tx->literal < tx->size) {
+				if (delta_literal(tx->size) < 0)
+					delta_done();
+				return 0;
+			}
+			if (delta_copy() == 0) {
+				vs.vs_type = htonl(VS_TYPE_END);
+				vs.vs_info.vs_digest = htonl(tx->size > 0 ? crc32c(0, tx->map, tx->size) : 0);
+				send_peers(&vs, sizeof(vs.vs_type) + sizeof(vs.vs_info.vs_digest), "END");
+			}
+			delta_done();
+			return 0;
+		}
+		window = tx->map + tx->offset;
+		if (!tx->rolling) {
+			delta_sums(window, bs, &tx->s1, &tx->s2);
+			tx->rolling = 1;
+		}
+		weak = DELTA_WEAK(tx->s1, tx->s2);
+		strongok = 0;
+		/* The block after the current run is the likeliest match */
+		i = -1;
+		if (tx->copycount > 0 && tx->copyoff + (u_int64_t)tx->copycount * bs == tx->offset &&
+		    tx->copyblock + tx->copycount < tx->nblocks &&
+		    tx->sigs[tx->copyblock + tx->copycount].vs_weak == weak) {
+			strong = delta_strong(window, bs);
+			strongok = 1;
+			if (tx->sigs[tx->copyblock + tx->copycount].vs_strong == strong)
+				i = tx->copyblock + tx->copycount;
+		}
+		if (i < 0) {
+			for (i = tx->bucket[DELTA_HASH(weak)]; i >= 0; i = tx->chain[i]) {
+				if (tx->sigs[i].vs_weak != weak)
+					continue;
+				if (!strongok) {
+					strong = delta_strong(window, bs);
+					strongok = 1;
+				}
+				if (tx->sigs[i].vs_strong == strong)
+					break;
+			}
+		}
+		if (i >= 0) {
+			/* Less than VS_MAXDATA bytes of literal data can be pending */
+			if (tx->literal < tx->offset && delta_literal(tx->offset) < 0) {
+				delta_done();
+				return 0;
+			}
+			if (tx->copycount > 0 && tx->copyoff + (u_int64_t)tx->copycount * bs == tx->offset &&
+			    tx->copyblock + tx->copycount == i) {
+				tx->copycount++;
+			}
+			else {
+				if (delta_copy() < 0) {
+					delta_done();
+					return 0;
+				}
+				tx->copyoff = tx->offset;
+				tx->copyblock = i;
+				tx->copycount = 1;
+			}
+			tx->offset += bs;
+			tx->literal = tx->offset;
+			tx->rolling = 0;
+			return 0;
+		}
+		if (tx->offset + bs < tx->size)
+			delta_roll(&tx->s1, &tx->s2, window[0], window[bs], bs);
+		else
+			tx->rolling = 0;
+		tx->offset++;
+		if (tx->offset - tx->literal == VS_MAXDATA) {
+			if (delta_literal(tx->offset) < 0)
+				delta_done();
+			return 0;
+		}
+	}
+}
@@ -5,11 +5,66 @@
 #define VS_TYPE_BEGIN	1
 #define VS_TYPE_DATA	2
 #define VS_TYPE_END 	3
+#define VS_TYPE_HAVE	4	/* Receiver to sender: bytes of the file already present */
+#define VS_TYPE_SIGS	5	/* Receiver to sender: block signatures of its copy */
+#define VS_TYPE_COPY	6	/* Sender to receiver: blocks of the old copy to reuse */
+
+#define VS_FLAG_RESUME	1	/* BEGIN: wait for HAVE and skip what the receiver has */
+#define VS_FLAG_DELTA	2	/* BEGIN: wait for SIGS and send only the differences */
+
+#define VS_MAXSIGS	64	/* Block signatures per SIGS message */
+
+/*
+ * 64-bit fields are in network byte order (htobe64/be64toh).
+ * BEGIN announces the file and the byte range [vs_start, vs_end) that
+ * follows; DATA carries the file offset of its bytes; END carries a
+ * CRC32C of the bytes sent.
+ *
+ * In delta mode the receiver answers BEGIN with the signatures of the
+ * whole blocks of its copy, spread over SIGS messages. The sender then
+ * rebuilds the file from COPY messages, which reuse runs of the
+ * receiver's blocks, and DATA messages for everything else; the receiver
+ * builds the result in a temporary file and renames it over its copy
+ * once the END digest matches.
+ */
+
+struct vs_sig {
+	u_int32_t vs_weak;		/* Rolling checksum */
+	u_int64_t vs_strong;		/* Strong hash */
+} __attribute__ ((packed));
 
 struct vsftp {
 	u_int32_t vs_type;
 	union {
-		char vs_filename[VS_FILENAMELENGTH];
-		u_int8_t vs_data[VS_MAXDATA];
+		struct {
+			u_int32_t vs_flags;	/* VS_FLAG_* */
+			u_int64_t vs_size;	/* Total size of the file */
+			u_int64_t vs_start;	/* First byte to be sent */
+			u_int64_t vs_end;	/* End of the range to be sent */
+			char vs_filename[VS_FILENAMELENGTH];
+		} __attribute__ ((packed)) vs_begin;
+		struct {
+			u_int64_t vs_offset;	/* File offset of vs_data */
+			u_int8_t vs_data[VS_MAXDATA];
+		} __attribute__ ((packed)) vs_data;
+		struct {
+			u_int32_t vs_blocksize;	/* Bytes per block */
+			u_int32_t vs_nblocks;	/* Blocks in the receiver's copy */
+			u_int32_t vs_first;	/* Block number of vs_sig[0] */
+			u_int32_t vs_count;	/* Signatures in this message */
+			struct vs_sig vs_sig[VS_MAXSIGS];
+		} __attribute__ ((packed)) vs_sigs;
+		struct {
+			u_int64_t vs_offset;	/* File offset to write at */
+			u_int32_t vs_block;	/* First block of the receiver's copy */
+			u_int32_t vs_count;	/* Number of blocks */
+		} __attribute__ ((packed)) vs_copy;
+		u_int32_t vs_digest;	/* END: CRC32C of the bytes sent */
+		u_int64_t vs_have;	/* HAVE: length of the file at the receiver */
 	} vs_info;
-};
+} __attribute__ ((packed));
+
+#define VS_BEGINLEN	(sizeof(u_int32_t) + 3 * sizeof(u_int64_t) + sizeof(u_int32_t))
+#define VS_DATALEN	(sizeof(u_int32_t) + sizeof(u_int64_t))
+#define VS_SIGSLEN	(5 * sizeof(u_int32_t))
+#define VS_COPYLEN	(3 * sizeof(u_int32_t) + sizeof(u_int64_t))